@@ -0,0 +1,395 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Microbenchmarks for the cropper subroutines
+ *
+ * Usage: CropperBench [corpusdir]
+ *
+ * A synthetic corpus of radar-like images, a map description and a
+ * coordinate database is generated into the given directory unless
+ * it already exists. The results are printed as JSON so that they
+ * can be compared between builds.
+ *
+ * Each iteration runs in its own request arena like a real request.
+ * The heap and arena allocations of a single iteration are reported
+ * alongside the times.
+ */
+// ======================================================================
+
+#include "CropperArena.h"
+#include "CropperException.h"
+#include "CropperResample.h"
+#include "CropperTools.h"
+#include "WebAuthenticator.h"
+
+#include <imagine/NFmiImage.h>
+#include <newbase/NFmiFileSystem.h>
+#include <newbase/NFmiSettings.h>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Count the heap allocations for the allocations per operation
+
+atomic<long> heap_allocations{0};
+
+void* operator new(size_t theSize)
+{
+  ++heap_allocations;
+  if (void* ptr = malloc(theSize > 0 ? theSize : 1))
+    return ptr;
+  throw bad_alloc();
+}
+
+void operator delete(void* thePtr) noexcept
+{
+  free(thePtr);
+}
+
+void operator delete(void* thePtr, size_t theSize) noexcept
+{
+  free(thePtr);
+}
+
+namespace
+{
+// Synthetic radar composite size, roughly that of the Finnish composite
+const int image_width = 1000;
+const int image_height = 1200;
+
+// Minimum time spent on each benchmark
+const double min_seconds = 0.25;
+
+// Sink for results so that the optimizer cannot remove the work
+volatile long sink = 0;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A benchmark result
+ */
+// ----------------------------------------------------------------------
+
+struct Result
+{
+  string name;
+  long iterations;
+  double ns_per_op;
+  long heap_allocs;   // heap allocations per operation
+  long arena_allocs;  // arena allocations per operation
+};
+
+vector<Result> results;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Run the function repeatedly until enough time has elapsed
+ */
+// ----------------------------------------------------------------------
+
+template <typename Function>
+void run(const string& theName, Function theFunction)
+{
+  theFunction();  // warm up caches
+
+  Result result;
+  {
+    const long heap = heap_allocations;
+    RequestArena arena;
+    theFunction();
+    result.heap_allocs = heap_allocations - heap;
+    result.arena_allocs = arena.allocations();
+  }
+
+  long n = 1;
+  double seconds = 0;
+  for (;;)
+  {
+    const auto start = chrono::steady_clock::now();
+    for (long i = 0; i < n; i++)
+    {
+      RequestArena arena;
+      theFunction();
+    }
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (seconds >= min_seconds || n >= (1L << 30))
+      break;
+    n *= 2;
+  }
+
+  result.name = theName;
+  result.iterations = n;
+  result.ns_per_op = 1e9 * seconds / n;
+  results.push_back(result);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Deterministic pseudo random numbers in the range 0-1
+ */
+// ----------------------------------------------------------------------
+
+double random01()
+{
+  static unsigned long state = 12345;
+  state = state * 6364136223846793005UL + 1442695040888963407UL;
+  return (state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Generate a radar-like image
+ *
+ * The background alternates smoothly between land and sea colours,
+ * precipitation cells are gaussian blobs coloured with a typical
+ * reflectivity scale.
+ */
+// ----------------------------------------------------------------------
+
+void make_radar_image(const string& theFile)
+{
+  using namespace Imagine::NFmiColorTools;
+
+  const Color scale[] = {MakeColor(190, 230, 250),
+                         MakeColor(110, 190, 240),
+                         MakeColor(40, 140, 220),
+                         MakeColor(40, 200, 80),
+                         MakeColor(250, 240, 60),
+                         MakeColor(250, 150, 30),
+                         MakeColor(220, 30, 30),
+                         MakeColor(180, 30, 180)};
+  const int ncolors = sizeof(scale) / sizeof(*scale);
+
+  struct Cell
+  {
+    double x, y, r, v;
+  };
+  vector<Cell> cells;
+  for (int i = 0; i < 60; i++)
+  {
+    Cell c;
+    c.x = random01() * image_width;
+    c.y = random01() * image_height;
+    c.r = 10 + random01() * 60;
+    c.v = 0.5 + random01() * ncolors;
+    cells.push_back(c);
+  }
+
+  Imagine::NFmiImage image(image_width, image_height);
+  for (int j = 0; j < image_height; j++)
+    for (int i = 0; i < image_width; i++)
+    {
+      double value = 0;
+      for (const Cell& c : cells)
+      {
+        const double dx = (i - c.x) / c.r;
+        const double dy = (j - c.y) / c.r;
+        const double d2 = dx * dx + dy * dy;
+        if (d2 < 9)
+          value += c.v * exp(-d2);
+      }
+      const int k = static_cast<int>(value);
+      if (k > 0)
+        image(i, j) = scale[min(k, ncolors) - 1];
+      else if (sin(i / 90.0) + cos(j / 70.0) > 0.3)
+        image(i, j) = MakeColor(235, 235, 220);
+      else
+        image(i, j) = MakeColor(215, 225, 235);
+    }
+
+  image.Write(theFile, "png");
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Generate a legend image
+ */
+// ----------------------------------------------------------------------
+
+void make_legend_image(const string& theFile)
+{
+  using namespace Imagine::NFmiColorTools;
+
+  Imagine::NFmiImage image(40, 120);
+  for (int j = 0; j < image.Height(); j++)
+    for (int i = 0; i < image.Width(); i++)
+      image(i, j) = MakeColor(255 * j / image.Height(), 100, 255 - 255 * j / image.Height(), 20);
+  image.Write(theFile, "png");
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Generate the corpus unless it already exists
+ */
+// ----------------------------------------------------------------------
+
+void make_corpus(const string& theDir)
+{
+  if (!NFmiFileSystem::CreateDirectory(theDir + "/maps/bench/radar") ||
+      !NFmiFileSystem::CreateDirectory(theDir + "/labels") ||
+      !NFmiFileSystem::CreateDirectory(theDir + "/cache"))
+    throw runtime_error("Failed to create corpus directory '" + theDir + "'");
+
+  const string obsfile = theDir + "/201901011200_bench_radar.png";
+  const string forfile = theDir + "/201901011200_201901011300_bench_radar.png";
+  if (!NFmiFileSystem::FileExists(obsfile))
+    make_radar_image(obsfile);
+  if (!NFmiFileSystem::FileExists(forfile))
+    make_radar_image(forfile);
+  if (!NFmiFileSystem::FileExists(theDir + "/legend.png"))
+    make_legend_image(theDir + "/legend.png");
+
+  ofstream area((theDir + "/maps/bench/radar/area.cnf").c_str());
+  area << "# Synthetic map for benchmarks" << endl
+       << "projection stereographic,20,90,60:6,51.3,49,70.2:" << image_width << ","
+       << image_height << endl;
+
+  ofstream coords((theDir + "/coordinates.txt").c_str());
+  coords << "Helsinki\t60.17\t24.94" << endl
+         << "Turku\t60.45\t22.27" << endl
+         << "Tampere\t61.50\t23.76" << endl
+         << "Oulu\t65.01\t25.47" << endl
+         << "Rovaniemi\t66.50\t25.73" << endl;
+
+  ofstream labels((theDir + "/labels/bench_cities.txt").c_str());
+  labels << "# Synthetic label set for benchmarks" << endl
+         << "Helsinki,24.94,60.17" << endl
+         << "Turku,22.27,60.45" << endl
+         << "Tampere,23.76,61.50" << endl
+         << "Oulu,25.47,65.01" << endl
+         << "Rovaniemi,25.73,66.50" << endl;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Run all the benchmarks
+ */
+// ----------------------------------------------------------------------
+
+void run_benchmarks(const string& corpus)
+{
+  make_corpus(corpus);
+
+  NFmiSettings::Set("cropper::cachedir", corpus + "/cache", true);
+  NFmiSettings::Set("cropper::mapsdir", corpus + "/maps", true);
+  NFmiSettings::Set("cropper::coordinates", corpus + "/coordinates.txt", true);
+  NFmiSettings::Set("cropper::labelsdir", corpus + "/labels", true);
+  set_timezone("Europe/Helsinki");
+
+  const string obsfile = corpus + "/201901011200_bench_radar.png";
+  const string forfile = corpus + "/201901011200_201901011300_bench_radar.png";
+  const Imagine::NFmiImage source(obsfile);
+
+  int x, y, w, h, xoff, yoff;
+
+  // Option parsing
+
+  run("parse_query",
+      [&]()
+      {
+        const Options options(
+            "f=radar.png&p=500x400+Helsinki:bench/radar&T=-5,-5,%25H:%25M&L=Helsinki,24.94,60.17");
+        sink += options.size();
+      });
+  run("parse_geometry", [&]() { parse_geometry("500x400+120+340", x, y, w, h); });
+  run("parse_center_geometry", [&]() { parse_center_geometry("500x400+500+600", x, y, w, h); });
+  run("parse_latlon_geometry",
+      [&]() { parse_latlon_geometry("500x400+24.94+60.17:bench/radar", x, y, w, h); });
+  run("parse_named_geometry",
+      [&]() { parse_named_geometry("500x400+Helsinki:bench/radar", x, y, w, h); });
+
+  // Cropping
+
+  run("crop_corner", [&]() { sink += crop_corner(source, 120, 340, 500, 400, xoff, yoff)->Width(); });
+  run("crop_center", [&]() { sink += crop_center(source, 500, 600, 500, 400, xoff, yoff)->Width(); });
+
+  // Decorations
+
+  unique_ptr<Imagine::NFmiImage> crop = crop_center(source, 500, 600, 500, 400, xoff, yoff);
+  CropInfo info;
+  info.area = create_map("bench/radar");
+  info.xoff = xoff;
+  info.yoff = yoff;
+
+  run("draw_labels",
+      [&]()
+      {
+        draw_labels(*crop,
+                    info,
+                    "Helsinki,24.94,60.17::Turku,22.27,60.45::Tampere,23.76,61.50::"
+                    "Oulu,25.47,65.01::Rovaniemi,25.73,66.50");
+      });
+  run("draw_label_set", [&]() { draw_labels(*crop, info, "@bench_cities"); });
+  run("draw_timestamp", [&]() { draw_timestamp(*crop, "-5,-5,%H:%M,forobs", forfile); });
+  run("draw_image", [&]() { draw_image(*crop, corpus + "/legend.png,5,5"); });
+  run("reduce_colors", [&]() { reduce_colors(*crop, "5550"); });
+
+  // Downscaling
+
+  run("resample_box", [&]() { sink += resample_image(*crop, 250, 200, BoxKernel)->Width(); });
+  run("resample_lanczos",
+      [&]() { sink += resample_image(*crop, 250, 200, LanczosKernel)->Width(); });
+
+  // Encoding
+
+  run("png_encode", [&]() { sink += encode_image(*crop, "png").size(); });
+
+  // Caching and authentication
+
+  const string query = "f=" + obsfile + "&p=500x400+Helsinki:bench/radar&T=-5,-5&Z=5550";
+  run("cachename", [&]() { sink += cachename(query).size(); });
+
+  WebAuthenticator auth("benchsecret");
+  const string signedquery = query + "&auth=" + auth.MD5Digest("benchsecret", query);
+  run("isValidQuery", [&]() { sink += auth.isValidQuery(signedquery); });
+
+  // Report
+
+  cout << "{" << endl << "  \"benchmarks\": [" << endl;
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    cout << "    {\"name\": \"" << results[i].name << "\", \"iterations\": " << results[i].iterations
+         << ", \"ns_per_op\": " << fixed << setprecision(1) << results[i].ns_per_op
+         << ", \"heap_allocs\": " << results[i].heap_allocs
+         << ", \"arena_allocs\": " << results[i].arena_allocs << "}"
+         << (i + 1 < results.size() ? "," : "") << endl;
+  }
+  cout << "  ]" << endl << "}" << endl;
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Main program
+ */
+// ----------------------------------------------------------------------
+
+int main(int argc, const char* argv[])
+{
+  try
+  {
+    run_benchmarks(argc > 1 ? argv[1] : "corpus");
+    return 0;
+  }
+  catch (CropperException& e)
+  {
+    cerr << "Error: " << e.status() << ' ' << e.what() << endl;
+  }
+  catch (exception& e)
+  {
+    cerr << "Error: " << e.what() << endl;
+  }
+  return 1;
+}
+
+// ======================================================================
@@ -0,0 +1,372 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Replay recorded query strings against cropper_auth
+ *
+ * Usage: CropperReplay [options] <queryfile>
+ *
+ * Each line of the query file is a QUERY_STRING as recorded from the
+ * web server logs. Each query is run by spawning the CGI program with
+ * the same environment a web server would provide, at the requested
+ * concurrency. At the end the throughput, latency percentiles, status
+ * codes and cache hit ratio are reported.
+ *
+ * Options:
+ *
+ *   -p [program]     The CGI program, default ../cropper_auth
+ *   -c [concurrency] The number of simultaneous requests, default 4
+ *   -r [repeats]     How many times the query list is replayed, default 1
+ *   -a [secretfile]  Sign the queries with the secret in the given file
+ *   -e [seconds]     Expiration time of signed queries, default 3600
+ *
+ * Existing authentication parameters are removed before signing.
+ */
+// ======================================================================
+
+#include "WebAuthenticator.h"
+
+#include <newbase/NFmiCmdLine.h>
+#include <newbase/NFmiStringTools.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C"
+{
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+}
+
+extern char** environ;
+
+using namespace std;
+
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief The outcome of a single request
+ */
+// ----------------------------------------------------------------------
+
+struct Response
+{
+  double seconds = 0;  // latency
+  int status = 0;      // HTTP status, 0 if the program failed
+  int cache = 0;       // 1 for hit, -1 for miss, 0 if not applicable
+  size_t bytes = 0;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Sign the query string
+ */
+// ----------------------------------------------------------------------
+
+string sign(const string& theQuery, const string& theSecret, long theExpiration)
+{
+  WebAuthenticator auth(theSecret);
+  string query = auth.canonizeQuery(theQuery);
+  query += "&exp=" + NFmiStringTools::Convert(time(nullptr) + theExpiration);
+  query += "&auth=" + auth.MD5Digest(theSecret, query);
+  return query;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Parse the CGI response headers
+ */
+// ----------------------------------------------------------------------
+
+void parse_headers(const string& theOutput, Response& theResponse)
+{
+  theResponse.bytes = theOutput.size();
+
+  string::size_type pos = 0;
+  while (pos < theOutput.size())
+  {
+    string::size_type next = theOutput.find('\n', pos);
+    if (next == string::npos)
+      next = theOutput.size();
+    string line = theOutput.substr(pos, next - pos);
+    if (!line.empty() && line[line.size() - 1] == '\r')
+      line.resize(line.size() - 1);
+    if (line.empty())
+      break;
+
+    if (line.compare(0, 8, "Status: ") == 0)
+      theResponse.status = atoi(line.c_str() + 8);
+    else if (line == "X-Cache: HIT")
+      theResponse.cache = 1;
+    else if (line == "X-Cache: MISS")
+      theResponse.cache = -1;
+
+    pos = next + 1;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Run a single CGI request
+ */
+// ----------------------------------------------------------------------
+
+Response run_query(const string& theProgram, const string& theQuery)
+{
+  // The CGI environment on top of the current one
+
+  vector<string> env;
+  env.push_back("QUERY_STRING=" + theQuery);
+  env.push_back("REQUEST_METHOD=GET");
+  env.push_back("GATEWAY_INTERFACE=CGI/1.1");
+  env.push_back("SERVER_PROTOCOL=HTTP/1.1");
+  env.push_back("SCRIPT_NAME=/" + theProgram.substr(theProgram.rfind('/') + 1));
+  for (char** e = environ; *e != nullptr; ++e)
+    if (strncmp(*e, "QUERY_STRING=", 13) != 0 && strncmp(*e, "REQUEST_METHOD=", 15) != 0)
+      env.push_back(*e);
+
+  vector<char*> envp;
+  for (auto& e : env)
+    envp.push_back(&e[0]);
+  envp.push_back(nullptr);
+
+  string program = theProgram;
+  char* argv[] = {&program[0], nullptr};
+
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) != 0)
+    throw runtime_error("Failed to create a pipe");
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+  posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+  Response response;
+  const auto start = chrono::steady_clock::now();
+
+  pid_t pid;
+  const int err = posix_spawn(&pid, program.c_str(), &actions, nullptr, argv, &envp[0]);
+  posix_spawn_file_actions_destroy(&actions);
+  close(fds[1]);
+
+  if (err != 0)
+  {
+    close(fds[0]);
+    throw runtime_error("Failed to run '" + theProgram + "'");
+  }
+
+  string output;
+  char buffer[65536];
+  ssize_t n;
+  while ((n = read(fds[0], buffer, sizeof(buffer))) > 0)
+    output.append(buffer, n);
+  close(fds[0]);
+
+  int status;
+  waitpid(pid, &status, 0);
+
+  response.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  parse_headers(output, response);
+  return response;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Percentile of sorted latencies
+ */
+// ----------------------------------------------------------------------
+
+double percentile(const vector<double>& theSorted, double theFraction)
+{
+  if (theSorted.empty())
+    return 0;
+  const size_t pos = static_cast<size_t>(theFraction * (theSorted.size() - 1) + 0.5);
+  return theSorted[pos];
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Print usage information
+ */
+// ----------------------------------------------------------------------
+
+void usage()
+{
+  cout << "Usage: CropperReplay [options] <queryfile>" << endl
+       << endl
+       << "   -p [program]\t\tThe CGI program, default ../cropper_auth" << endl
+       << "   -c [concurrency]\tNumber of simultaneous requests, default 4" << endl
+       << "   -r [repeats]\t\tNumber of times the queries are replayed, default 1" << endl
+       << "   -a [secretfile]\tSign the queries with the given secret" << endl
+       << "   -e [seconds]\t\tExpiration time of signed queries, default 3600" << endl
+       << endl;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Replay the queries
+ */
+// ----------------------------------------------------------------------
+
+int run(int argc, const char* argv[])
+{
+  NFmiCmdLine cmdline(argc, argv, "p!c!r!a!e!h");
+
+  if (cmdline.Status().IsError())
+    throw runtime_error(cmdline.Status().ErrorLog().CharPtr());
+
+  if (cmdline.isOption('h'))
+  {
+    usage();
+    return 0;
+  }
+
+  if (cmdline.NumberofParameters() != 1)
+    throw runtime_error("Expecting the query file as the only parameter");
+
+  const string program = (cmdline.isOption('p') ? cmdline.OptionValue('p') : "../cropper_auth");
+  const unsigned int concurrency =
+      (cmdline.isOption('c') ? NFmiStringTools::Convert<unsigned int>(cmdline.OptionValue('c'))
+                             : 4);
+  const unsigned int repeats =
+      (cmdline.isOption('r') ? NFmiStringTools::Convert<unsigned int>(cmdline.OptionValue('r'))
+                             : 1);
+  const long expiration =
+      (cmdline.isOption('e') ? NFmiStringTools::Convert<long>(cmdline.OptionValue('e')) : 3600);
+
+  string secret;
+  if (cmdline.isOption('a'))
+  {
+    ifstream in(cmdline.OptionValue('a'));
+    if (!in || !getline(in, secret))
+      throw runtime_error(string("Failed to read secret from '") + cmdline.OptionValue('a') + "'");
+  }
+
+  // Read and sign the queries
+
+  const string queryfile = cmdline.Parameter(1);
+  ifstream in(queryfile.c_str());
+  if (!in)
+    throw runtime_error("Failed to open '" + queryfile + "' for reading");
+
+  vector<string> queries;
+  string line;
+  while (getline(in, line))
+  {
+    if (line.empty() || line[0] == '#')
+      continue;
+    queries.push_back(secret.empty() ? line : sign(line, secret, expiration));
+  }
+
+  if (queries.empty() || concurrency == 0)
+    throw runtime_error("Nothing to do");
+
+  // Replay
+
+  const size_t n = queries.size() * repeats;
+  vector<Response> responses(n);
+  atomic<size_t> next(0);
+  mutex error_lock;
+  string error;
+
+  const auto start = chrono::steady_clock::now();
+
+  vector<thread> workers;
+  for (unsigned int t = 0; t < concurrency; t++)
+    workers.push_back(thread(
+        [&]()
+        {
+          size_t i;
+          while ((i = next++) < n)
+          {
+            try
+            {
+              responses[i] = run_query(program, queries[i % queries.size()]);
+            }
+            catch (exception& e)
+            {
+              lock_guard<mutex> lock(error_lock);
+              error = e.what();
+            }
+          }
+        }));
+  for (auto& w : workers)
+    w.join();
+
+  const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  if (!error.empty())
+    throw runtime_error(error);
+
+  // Report
+
+  vector<double> latencies;
+  map<int, size_t> statuses;
+  size_t hits = 0, misses = 0, bytes = 0;
+  for (const Response& r : responses)
+  {
+    latencies.push_back(r.seconds);
+    ++statuses[r.status];
+    hits += (r.cache > 0);
+    misses += (r.cache < 0);
+    bytes += r.bytes;
+  }
+  sort(latencies.begin(), latencies.end());
+
+  cout << "Requests: " << n << endl
+       << "Concurrency: " << concurrency << endl
+       << fixed << setprecision(3) << "Time: " << seconds << " s" << endl
+       << setprecision(1) << "Throughput: " << n / seconds << " requests/s, "
+       << bytes / seconds / (1024 * 1024) << " MB/s" << endl
+       << "Latency p50: " << 1000 * percentile(latencies, 0.50) << " ms" << endl
+       << "Latency p95: " << 1000 * percentile(latencies, 0.95) << " ms" << endl
+       << "Latency p99: " << 1000 * percentile(latencies, 0.99) << " ms" << endl;
+
+  for (const auto& s : statuses)
+    cout << "Status " << s.first << ": " << s.second << endl;
+
+  cout << "Cache hit ratio: "
+       << (hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0) << "% (" << hits << " hits, "
+       << misses << " renders)" << endl;
+
+  return 0;
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Main program
+ */
+// ----------------------------------------------------------------------
+
+int main(int argc, const char* argv[])
+{
+  try
+  {
+    return run(argc, argv);
+  }
+  catch (exception& e)
+  {
+    cerr << "Error: " << e.what() << endl;
+  }
+  return 1;
+}
+
+// ======================================================================
@@ -0,0 +1,21 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Multi-frame animation output
+ */
+// ======================================================================
+
+#ifndef CROPPERANIMATION_H
+#define CROPPERANIMATION_H
+
+#include "CropperTools.h"
+
+#include <string>
+#include <vector>
+
+std::vector<std::string> expand_frames(const std::string& theSpec);
+std::string render_animation(const std::vector<std::string>& theFrames, const Options& theOptions);
+
+#endif  // CROPPERANIMATION_H
+
+// ======================================================================
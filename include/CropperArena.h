@@ -0,0 +1,68 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Per-request arena for short-lived scratch allocations
+ */
+// ======================================================================
+
+#ifndef CROPPERARENA_H
+#define CROPPERARENA_H
+
+#include <cstddef>
+#include <memory_resource>
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A monotonic arena for the request run by this thread
+ *
+ * The arena is installed for the current thread on construction and
+ * all its memory is released at once on destruction. Deallocations
+ * are no-ops, hence only scratch state which does not outlive the
+ * request may be allocated from it.
+ */
+// ----------------------------------------------------------------------
+
+class RequestArena : public std::pmr::memory_resource
+{
+ public:
+  RequestArena();
+  ~RequestArena();
+
+  // Allocations and bytes requested from the arena, and blocks taken from the heap
+  std::size_t allocations() const { return itsAllocations; }
+  std::size_t bytes() const { return itsBytes; }
+  std::size_t blocks() const { return itsUpstream.blocks; }
+
+  static std::pmr::memory_resource* current();
+
+ private:
+  RequestArena(const RequestArena& theOther);
+  RequestArena& operator=(const RequestArena& theOther);
+
+  void* do_allocate(std::size_t theBytes, std::size_t theAlignment) override;
+  void do_deallocate(void* thePtr, std::size_t theBytes, std::size_t theAlignment) override;
+  bool do_is_equal(const std::pmr::memory_resource& theOther) const noexcept override;
+
+  // Counts the blocks the arena takes from the heap
+  struct Upstream : public std::pmr::memory_resource
+  {
+    std::size_t blocks = 0;
+
+    void* do_allocate(std::size_t theBytes, std::size_t theAlignment) override;
+    void do_deallocate(void* thePtr, std::size_t theBytes, std::size_t theAlignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& theOther) const noexcept override;
+  };
+
+  static const std::size_t inline_size = 8192;
+
+  alignas(std::max_align_t) char itsInline[inline_size];
+  Upstream itsUpstream;
+  std::pmr::monotonic_buffer_resource itsMemory;
+  std::size_t itsAllocations = 0;
+  std::size_t itsBytes = 0;
+  RequestArena* itsPrevious;
+};
+
+#endif  // CROPPERARENA_H
+
+// ======================================================================
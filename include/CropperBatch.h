@@ -0,0 +1,17 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Batch mode rendering of many crops in a single process
+ */
+// ======================================================================
+
+#ifndef CROPPERBATCH_H
+#define CROPPERBATCH_H
+
+#include <string>
+
+int batch(const std::string& theManifest, unsigned int theThreads);
+
+#endif  // CROPPERBATCH_H
+
+// ======================================================================
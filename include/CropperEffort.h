@@ -0,0 +1,41 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Automatic choice of the PNG encoder effort
+ */
+// ======================================================================
+
+#ifndef CROPPEREFFORT_H
+#define CROPPEREFFORT_H
+
+#include "CropperOptions.h"
+
+#include <imagine/NFmiImage.h>
+
+#include <string>
+
+// The encoder parameters chosen for an image
+
+struct EncoderEffort
+{
+  int level = 6;        // deflate level
+  bool palette = true;  // try to save with a palette
+  bool filter = true;   // use adaptive row filters
+  int strategy = 0;     // zlib strategy
+  bool filters = true;  // false if filter and strategy are left to the encoder
+  int colors = 0;       // sampled distinct colors, 257 meaning more than 256
+  double entropy = 0;   // bits per byte of the sampled row differences
+  double estimate = 0;  // estimated encoding time in milliseconds
+
+  std::string summary() const;
+};
+
+bool auto_effort(const Options& theOptions);
+EncoderEffort choose_effort(const Imagine::NFmiImage& theImage,
+                            int theFrames = 1,
+                            bool thePalette = true,
+                            bool theFilters = true);
+
+#endif  // CROPPEREFFORT_H
+
+// ======================================================================
@@ -0,0 +1,40 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Fast non-cryptographic hashing
+ */
+// ======================================================================
+
+#ifndef CROPPERHASH_H
+#define CROPPERHASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A 128-bit hash value
+ */
+// ----------------------------------------------------------------------
+
+struct Hash128
+{
+  std::uint64_t h1 = 0;
+  std::uint64_t h2 = 0;
+
+  bool operator==(const Hash128& theOther) const
+  {
+    return h1 == theOther.h1 && h2 == theOther.h2;
+  }
+  bool operator!=(const Hash128& theOther) const { return !(*this == theOther); }
+
+  const std::string hex() const;
+};
+
+Hash128 hash128(const void* theData, std::size_t theLength, std::uint64_t theSeed = 0);
+Hash128 hash128(const std::string& theData, std::uint64_t theSeed = 0);
+
+#endif  // CROPPERHASH_H
+
+// ======================================================================
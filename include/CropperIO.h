@@ -0,0 +1,34 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief File status, readahead hints and deferred cache writes
+ */
+// ======================================================================
+
+#ifndef CROPPERIO_H
+#define CROPPERIO_H
+
+#include <cstddef>
+#include <ctime>
+#include <functional>
+#include <string>
+
+// The result of a single stat call
+
+struct FileStatus
+{
+  bool exists = false;
+  std::size_t size = 0;
+  std::time_t modtime = 0;
+};
+
+FileStatus file_status(const std::string& theFile);
+void prefetch_file(const std::string& theFile);
+bool sweep_due(const std::string& theDirectory, std::time_t theInterval);
+
+void defer_write(std::function<void()> theTask);
+void finish_deferred_writes();
+
+#endif  // CROPPERIO_H
+
+// ======================================================================
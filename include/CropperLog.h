@@ -0,0 +1,25 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Non-blocking structured request logging
+ */
+// ======================================================================
+
+#ifndef CROPPERLOG_H
+#define CROPPERLOG_H
+
+#include <cstddef>
+#include <string>
+
+void log_request(const std::string& theOutcome,
+                 int theStatus,
+                 std::size_t theBytes,
+                 const char* theQuery);
+void log_event(const std::string& theEvent);
+
+void start_log_flusher();
+void stop_log_flusher();
+
+#endif  // CROPPERLOG_H
+
+// ======================================================================
@@ -0,0 +1,65 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Request counters shared between cropper processes
+ */
+// ======================================================================
+
+#ifndef CROPPERMETRICS_H
+#define CROPPERMETRICS_H
+
+#include <cstddef>
+#include <ostream>
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The counted events
+ *
+ * New metrics must be added to the end, the order defines the layout
+ * of the shared memory block. Each metric also needs an export label
+ * in the same position in CropperMetrics.cpp.
+ */
+// ----------------------------------------------------------------------
+
+enum Metric
+{
+  PassthroughRequests,  // unmodified original images
+  NotModifiedRequests,  // 304 responses
+  CacheHitRequests,     // renderings found in the cache
+  RenderRequests,       // new single image renderings
+  AnimationRequests,    // new animations
+  MultipartRequests,    // new multiple geometry renderings
+  PassthroughBytes,
+  CacheHitBytes,
+  RenderBytes,
+  CacheFilesWritten,
+  CacheBytesWritten,
+  BatchJobs,
+  BatchFailures,
+  LogRecordsDropped,
+  RasterCacheHits,
+  RasterCacheMisses,
+  RasterCacheBytesWritten,
+  RasterCacheBytesEvicted,
+  HeadRequests,   // HEAD requests answered without a body
+  RangeRequests,  // 206 responses
+  InteractiveTasksQueued,
+  BackgroundTasksQueued,
+  InteractiveTasksStarted,
+  BackgroundTasksStarted,
+  DeadlineDrops,      // requests dropped after their deadline
+  NegativeCacheHits,  // failures repeated from the negative cache
+  NegativeCacheMisses,
+  NegativeCacheStores,
+  NegativeCacheEvictions,
+  MetricCount
+};
+
+void metrics_count(Metric theMetric, std::size_t theAmount = 1);
+void metrics_error(int theStatus);
+void metrics_render_time(double theMilliseconds);
+bool metrics_export(std::ostream& theOutput);
+
+#endif  // CROPPERMETRICS_H
+
+// ======================================================================
@@ -0,0 +1,25 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Several crops from a single decoded image
+ */
+// ======================================================================
+
+#ifndef CROPPERMULTIPART_H
+#define CROPPERMULTIPART_H
+
+#include "CropperTools.h"
+
+#include <string>
+
+extern const std::string multipart_boundary;
+
+bool has_multiple_geometries(const Options& theOptions);
+std::pmr::string render_multipart(const Imagine::NFmiImage& theImage,
+                                  const Options& theOptions,
+                                  const std::string& theFilename,
+                                  const std::string& theType);
+
+#endif  // CROPPERMULTIPART_H
+
+// ======================================================================
@@ -0,0 +1,21 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Short lived cache of failed requests
+ */
+// ======================================================================
+
+#ifndef CROPPERNEGATIVECACHE_H
+#define CROPPERNEGATIVECACHE_H
+
+#include "CropperException.h"
+
+#include <string>
+#include <vector>
+
+void negative_cache_check(const std::string& theQuery, const std::vector<std::string>& theSources);
+void negative_cache_store(const CropperException& theError);
+
+#endif  // CROPPERNEGATIVECACHE_H
+
+// ======================================================================
@@ -0,0 +1,106 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Request options and allocation free parsing helpers
+ */
+// ======================================================================
+
+#ifndef CROPPEROPTIONS_H
+#define CROPPEROPTIONS_H
+
+#include "CropperArena.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The options of a single request
+ *
+ * All options are single letters. The values are stored in a single
+ * buffer and are returned as views into it, hence parsing a query
+ * string needs at most one allocation, which is taken from the request
+ * arena if there is one. Copies allocate from the heap, hence they may
+ * be passed to other threads.
+ */
+// ----------------------------------------------------------------------
+
+class Options
+{
+ public:
+  Options() = default;
+  explicit Options(std::string_view theQueryString);
+
+  bool has(char theOption) const { return slot(theOption) != nullptr; }
+  std::string_view get(char theOption) const;
+  std::string str(char theOption) const { return std::string(get(theOption)); }
+
+  void set(char theOption, std::string_view theValue);
+  void erase(char theOption);
+
+  // The number of options given, including unknown ones
+  std::size_t size() const { return itsCount + itsUnknown; }
+
+ private:
+  static const int nslots = 52;  // a-z and A-Z
+
+  struct Slot
+  {
+    std::uint32_t offset = 0;
+    std::uint32_t length = 0;
+    bool set = false;
+  };
+
+  static int index(char theOption);
+  const Slot* slot(char theOption) const;
+
+  std::pmr::string itsBuffer{RequestArena::current()};
+  Slot itsSlots[nslots];
+  std::size_t itsCount = 0;
+  std::size_t itsUnknown = 0;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Iterate over the parts of a delimited string
+ *
+ * Unlike NFmiStringTools::Split the parts are views into the
+ * original string, and empty parts are returned as is.
+ */
+// ----------------------------------------------------------------------
+
+class Tokenizer
+{
+ public:
+  Tokenizer(std::string_view theString, std::string_view theDelimiter)
+      : itsString(theString), itsDelimiter(theDelimiter)
+  {
+  }
+
+  bool next(std::string_view& thePart);
+
+ private:
+  std::string_view itsString;
+  std::string_view itsDelimiter;
+  std::size_t itsPos = 0;
+  bool itsDone = false;
+};
+
+std::size_t split(std::string_view theString,
+                  std::string_view theDelimiter,
+                  std::string_view* theParts,
+                  std::size_t theMaxParts);
+
+bool parse_number(std::string_view theString, int& theValue);
+bool parse_number(std::string_view theString, unsigned int& theValue);
+bool parse_number(std::string_view theString, std::uintmax_t& theValue);
+bool parse_number(std::string_view theString, double& theValue);
+
+int to_int(std::string_view theString, const char* theOption);
+double to_double(std::string_view theString, const char* theOption);
+
+#endif  // CROPPEROPTIONS_H
+
+// ======================================================================
@@ -0,0 +1,29 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Cache of undecorated cropped rasters
+ */
+// ======================================================================
+
+#ifndef CROPPERRASTERCACHE_H
+#define CROPPERRASTERCACHE_H
+
+#include "CropperTools.h"
+
+#include <memory>
+#include <string>
+
+std::unique_ptr<Imagine::NFmiImage> raster_cache_load(const Options& theOptions,
+                                                      const std::string& theSource,
+                                                      CropInfo& theInfo,
+                                                      std::string& theType);
+
+void raster_cache_store(const Options& theOptions,
+                        const std::string& theSource,
+                        const Imagine::NFmiImage& theImage,
+                        const CropInfo& theInfo,
+                        const std::string& theType);
+
+#endif  // CROPPERRASTERCACHE_H
+
+// ======================================================================
@@ -0,0 +1,36 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Resampling of cropped images
+ */
+// ======================================================================
+
+#ifndef CROPPERRESAMPLE_H
+#define CROPPERRESAMPLE_H
+
+#include <imagine/NFmiImage.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+// The available resampling kernels
+
+enum ResampleKernel
+{
+  BoxKernel,     // area average, fastest
+  LanczosKernel  // Lanczos-3, sharpest
+};
+
+ResampleKernel resample_kernel(std::string_view theName);
+
+std::unique_ptr<Imagine::NFmiImage> resample_image(const Imagine::NFmiImage& theImage,
+                                                   int theWidth,
+                                                   int theHeight,
+                                                   ResampleKernel theKernel);
+
+const std::string pyramid_file(const std::string& theSource, int theLevel);
+
+#endif  // CROPPERRESAMPLE_H
+
+// ======================================================================
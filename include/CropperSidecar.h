@@ -0,0 +1,63 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Memory mapped raw raster sidecars of source images
+ */
+// ======================================================================
+
+#ifndef CROPPERSIDECAR_H
+#define CROPPERSIDECAR_H
+
+#include <imagine/NFmiColorTools.h>
+#include <imagine/NFmiImage.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A read only memory mapped raster
+ *
+ * Provides the same pixel access as NFmiImage so that the crop
+ * routines can copy the crop window directly from the mapping.
+ */
+// ----------------------------------------------------------------------
+
+class MappedRaster
+{
+ public:
+  ~MappedRaster();
+
+  static std::unique_ptr<MappedRaster> open(const std::string& theSource);
+  static void create(const std::string& theSource, const Imagine::NFmiImage& theImage);
+
+  int Width() const { return itsWidth; }
+  int Height() const { return itsHeight; }
+  const std::string& Type() const { return itsType; }
+
+  Imagine::NFmiColorTools::Color operator()(int i, int j) const
+  {
+    return itsPixels[static_cast<std::size_t>(j) * itsStride + i];
+  }
+
+  std::unique_ptr<Imagine::NFmiImage> image() const;
+
+ private:
+  MappedRaster() = default;
+  MappedRaster(const MappedRaster& theOther) = delete;
+  MappedRaster& operator=(const MappedRaster& theOther) = delete;
+
+  void* itsMapping = nullptr;
+  std::size_t itsSize = 0;
+  const std::int32_t* itsPixels = nullptr;
+  int itsWidth = 0;
+  int itsHeight = 0;
+  std::size_t itsStride = 0;  // pixels per row
+  std::string itsType;
+};
+
+#endif  // CROPPERSIDECAR_H
+
+// ======================================================================
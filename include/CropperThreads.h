@@ -0,0 +1,68 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief A shared work-stealing pool for rendering several images at once
+ */
+// ======================================================================
+
+#ifndef CROPPERTHREADS_H
+#define CROPPERTHREADS_H
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+
+// The priority classes, in the order they are served
+
+enum Priority
+{
+  InteractivePriority,  // requests someone is waiting for
+  BackgroundPriority,   // batch jobs and prewarming
+  PriorityCount
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The priority and deadline of the request run by this thread
+ *
+ * Work submitted with parallel_for inherits the context of the
+ * submitting thread. A zero budget means no deadline.
+ */
+// ----------------------------------------------------------------------
+
+class RequestContext
+{
+ public:
+  RequestContext(Priority thePriority, std::chrono::milliseconds theBudget);
+  ~RequestContext();
+
+  static Priority priority();
+  static bool expired();
+
+ private:
+  RequestContext(const RequestContext& theOther);
+  RequestContext& operator=(const RequestContext& theOther);
+
+  Priority itsPreviousPriority;
+  std::chrono::steady_clock::time_point itsPreviousDeadline;
+};
+
+void check_deadline(const char* theStage);
+
+void scheduler_threads(unsigned int theThreads);
+std::size_t scheduler_queue_depth(Priority thePriority);
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Run the given function for indices 0...n-1 in parallel
+ *
+ * The calling thread helps with the work while waiting. The first
+ * exception thrown is rethrown in the calling thread.
+ */
+// ----------------------------------------------------------------------
+
+void parallel_for(std::size_t n, const std::function<void(std::size_t)>& theFunction);
+
+#endif  // CROPPERTHREADS_H
+
+// ======================================================================
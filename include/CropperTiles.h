@@ -0,0 +1,82 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Tiled store of source images
+ */
+// ======================================================================
+
+#ifndef CROPPERTILES_H
+#define CROPPERTILES_H
+
+#include <imagine/NFmiColorTools.h>
+#include <imagine/NFmiImage.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A source image stored as independently compressed tiles
+ *
+ * Provides the same pixel access as NFmiImage so that the crop
+ * routines can use it directly. Tiles are read and decompressed when
+ * first accessed, hence a crop only decodes the intersecting tiles.
+ * Not thread safe.
+ */
+// ----------------------------------------------------------------------
+
+class TiledRaster
+{
+ public:
+  ~TiledRaster();
+
+  static bool active();
+  static std::unique_ptr<TiledRaster> open(const std::string& theSource);
+  static bool create(const std::string& theSource, const Imagine::NFmiImage& theImage);
+
+  int Width() const { return itsWidth; }
+  int Height() const { return itsHeight; }
+  const std::string& Type() const { return itsType; }
+
+  Imagine::NFmiColorTools::Color operator()(int i, int j) const
+  {
+    const std::size_t t = static_cast<std::size_t>(j / itsTileSize) * itsColumns + i / itsTileSize;
+    if (itsTiles[t].empty())
+      load(t);
+    return itsTiles[t][(j % itsTileSize) * itsTileSize + i % itsTileSize];
+  }
+
+  std::unique_ptr<Imagine::NFmiImage> image() const;
+  std::size_t loadedTiles() const { return itsLoaded; }
+
+ private:
+  TiledRaster() = default;
+  TiledRaster(const TiledRaster& theOther) = delete;
+  TiledRaster& operator=(const TiledRaster& theOther) = delete;
+
+  void load(std::size_t theTile) const;
+
+  struct IndexEntry
+  {
+    std::uint64_t offset;
+    std::uint32_t size;
+    std::uint32_t reserved;
+  };
+
+  int itsFile = -1;
+  int itsWidth = 0;
+  int itsHeight = 0;
+  int itsTileSize = 0;
+  std::size_t itsColumns = 0;
+  std::string itsType;
+  std::vector<IndexEntry> itsIndex;
+  mutable std::vector<std::vector<std::int32_t> > itsTiles;
+  mutable std::size_t itsLoaded = 0;
+};
+
+#endif  // CROPPERTILES_H
+
+// ======================================================================
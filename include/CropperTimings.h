@@ -0,0 +1,110 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Per-stage timing of request processing
+ */
+// ======================================================================
+
+#ifndef CROPPERTIMINGS_H
+#define CROPPERTIMINGS_H
+
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Stage timings of a single request
+ *
+ * The timings of the current thread are available via current(),
+ * hence the stages can be timed without passing the object around.
+ */
+// ----------------------------------------------------------------------
+
+class Timings
+{
+ public:
+  typedef std::vector<std::pair<std::string, double> > Stages;  // name and milliseconds
+
+  Timings();
+  ~Timings();
+
+  void add(const std::string& theStage, double theMilliseconds);
+  void note(const std::string& theNote);
+  double total() const;
+  const Stages& stages() const { return itsStages; }
+
+  std::string header() const;
+  std::string summary() const;
+
+  static Timings* current();
+
+ private:
+  Timings(const Timings& theOther);
+  Timings& operator=(const Timings& theOther);
+
+  std::chrono::steady_clock::time_point itsStart;
+  Stages itsStages;
+  std::string itsNotes;  // extra information for the logs
+  Timings* itsPrevious;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Time the enclosing scope as a stage of the current request
+ */
+// ----------------------------------------------------------------------
+
+class StageTimer
+{
+ public:
+  explicit StageTimer(const char* theStage);
+  ~StageTimer();
+
+ private:
+  StageTimer(const StageTimer& theOther);
+  StageTimer& operator=(const StageTimer& theOther);
+
+  Timings* itsTimings;
+  const char* itsStage;
+  std::chrono::steady_clock::time_point itsStart;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Aggregate histograms of stage timings over many requests
+ */
+// ----------------------------------------------------------------------
+
+class StageHistograms
+{
+ public:
+  // Logarithmic buckets, bucket k counts times below 2^k microseconds
+  static const int buckets = 32;
+
+  void add(const Timings& theTimings);
+  void report(std::ostream& theOutput) const;
+
+ private:
+  struct Histogram
+  {
+    std::size_t count = 0;
+    double sum = 0;
+    double max = 0;
+    std::size_t counts[buckets] = {};
+
+    double percentile(double theFraction) const;
+  };
+
+  mutable std::mutex itsMutex;
+  std::map<std::string, Histogram> itsHistograms;
+};
+
+#endif  // CROPPERTIMINGS_H
+
+// ======================================================================
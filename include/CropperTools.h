@@ -8,8 +8,12 @@
 #ifndef CROPPERTOOLS_H
 #define CROPPERTOOLS_H
 
+#include "CropperOptions.h"
+
 #include <memory>
 #include <string>
+#include <string_view>
+#include <vector>
 
 class NFmiArea;
 class NFmiPoint;
@@ -18,36 +22,64 @@ class NFmiPoint;
 #include <imagine/NFmiImage.h>
 #include <newbase/NFmiAreaFactory.h>
 
+// Information on the performed crop needed by the decorations
+
+struct CropInfo
+{
+  NFmiAreaFactory::return_type area;  // the projection, if any
+  bool has_center = false;            // true if cropped around a center point
+  int xm = 0;                         // the center point in the cropped image
+  int ym = 0;
+  int xoff = 0;  // how much was removed from the image
+  int yoff = 0;
+  double scale = 1.0;  // source pixels to cropped pixels, below one for a downscaled level
+  double zoom = 1.0;   // cropped pixels to output pixels
+};
+
 void usage(const std::string& theProgName);
 void set_timezone(const std::string& theZone);
 const std::string format_time(const ::time_t theTime);
-void http_output_image(const std::string& theFile);
-const std::string cachename(const std::string& tehQueryString);
-bool not_modified(const std::string& theFile);
-bool http_output_cache(const char* theQueryString);
-NFmiAreaFactory::return_type create_map(const std::string& theMap);
-const NFmiPoint find_location(const std::string& theName);
+void http_output_image(const std::string& theFile, bool theCacheHit = false);
+void http_output_head(const std::string& theFile, const std::string& theMimeType);
+const std::string canonical_query(const Options& theOptions,
+                                  const std::string& theTimezone,
+                                  bool theResolve = true);
+const std::string cachename(const std::string& theQueryString);
+bool not_modified(const std::string& theFile, const std::string& theCacheFile);
+bool http_output_cache(const std::string& theCacheFile);
+NFmiAreaFactory::return_type create_map(std::string_view theMap);
+const NFmiPoint find_location(std::string_view theName);
 const std::string get_suffix(const std::string& theFilename);
 void http_output_image(const Imagine::NFmiImage& theImage,
                        const std::string& theFile,
                        const std::string& theType,
-                       bool theCacheFlag);
-void parse_geometry(const std::string& theGeometry, int& x1, int& y1, int& width, int& height);
+                       const std::string& theCacheFile);
+const std::string encode_image(const Imagine::NFmiImage& theImage, const std::string& theType);
+void http_output_data(std::string_view theData,
+                      const std::string& theFile,
+                      const std::string& theMimeType,
+                      const std::string& theCacheFile);
+void parse_geometry(std::string_view theGeometry, int& x1, int& y1, int& width, int& height);
 void parse_center_geometry(
-    const std::string& theGeometry, int& xc, int& yc, int& width, int& height);
+    std::string_view theGeometry, int& xc, int& yc, int& width, int& height);
 
 NFmiAreaFactory::return_type parse_latlon_geometry(
-    const std::string& theGeometry, int& xc, int& yc, int& width, int& height);
+    std::string_view theGeometry, int& xc, int& yc, int& width, int& height);
 NFmiAreaFactory::return_type parse_named_geometry(
-    const std::string& theGeometry, int& xc, int& yc, int& width, int& height);
-std::unique_ptr<Imagine::NFmiImage> crop_corner(const Imagine::NFmiImage& theImage,
+    std::string_view theGeometry, int& xc, int& yc, int& width, int& height);
+const std::string resolve_geometry(char theOption, std::string_view theGeometry);
+// The crop routines accept an NFmiImage or a MappedRaster
+
+template <typename Image>
+std::unique_ptr<Imagine::NFmiImage> crop_corner(const Image& theImage,
                                                 int theX1,
                                                 int theY1,
                                                 int theWidth,
                                                 int theHeight,
                                                 int& theXoff,
                                                 int& theYoff);
-std::unique_ptr<Imagine::NFmiImage> crop_center(const Imagine::NFmiImage& theImage,
+template <typename Image>
+std::unique_ptr<Imagine::NFmiImage> crop_center(const Image& theImage,
                                                 int theXC,
                                                 int theYC,
                                                 int theWidth,
@@ -55,24 +87,39 @@ std::unique_ptr<Imagine::NFmiImage> crop_center(const Imagine::NFmiImage& theIma
                                                 int& theXoff,
                                                 int& theYoff);
 
-Imagine::NFmiColorTools::Color parse_color(const std::string& theColor);
-const std::vector<std::string> extract_timestamps(const std::string& theString);
+Imagine::NFmiColorTools::Color parse_color(std::string_view theColor);
+const std::pmr::vector<std::string_view> extract_timestamps(std::string_view theString);
 
-const ::tm parse_stamp(const std::string& theStamp);
-std::string make_timestamp(const std::string& theFilename,
-                           const std::string& theType,
-                           const std::string& theFormat);
+const ::tm parse_stamp(std::string_view theStamp);
+std::string make_timestamp(std::string_view theFilename,
+                           std::string_view theType,
+                           std::string_view theFormat);
 void draw_timestamp(Imagine::NFmiImage& theImage,
-                    const std::string& theOptions,
+                    std::string_view theOptions,
                     const std::string& theFilename);
+void cache_timestamps();
 void draw_labels(Imagine::NFmiImage& theImage,
-                 const NFmiArea& theArea,
-                 int theXoff,
-                 int theYoff,
-                 const std::string& theOptions);
-void draw_center(Imagine::NFmiImage& theImage, const std::string& theOptions, int theX, int theY);
-void draw_image(Imagine::NFmiImage& theImage, const std::string& theOptions);
-void reduce_colors(Imagine::NFmiImage& theImage, const std::string& theSpecs);
+                 const CropInfo& theInfo,
+                 std::string_view theOptions);
+void draw_center(Imagine::NFmiImage& theImage, std::string_view theOptions, int theX, int theY);
+void draw_image(Imagine::NFmiImage& theImage, std::string_view theOptions);
+void prefetch_overlays(const Options& theOptions);
+void reduce_colors(Imagine::NFmiImage& theImage, std::string_view theSpecs);
+template <typename Image>
+std::unique_ptr<Imagine::NFmiImage> crop_image(const Image& theImage,
+                                               const Options& theOptions,
+                                               CropInfo& theInfo,
+                                               int theLevel = 0);
+std::unique_ptr<Imagine::NFmiImage> scale_image(const Imagine::NFmiImage& theImage,
+                                                const Options& theOptions,
+                                                CropInfo& theInfo);
+void decorate_image(Imagine::NFmiImage& theImage,
+                    const Options& theOptions,
+                    const CropInfo& theInfo,
+                    const std::string& theFilename);
+void finish_image(Imagine::NFmiImage& theImage,
+                  const Options& theOptions,
+                  const std::string& theType);
 int domain(int argc, const char* argv[]);
 
 #endif  // CROPPERTOOLS_H
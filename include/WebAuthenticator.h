@@ -25,19 +25,28 @@
 #define _HAVE_WEBAUTHENTICATOR_H
 
 #include <iostream>
+#include <memory>
 #include <string>
 
+struct WebKeyring;
+
 class WebAuthenticator
 {
  private:
-  // Authentication parameters
-  std::string md5_secret;
+  // Authentication parameters, shared and immutable
+  std::shared_ptr<const WebKeyring> md5_keyring;
 
  public:
   // ----------------------------------------------------------------------
   /*!
    * \brief Constructor for WebAuthenticator class
    *
+   * The default constructor uses the secret on the first line of the
+   * default secret file. Old secrets marked with "accept:" on later lines
+   * are accepted too, which allows rotating the secret without breaking
+   * the signed queries in use. The file is read
+   * only once per process and reread when it changes.
+   *
    * \param secret Secret key used in MD5 message digest calculation
    */
   // ----------------------------------------------------------------------
@@ -10,6 +10,9 @@
 // ======================================================================
 
 #include "CropperException.h"
+#include "CropperLog.h"
+#include "CropperMetrics.h"
+#include "CropperNegativeCache.h"
 #include "CropperTools.h"
 #include <cstdlib>
 #include <iostream>
@@ -42,6 +45,9 @@ int main(int argc, const char* argv[])
       cout << "Content-Type: text/plain" << endl
            << "Status: " << e.status() << ' ' << e.what() << endl
            << endl;
+      metrics_error(e.status());
+      negative_cache_store(e);
+      log_request("error", e.status(), 0, getenv("QUERY_STRING"));
     }
   }
 
@@ -54,6 +60,8 @@ int main(int argc, const char* argv[])
     else
     {
       cout << "Content-Type: text/plain" << endl << "Status: 409 " << e.what() << endl << endl;
+      metrics_error(409);
+      log_request("error", 409, 0, getenv("QUERY_STRING"));
     }
   }
 
@@ -62,9 +70,13 @@ int main(int argc, const char* argv[])
     if (!httpmode)
       cerr << "Error: Caught an unknown exception" << endl;
     else
+    {
       cout << "Content-Type: text/plain" << endl
            << "Status: 409 Unknown exception occurred" << endl
            << endl;
+      metrics_error(409);
+      log_request("error", 409, 0, getenv("QUERY_STRING"));
+    }
   }
   return 1;
 }
@@ -0,0 +1,51 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of the \c cropper_metrics command
+ *
+ * Prints the counters updated by the cropper processes in the
+ * Prometheus text format. When run as a CGI script the output
+ * is preceded by the HTTP headers.
+ */
+// ======================================================================
+
+#include "CropperMetrics.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The main program
+ */
+// ----------------------------------------------------------------------
+
+int main()
+{
+  const bool httpmode = (getenv("GATEWAY_INTERFACE") != 0);
+
+  ostringstream metrics;
+  if (!metrics_export(metrics))
+  {
+    if (!httpmode)
+      cerr << "Error: The metrics are not available" << endl;
+    else
+      cout << "Content-Type: text/plain" << endl
+           << "Status: 503 Metrics not available" << endl
+           << endl;
+    return 1;
+  }
+
+  if (httpmode)
+    cout << "Content-Type: text/plain; version=0.0.4" << endl
+         << "Cache-Control: no-cache" << endl
+         << endl;
+
+  cout << metrics.str();
+  return 0;
+}
+
+// ======================================================================
@@ -0,0 +1,118 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Implementation of the \c cropper_tile command
+ *
+ * Writes the tiled stores of the given images, so that the first
+ * request for a newly published image does not have to decode it.
+ * Optionally writes also the given number of downscaled levels of
+ * the images, each half the size of the previous one. The stores are
+ * named by a hash of the path, hence the images must be given with the
+ * same paths as in the queries.
+ *
+ * Usage: cropper_tile [-p <levels>] <image> [<image> ...]
+ */
+// ======================================================================
+
+#include "CropperResample.h"
+#include "CropperTiles.h"
+
+#include <imagine/NFmiImage.h>
+#include <newbase/NFmiFileSystem.h>
+#include <newbase/NFmiStringTools.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+extern "C"
+{
+#include <unistd.h>
+}
+
+using namespace std;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write the downscaled levels of an image
+ *
+ * \param theSource The source image
+ * \param theImage The decoded source image
+ * \param theLevels The number of levels
+ */
+// ----------------------------------------------------------------------
+
+void write_pyramid(const string& theSource, const Imagine::NFmiImage& theImage, int theLevels)
+{
+  unique_ptr<Imagine::NFmiImage> previous;
+  for (int level = 1; level <= theLevels; level++)
+  {
+    const Imagine::NFmiImage& image = (previous ? *previous : theImage);
+    if (image.Width() < 2 && image.Height() < 2)
+      break;
+
+    unique_ptr<Imagine::NFmiImage> half = resample_image(
+        image, max(1, image.Width() / 2), max(1, image.Height() / 2), BoxKernel);
+    half->SaveAlpha(true);
+
+    const string filename = pyramid_file(theSource, level);
+    if (!NFmiFileSystem::CreateDirectory(filename.substr(0, filename.rfind('/'))))
+      throw runtime_error("Failed to create directory for " + filename);
+    const string tmpfile = filename + "." + NFmiStringTools::Convert(::getpid());
+    half->Write(tmpfile, theImage.Type());
+    NFmiFileSystem::RenameFile(tmpfile, filename);
+
+    previous = std::move(half);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The main program
+ */
+// ----------------------------------------------------------------------
+
+int main(int argc, const char* argv[])
+{
+  int first = 1;
+  int levels = 0;
+  if (argc > 2 && strcmp(argv[1], "-p") == 0)
+  {
+    levels = atoi(argv[2]);
+    first = 3;
+  }
+
+  if (argc <= first || levels < 0)
+  {
+    cerr << "Usage: cropper_tile [-p <levels>] <image> [<image> ...]" << endl;
+    return 1;
+  }
+
+  int failures = 0;
+  for (int i = first; i < argc; i++)
+  {
+    try
+    {
+      const Imagine::NFmiImage image(argv[i]);
+      if (!TiledRaster::create(argv[i], image))
+      {
+        cerr << "Error: Failed to write the tiles of '" << argv[i] << "'" << endl;
+        ++failures;
+      }
+      write_pyramid(argv[i], image, levels);
+    }
+    catch (exception& e)
+    {
+      cerr << "Error: Failed to read '" << argv[i] << "'" << endl << " --> " << e.what() << endl;
+      ++failures;
+    }
+  }
+
+  return (failures == 0 ? 0 : 1);
+}
+
+// ======================================================================
@@ -28,6 +28,8 @@ Requires: smartmet-library-macgyver >= 24.1.17
 Requires: smartmet-library-imagine >= 24.2.23
 Provides: cropper
 Provides: cropper_auth
+Provides: cropper_metrics
+Provides: cropper_tile
 Obsoletes: libsmartmet-webauthenticator
 
 %description
@@ -51,6 +53,8 @@ rm -rf $RPM_BUILD_ROOT
 %defattr(-,root,root,0775)
 %{_bindir}/cropper
 %{_bindir}/cropper_auth
+%{_bindir}/cropper_metrics
+%{_bindir}/cropper_tile
 
 %changelog
 * Thu Feb 29 2024 Mika Heiskanen <mika.heiskanen@fmi.fi> - 24.2.29-1.fmi
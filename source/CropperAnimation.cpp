@@ -0,0 +1,502 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Multi-frame animation output
+ *
+ * All frames share the same geometry and decorations. The frames are
+ * rendered in parallel and written as a single animated PNG (APNG).
+ * Each frame after the first one is encoded as a delta against the
+ * previous frame: only the bounding box of the changed pixels is
+ * stored, and unchanged pixels inside the box are made transparent
+ * so that they compress to almost nothing.
+ *
+ * APNG files are valid PNG images, older clients simply show the
+ * first frame.
+ */
+// ======================================================================
+
+#include "CropperAnimation.h"
+#include "CropperEffort.h"
+#include "CropperException.h"
+#include "CropperIO.h"
+#include "CropperThreads.h"
+
+#include <imagine/NFmiImage.h>
+#include <newbase/NFmiSettings.h>
+#include <newbase/NFmiStringTools.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+
+extern "C"
+{
+#include <glob.h>
+#include <zlib.h>
+}
+
+using namespace std;
+
+namespace
+{
+// APNG blend operations
+const unsigned char APNG_BLEND_OP_SOURCE = 0;
+const unsigned char APNG_BLEND_OP_OVER = 1;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A frame converted to 8-bit RGBA
+ */
+// ----------------------------------------------------------------------
+
+struct Raster
+{
+  int width = 0;
+  int height = 0;
+  vector<unsigned char> pixels;  // RGBA, row by row
+
+  const unsigned char* pixel(int i, int j) const { return &pixels[4 * (j * width + i)]; }
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief An encoded frame
+ */
+// ----------------------------------------------------------------------
+
+struct Frame
+{
+  int x = 0;  // the region stored in the frame
+  int y = 0;
+  int width = 0;
+  int height = 0;
+  unsigned char blend = APNG_BLEND_OP_SOURCE;
+  string data;  // the compressed image data
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Convert an image to RGBA
+ *
+ * Imagine uses 7-bit alpha where 0 is opaque, PNG uses 8-bit alpha
+ * where 255 is opaque.
+ */
+// ----------------------------------------------------------------------
+
+Raster make_raster(const Imagine::NFmiImage& theImage, bool theAlphaFlag)
+{
+  using namespace Imagine::NFmiColorTools;
+
+  Raster raster;
+  raster.width = theImage.Width();
+  raster.height = theImage.Height();
+  raster.pixels.resize(4 * raster.width * raster.height);
+
+  unsigned char* ptr = &raster.pixels[0];
+  for (int j = 0; j < raster.height; j++)
+    for (int i = 0; i < raster.width; i++)
+    {
+      const Color c = theImage(i, j);
+      *ptr++ = static_cast<unsigned char>(GetRed(c));
+      *ptr++ = static_cast<unsigned char>(GetGreen(c));
+      *ptr++ = static_cast<unsigned char>(GetBlue(c));
+      *ptr++ = (theAlphaFlag ? static_cast<unsigned char>(((MaxAlpha - GetAlpha(c)) * 255 +
+                                                           MaxAlpha / 2) /
+                                                          MaxAlpha)
+                             : 255);
+    }
+
+  return raster;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The PNG Paeth predictor
+ */
+// ----------------------------------------------------------------------
+
+inline unsigned char paeth(int a, int b, int c)
+{
+  const int p = a + b - c;
+  const int pa = abs(p - a);
+  const int pb = abs(p - b);
+  const int pc = abs(p - c);
+  if (pa <= pb && pa <= pc)
+    return static_cast<unsigned char>(a);
+  if (pb <= pc)
+    return static_cast<unsigned char>(b);
+  return static_cast<unsigned char>(c);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Filter and compress a block of RGBA rows
+ *
+ * Each row uses the filter with the smallest sum of absolute values,
+ * which is the heuristic recommended by the PNG specification, unless
+ * filtering is disabled.
+ */
+// ----------------------------------------------------------------------
+
+string compress_rows(const vector<unsigned char>& theRows,
+                     int theWidth,
+                     int theHeight,
+                     const EncoderEffort& theEffort)
+{
+  const size_t rowsize = 4 * theWidth;
+  vector<unsigned char> filtered((rowsize + 1) * theHeight);
+  vector<unsigned char> candidate(rowsize);
+  vector<unsigned char> best(rowsize);
+  const vector<unsigned char> zero(rowsize, 0);
+
+  for (int j = 0; j < theHeight; j++)
+  {
+    const unsigned char* row = &theRows[j * rowsize];
+    const unsigned char* prev = (j > 0 ? &theRows[(j - 1) * rowsize] : &zero[0]);
+
+    unsigned char bestfilter = 0;
+    unsigned long bestsum = ~0UL;
+
+    const unsigned char maxfilter = (theEffort.filter ? 4 : 0);
+    for (unsigned char filter = 0; filter <= maxfilter; filter++)
+    {
+      unsigned long sum = 0;
+      for (size_t k = 0; k < rowsize; k++)
+      {
+        const int a = (k >= 4 ? row[k - 4] : 0);
+        const int b = prev[k];
+        const int c = (k >= 4 ? prev[k - 4] : 0);
+        unsigned char value = row[k];
+        if (filter == 1)
+          value -= a;
+        else if (filter == 2)
+          value -= b;
+        else if (filter == 3)
+          value -= (a + b) / 2;
+        else if (filter == 4)
+          value -= paeth(a, b, c);
+        candidate[k] = value;
+        sum += (value < 128 ? value : 256 - value);
+      }
+      if (sum < bestsum)
+      {
+        bestsum = sum;
+        bestfilter = filter;
+        best.swap(candidate);
+      }
+    }
+
+    filtered[j * (rowsize + 1)] = bestfilter;
+    copy(best.begin(), best.end(), filtered.begin() + j * (rowsize + 1) + 1);
+  }
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, theEffort.level, Z_DEFLATED, 15, 8, theEffort.strategy) != Z_OK)
+    throw CropperException(500, "Failed to compress animation frame");
+
+  string ret(deflateBound(&stream, filtered.size()), '\0');
+  stream.next_in = &filtered[0];
+  stream.avail_in = filtered.size();
+  stream.next_out = reinterpret_cast<Bytef*>(&ret[0]);
+  stream.avail_out = ret.size();
+  const int status = deflate(&stream, Z_FINISH);
+  ret.resize(stream.total_out);
+  deflateEnd(&stream);
+
+  if (status != Z_STREAM_END)
+    throw CropperException(500, "Failed to compress animation frame");
+  return ret;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Encode a frame as a delta against the previous frame
+ *
+ * \param theFrame The frame to encode
+ * \param thePrevious The previous frame, or 0 for the first frame
+ * \param theEffort The encoder parameters
+ */
+// ----------------------------------------------------------------------
+
+Frame encode_frame(const Raster& theFrame,
+                   const Raster* thePrevious,
+                   const EncoderEffort& theEffort)
+{
+  Frame frame;
+  frame.width = theFrame.width;
+  frame.height = theFrame.height;
+
+  if (thePrevious != 0)
+  {
+    // Bounding box of the changed pixels
+
+    int x1 = theFrame.width, y1 = theFrame.height, x2 = -1, y2 = -1;
+    bool opaque = true;
+
+    for (int j = 0; j < theFrame.height; j++)
+      for (int i = 0; i < theFrame.width; i++)
+      {
+        const unsigned char* p = theFrame.pixel(i, j);
+        if (!equal(p, p + 4, thePrevious->pixel(i, j)))
+        {
+          x1 = min(x1, i);
+          y1 = min(y1, j);
+          x2 = max(x2, i);
+          y2 = max(y2, j);
+          opaque &= (p[3] == 255);
+        }
+      }
+
+    if (x2 < 0)
+    {
+      // Identical frames: a single transparent pixel blended over the old one
+      x1 = y1 = x2 = y2 = 0;
+      frame.blend = APNG_BLEND_OP_OVER;
+    }
+    else if (opaque)
+    {
+      // The changed pixels replace the old ones even when blended
+      frame.blend = APNG_BLEND_OP_OVER;
+    }
+
+    frame.x = x1;
+    frame.y = y1;
+    frame.width = x2 - x1 + 1;
+    frame.height = y2 - y1 + 1;
+  }
+
+  // Extract the region, clearing the unchanged pixels when blending
+
+  vector<unsigned char> rows(4 * frame.width * frame.height);
+  unsigned char* ptr = &rows[0];
+  for (int j = frame.y; j < frame.y + frame.height; j++)
+    for (int i = frame.x; i < frame.x + frame.width; i++)
+    {
+      const unsigned char* p = theFrame.pixel(i, j);
+      if (frame.blend == APNG_BLEND_OP_OVER && equal(p, p + 4, thePrevious->pixel(i, j)))
+        ptr = fill_n(ptr, 4, 0);
+      else
+        ptr = copy(p, p + 4, ptr);
+    }
+
+  frame.data = compress_rows(rows, frame.width, frame.height, theEffort);
+  return frame;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Append a big endian integer
+ */
+// ----------------------------------------------------------------------
+
+void put32(string& theOutput, unsigned long theValue)
+{
+  theOutput += static_cast<char>((theValue >> 24) & 0xff);
+  theOutput += static_cast<char>((theValue >> 16) & 0xff);
+  theOutput += static_cast<char>((theValue >> 8) & 0xff);
+  theOutput += static_cast<char>(theValue & 0xff);
+}
+
+void put16(string& theOutput, unsigned int theValue)
+{
+  theOutput += static_cast<char>((theValue >> 8) & 0xff);
+  theOutput += static_cast<char>(theValue & 0xff);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Append a PNG chunk
+ */
+// ----------------------------------------------------------------------
+
+void put_chunk(string& theOutput, const char* theType, const string& theData)
+{
+  put32(theOutput, theData.size());
+  const size_t start = theOutput.size();
+  theOutput.append(theType, 4);
+  theOutput += theData;
+  const unsigned long crc =
+      crc32(0L, reinterpret_cast<const Bytef*>(theOutput.data() + start), theData.size() + 4);
+  put32(theOutput, crc);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Assemble the APNG file
+ */
+// ----------------------------------------------------------------------
+
+string write_apng(const vector<Frame>& theFrames, int theWidth, int theHeight, unsigned int theDelay)
+{
+  string out("\x89PNG\r\n\x1a\n", 8);
+
+  string ihdr;
+  put32(ihdr, theWidth);
+  put32(ihdr, theHeight);
+  ihdr += '\x08';  // bit depth
+  ihdr += '\x06';  // RGBA
+  ihdr += '\x00';  // compression
+  ihdr += '\x00';  // filter
+  ihdr += '\x00';  // interlace
+  put_chunk(out, "IHDR", ihdr);
+
+  string actl;
+  put32(actl, theFrames.size());
+  put32(actl, 0);  // loop forever
+  put_chunk(out, "acTL", actl);
+
+  unsigned long sequence = 0;
+  for (size_t n = 0; n < theFrames.size(); n++)
+  {
+    const Frame& frame = theFrames[n];
+
+    string fctl;
+    put32(fctl, sequence++);
+    put32(fctl, frame.width);
+    put32(fctl, frame.height);
+    put32(fctl, frame.x);
+    put32(fctl, frame.y);
+    put16(fctl, theDelay);
+    put16(fctl, 1000);  // delay is in milliseconds
+    fctl += '\x00';     // APNG_DISPOSE_OP_NONE
+    fctl += static_cast<char>(frame.blend);
+    put_chunk(out, "fcTL", fctl);
+
+    if (n == 0)
+      put_chunk(out, "IDAT", frame.data);
+    else
+    {
+      string fdat;
+      put32(fdat, sequence++);
+      fdat += frame.data;
+      put_chunk(out, "fdAT", fdat);
+    }
+  }
+
+  put_chunk(out, "IEND", "");
+  return out;
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Expand the frame specification into a list of files
+ *
+ * The specification is either a comma separated list of files or
+ * a single glob pattern, in which case the frames are in sorted order.
+ *
+ * \param theSpec The frame specification
+ * \return The frame files
+ */
+// ----------------------------------------------------------------------
+
+vector<string> expand_frames(const string& theSpec)
+{
+  vector<string> frames;
+
+  if (theSpec.find_first_of("*?[") == string::npos)
+    frames = NFmiStringTools::Split(theSpec);
+  else
+  {
+    glob_t matches;
+    if (glob(theSpec.c_str(), 0, nullptr, &matches) == 0)
+      frames.assign(matches.gl_pathv, matches.gl_pathv + matches.gl_pathc);
+    globfree(&matches);
+  }
+
+  if (frames.empty())
+    throw CropperException(410, "No animation frames are available");
+
+  const unsigned int maxframes = NFmiSettings::Optional<int>("cropper::animation::maxframes", 100);
+  if (frames.size() > maxframes)
+    throw CropperException(400, "Too many animation frames requested");
+
+  return frames;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Render an animation
+ *
+ * The frames are cropped and decorated as if each of them had been
+ * given with option -f. The timezone and locale must have been set
+ * by the caller.
+ *
+ * \param theFrames The frame files
+ * \param theOptions The parsed options
+ * \return The APNG file contents
+ */
+// ----------------------------------------------------------------------
+
+string render_animation(const vector<string>& theFrames, const Options& theOptions)
+{
+  unsigned int delay = NFmiSettings::Optional<int>("cropper::animation::delay", 500);
+  if (theOptions.has('D') && !parse_number(theOptions.get('D'), delay))
+    throw CropperException(400, "Invalid animation frame delay '" + theOptions.str('D') + "'");
+  if (delay > 65535)
+    throw CropperException(400, "Animation frame delay must be at most 65535 milliseconds");
+
+  const bool autoeffort = auto_effort(theOptions);
+
+  EncoderEffort effort;
+  effort.level = Z_DEFAULT_COMPRESSION;
+  effort.strategy = Z_DEFAULT_STRATEGY;
+  if (theOptions.has('z') && !autoeffort)
+    effort.level = to_int(theOptions.get('z'), "z");
+  if (effort.level < Z_DEFAULT_COMPRESSION || effort.level > Z_BEST_COMPRESSION)
+    throw CropperException(400, "Compression level must be in the range 0-9");
+
+  const bool alpha = (theOptions.has('A') && theOptions.get('A') != "0");
+
+  // Render the frames
+
+  const size_t n = theFrames.size();
+  vector<Raster> rasters(n);
+  unique_ptr<Imagine::NFmiImage> first;
+
+  for (const string& frame : theFrames)
+    prefetch_file(frame);
+
+  parallel_for(n,
+               [&](size_t i)
+               {
+                 check_deadline("decode");
+                 unique_ptr<Imagine::NFmiImage> image(new Imagine::NFmiImage(theFrames[i]));
+                 CropInfo info;
+                 unique_ptr<Imagine::NFmiImage> cropped = crop_image(*image, theOptions, info);
+                 if (cropped.get() != 0)
+                   image = std::move(cropped);
+                 unique_ptr<Imagine::NFmiImage> scaled = scale_image(*image, theOptions, info);
+                 if (scaled.get() != 0)
+                   image = std::move(scaled);
+                 decorate_image(*image, theOptions, info, theFrames[i]);
+                 finish_image(*image, theOptions, "apng");
+                 rasters[i] = make_raster(*image, alpha);
+                 if (i == 0)
+                   first = std::move(image);
+               });
+
+  for (size_t i = 1; i < n; i++)
+    if (rasters[i].width != rasters[0].width || rasters[i].height != rasters[0].height)
+      throw CropperException(400, "Animation frames must all be of the same size");
+
+  // The first frame represents all of them when choosing the effort
+
+  if (autoeffort)
+    effort = choose_effort(*first, n, false);
+
+  // Encode the deltas
+
+  check_deadline("encode");
+  vector<Frame> frames(n);
+  parallel_for(n,
+               [&](size_t i)
+               { frames[i] = encode_frame(rasters[i], (i > 0 ? &rasters[i - 1] : 0), effort); });
+
+  return write_apng(frames, rasters[0].width, rasters[0].height, delay);
+}
+
+// ======================================================================
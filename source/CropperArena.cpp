@@ -0,0 +1,130 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Per-request arena for short-lived scratch allocations
+ *
+ * A single render allocates many small short-lived strings and
+ * vectors: the option buffer, the parsed timestamp stamps and format,
+ * the multipart body and the response headers. With several requests
+ * in progress they would all contend for the global allocator. They
+ * are instead taken from a monotonic arena owned by the request, which
+ * starts with an inline buffer and releases everything in one step.
+ *
+ * Threads without an arena, for example the workers of the render
+ * pool, allocate from the heap as usual.
+ */
+// ======================================================================
+
+#include "CropperArena.h"
+
+using namespace std;
+
+namespace
+{
+// The arena of the request being processed by this thread
+thread_local RequestArena* current_arena = nullptr;
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Install a new arena for the current thread
+ */
+// ----------------------------------------------------------------------
+
+RequestArena::RequestArena()
+    : itsMemory(itsInline, inline_size, &itsUpstream), itsPrevious(current_arena)
+{
+  current_arena = this;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Release the memory and restore the previous arena
+ */
+// ----------------------------------------------------------------------
+
+RequestArena::~RequestArena()
+{
+  current_arena = itsPrevious;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The arena of the current thread, or the heap if there is none
+ */
+// ----------------------------------------------------------------------
+
+pmr::memory_resource* RequestArena::current()
+{
+  if (current_arena != nullptr)
+    return current_arena;
+  return pmr::new_delete_resource();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Allocate from the arena
+ */
+// ----------------------------------------------------------------------
+
+void* RequestArena::do_allocate(size_t theBytes, size_t theAlignment)
+{
+  ++itsAllocations;
+  itsBytes += theBytes;
+  return itsMemory.allocate(theBytes, theAlignment);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Memory is released only when the arena is destroyed
+ */
+// ----------------------------------------------------------------------
+
+void RequestArena::do_deallocate(void* thePtr, size_t theBytes, size_t theAlignment) {}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Memory from one arena cannot be released into another
+ */
+// ----------------------------------------------------------------------
+
+bool RequestArena::do_is_equal(const pmr::memory_resource& theOther) const noexcept
+{
+  return this == &theOther;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Take a new block from the heap
+ */
+// ----------------------------------------------------------------------
+
+void* RequestArena::Upstream::do_allocate(size_t theBytes, size_t theAlignment)
+{
+  ++blocks;
+  return pmr::new_delete_resource()->allocate(theBytes, theAlignment);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Return a block to the heap
+ */
+// ----------------------------------------------------------------------
+
+void RequestArena::Upstream::do_deallocate(void* thePtr, size_t theBytes, size_t theAlignment)
+{
+  pmr::new_delete_resource()->deallocate(thePtr, theBytes, theAlignment);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Blocks from one upstream cannot be released into another
+ */
+// ----------------------------------------------------------------------
+
+bool RequestArena::Upstream::do_is_equal(const pmr::memory_resource& theOther) const noexcept
+{
+  return this == &theOther;
+}
+
+// ======================================================================
@@ -0,0 +1,405 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Batch mode rendering of many crops in a single process
+ *
+ * The manifest contains one job per line in the form
+ * \code
+ * <outputfile> <querystring>
+ * \endcode
+ * where the query string uses the same options as the CGI mode,
+ * for example
+ * \code
+ * /tmp/out1.png f=/data/radar.png&p=300x300+Helsinki:finland/radar&T=-5,-5
+ * \endcode
+ * Empty lines and lines starting with '#' are ignored.
+ *
+ * The jobs are grouped by source so that each source image is decoded
+ * only once, and the crops are rendered in parallel. Timezones and
+ * locales are process wide settings, hence jobs with different -t or -k
+ * options are rendered in separate rounds.
+ *
+ * The jobs run in the shared render pool at background priority, hence
+ * interactive requests in the same process are served first. With
+ * cropper::batch::deadline (milliseconds, 0 for none) jobs not yet
+ * decoded or encoded once the time has run out fail with status 503.
+ *
+ * The kernel is asked to read the next cropper::io::prefetch sources
+ * (default 4) ahead of the workers, so that decoding a source rarely
+ * has to wait for the disk.
+ */
+// ======================================================================
+
+#include "CropperBatch.h"
+#include "CropperArena.h"
+#include "CropperException.h"
+#include "CropperIO.h"
+#include "CropperLog.h"
+#include "CropperMetrics.h"
+#include "CropperThreads.h"
+#include "CropperTimings.h"
+#include "CropperTools.h"
+
+#include <imagine/NFmiImage.h>
+#include <newbase/NFmiFileSystem.h>
+#include <newbase/NFmiSettings.h>
+#include <newbase/NFmiStringTools.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <clocale>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief A single manifest entry
+ */
+// ----------------------------------------------------------------------
+
+struct Job
+{
+  size_t line;      // manifest line number for error messages
+  string output;    // the output file
+  Options options;  // the parsed query string
+  string source;    // the image to be cropped
+  string timezone;  // the timezone, empty if no timestamp is drawn
+  string locale;    // the time locale, empty for the default one
+  string query;     // the query string for logging
+
+  bool same_settings(const Job& theOther) const
+  {
+    return timezone == theOther.timezone && locale == theOther.locale;
+  }
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A source image shared by several jobs
+ *
+ * The image is decoded by the first job needing it and released
+ * once the last job using it has finished.
+ */
+// ----------------------------------------------------------------------
+
+struct Source
+{
+  mutex lock;
+  unique_ptr<Imagine::NFmiImage> image;
+  int status = 0;  // nonzero if decoding failed
+  string error;
+  atomic<size_t> pending{0};
+  string ahead;  // the source to prefetch once this one is decoded
+};
+
+typedef map<string, unique_ptr<Source> > Sources;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Batch statistics
+ */
+// ----------------------------------------------------------------------
+
+struct Statistics
+{
+  atomic<size_t> failed{0};
+  atomic<size_t> decoded{0};
+  atomic<size_t> bytes{0};
+  StageHistograms timings;
+  mutex output_lock;  // for error messages
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read the manifest
+ */
+// ----------------------------------------------------------------------
+
+vector<Job> read_manifest(const string& theManifest)
+{
+  ifstream in(theManifest.c_str());
+  if (!in)
+    throw CropperException(400, "Failed to open manifest '" + theManifest + "' for reading");
+
+  const string default_timezone =
+      NFmiSettings::Optional<string>("cropper::timezone", "Europe/Helsinki");
+
+  vector<Job> jobs;
+  string line;
+  size_t linenumber = 0;
+
+  while (getline(in, line))
+  {
+    ++linenumber;
+    NFmiStringTools::Trim(line);
+    if (line.empty() || line[0] == '#')
+      continue;
+
+    const string::size_type pos = line.find_first_of(" \t");
+    if (pos == string::npos)
+      throw CropperException(400,
+                             theManifest + ":" + NFmiStringTools::Convert(linenumber) +
+                                 ": expecting an output filename and a query string");
+
+    Job job;
+    job.line = linenumber;
+    job.output = line.substr(0, pos);
+    job.query = line.substr(pos + 1);
+    job.options = Options(NFmiStringTools::Trim(job.query));
+
+    if (!job.options.has('f'))
+      throw CropperException(
+          400, theManifest + ":" + NFmiStringTools::Convert(linenumber) + ": option f is missing");
+    job.source = job.options.str('f');
+
+    if (job.options.has('T'))
+      job.timezone = (job.options.has('t') ? job.options.str('t') : default_timezone);
+
+    if (job.options.has('k'))
+      job.locale = job.options.str('k');
+
+    jobs.push_back(job);
+  }
+
+  return jobs;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Get the decoded source image, decoding it if necessary
+ */
+// ----------------------------------------------------------------------
+
+const Imagine::NFmiImage& decode(Source& theSource, const string& theFile, Statistics& theStats)
+{
+  lock_guard<mutex> lock(theSource.lock);
+
+  if (theSource.status != 0)
+    throw CropperException(theSource.status, theSource.error);
+
+  if (!theSource.image)
+  {
+    try
+    {
+      if (!NFmiFileSystem::FileExists(theFile))
+        throw CropperException(410, "File is no longer available");
+      StageTimer timer("decode");
+      theSource.image.reset(new Imagine::NFmiImage(theFile));
+      ++theStats.decoded;
+      if (!theSource.ahead.empty())
+        prefetch_file(theSource.ahead);
+    }
+    catch (CropperException& e)
+    {
+      theSource.status = e.status();
+      theSource.error = e.what();
+      throw;
+    }
+    catch (exception& e)
+    {
+      theSource.status = 409;
+      theSource.error = e.what();
+      throw CropperException(theSource.status, theSource.error);
+    }
+  }
+
+  return *theSource.image;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Render a single job
+ */
+// ----------------------------------------------------------------------
+
+void render(const Job& theJob,
+            Source& theSource,
+            const string& theManifest,
+            Statistics& theStats)
+{
+  RequestArena arena;
+  Timings timings;
+  int status = 200;
+  size_t bytes = 0;
+
+  try
+  {
+    check_deadline("decode");
+    const Imagine::NFmiImage& image = decode(theSource, theJob.source, theStats);
+    const string imagetype = image.Type();
+
+    CropInfo info;
+    unique_ptr<Imagine::NFmiImage> cropped = crop_image(image, theJob.options, info);
+    if (cropped.get() == 0)
+      cropped.reset(new Imagine::NFmiImage(image));
+
+    unique_ptr<Imagine::NFmiImage> scaled = scale_image(*cropped, theJob.options, info);
+    if (scaled.get() != 0)
+      cropped = std::move(scaled);
+
+    decorate_image(*cropped, theJob.options, info, theJob.source);
+    finish_image(*cropped, theJob.options, imagetype);
+
+    check_deadline("encode");
+    {
+      StageTimer timer("encode");
+      cropped->Write(theJob.output, imagetype);
+    }
+    bytes = NFmiFileSystem::FileSize(theJob.output);
+    theStats.bytes += bytes;
+    theStats.timings.add(timings);
+  }
+  catch (CropperException& e)
+  {
+    status = e.status();
+    ++theStats.failed;
+    metrics_count(BatchFailures);
+    lock_guard<mutex> lock(theStats.output_lock);
+    cerr << theManifest << ":" << theJob.line << ": " << e.status() << ' ' << e.what() << endl;
+  }
+  catch (exception& e)
+  {
+    status = 409;
+    ++theStats.failed;
+    metrics_count(BatchFailures);
+    lock_guard<mutex> lock(theStats.output_lock);
+    cerr << theManifest << ":" << theJob.line << ": " << e.what() << endl;
+  }
+
+  metrics_count(BatchJobs);
+  log_request(status == 200 ? "batch" : "error", status, bytes, theJob.query.c_str());
+
+  // Release the source once no job needs it anymore
+
+  if (--theSource.pending == 0)
+  {
+    lock_guard<mutex> lock(theSource.lock);
+    theSource.image.reset();
+  }
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Render all the jobs in the given manifest
+ *
+ * \param theManifest The manifest file
+ * \param theThreads The number of threads, 0 for the number of cores
+ * \return 0 if all jobs succeeded, 1 otherwise
+ */
+// ----------------------------------------------------------------------
+
+int batch(const string& theManifest, unsigned int theThreads)
+{
+  const auto start = chrono::steady_clock::now();
+
+  vector<Job> jobs = read_manifest(theManifest);
+
+  // Group the jobs by settings and then by source
+
+  stable_sort(jobs.begin(),
+              jobs.end(),
+              [](const Job& a, const Job& b)
+              {
+                if (a.timezone != b.timezone)
+                  return a.timezone < b.timezone;
+                if (a.locale != b.locale)
+                  return a.locale < b.locale;
+                return a.source < b.source;
+              });
+
+  unsigned int threads = theThreads;
+  if (threads == 0)
+    threads = max(1U, thread::hardware_concurrency());
+
+  const int prefetch = max(0, NFmiSettings::Optional<int>("cropper::io::prefetch", 4));
+
+  scheduler_threads(threads);
+  RequestContext context(
+      BackgroundPriority,
+      chrono::milliseconds(NFmiSettings::Optional<int>("cropper::batch::deadline", 0)));
+
+  Statistics stats;
+  start_log_flusher();
+  cache_timestamps();
+
+  // Process each timezone and locale combination in turn
+
+  for (size_t first = 0; first < jobs.size();)
+  {
+    size_t last = first + 1;
+    while (last < jobs.size() && jobs[last].same_settings(jobs[first]))
+      ++last;
+
+    if (!jobs[first].timezone.empty())
+      set_timezone(jobs[first].timezone);
+    setlocale(LC_TIME, jobs[first].locale.empty() ? "C" : jobs[first].locale.c_str());
+
+    Sources sources;
+    vector<string> order;
+    for (size_t i = first; i < last; i++)
+    {
+      unique_ptr<Source>& source = sources[jobs[i].source];
+      if (!source)
+      {
+        source.reset(new Source);
+        order.push_back(jobs[i].source);
+        prefetch_overlays(jobs[i].options);
+      }
+      ++source->pending;
+    }
+
+    // Sources are decoded roughly in job order, keep the readahead a window ahead
+
+    const size_t window = min<size_t>(prefetch, order.size());
+    for (size_t k = 0; k < window; k++)
+      prefetch_file(order[k]);
+    for (size_t k = 0; window > 0 && k + window < order.size(); k++)
+      sources[order[k]]->ahead = order[k + window];
+
+    // Jobs are sorted by source, hence the workers tend to share sources
+
+    parallel_for(last - first,
+                 [&](size_t k)
+                 {
+                   const Job& job = jobs[first + k];
+                   render(job, *sources.find(job.source)->second, theManifest, stats);
+                 });
+
+    first = last;
+  }
+
+  stop_log_flusher();
+
+  // Summary
+
+  const double seconds =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  cout << "Jobs: " << jobs.size() << " (" << stats.failed << " failed)" << endl
+       << "Sources decoded: " << stats.decoded << endl
+       << "Threads: " << threads << endl
+       << fixed << setprecision(3) << "Time: " << seconds << " s" << endl
+       << setprecision(1) << "Throughput: " << (seconds > 0 ? jobs.size() / seconds : 0)
+       << " images/s" << endl
+       << "Output: " << stats.bytes / (1024.0 * 1024.0) << " MB" << endl;
+
+  stats.timings.report(cout);
+
+  return (stats.failed > 0 ? 1 : 0);
+}
+
+// ======================================================================
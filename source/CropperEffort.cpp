@@ -0,0 +1,177 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Automatic choice of the PNG encoder effort
+ *
+ * A fixed -z level is too slow for large photographic crops and too
+ * lax for small flat ones. With z=auto, or for all requests without -z
+ * when cropper::effort::auto is set, a sample of the image is inspected
+ * for its number of distinct colors and the entropy of the horizontal
+ * differences, and the deflate level, filtering and palette use are
+ * chosen to fit the encoding into cropper::effort::budget milliseconds
+ * (default 10).
+ *
+ * The cost model is deliberately simple: an approximate deflate cost
+ * per byte for each level, scaled down for redundant data. The chosen
+ * parameters are added to the request log record so that the policy
+ * can be tuned offline.
+ */
+// ======================================================================
+
+#include "CropperEffort.h"
+#include "CropperTimings.h"
+
+#include <imagine/NFmiColorTools.h>
+#include <newbase/NFmiSettings.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+#include <unordered_set>
+
+extern "C"
+{
+#include <zlib.h>
+}
+
+using namespace std;
+
+namespace
+{
+// Approximate deflate cost in nanoseconds per input byte for levels 0-9
+const double deflate_cost[10] = {0.5, 4, 5, 6, 8, 11, 16, 22, 40, 70};
+
+// Approximate cost of choosing the row filters per byte
+const double filter_cost = 2;
+
+// The sample size
+const int sample_rows = 64;
+const int sample_columns = 1024;
+
+const size_t max_palette = 256;
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A summary of the choice for the logs
+ *
+ * Only the parameters given to the encoder are listed, so that the
+ * logs used for tuning do not record choices which were never used.
+ */
+// ----------------------------------------------------------------------
+
+string EncoderEffort::summary() const
+{
+  ostringstream out;
+  out << "effort=z" << level << (palette ? ",palette" : "");
+  if (filters)
+    out << (filter ? ",filter" : ",nofilter") << ",strategy:" << strategy;
+  out << ",colors:" << colors << fixed << setprecision(2) << ",entropy:" << entropy
+      << ",estimate:" << estimate;
+  return out.str();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether the encoder effort is to be chosen automatically
+ */
+// ----------------------------------------------------------------------
+
+bool auto_effort(const Options& theOptions)
+{
+  if (theOptions.has('z'))
+    return (theOptions.get('z') == "auto");
+  return NFmiSettings::Optional<bool>("cropper::effort::auto", false);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Choose the encoder parameters for an image
+ *
+ * Images with at most 256 colors are saved with a palette and without
+ * row filters, which the PNG specification recommends for palette
+ * images. Other images are filtered, and the palette is not attempted
+ * since counting their colors would be wasted work.
+ *
+ * \param theImage The image to encode
+ * \param theFrames The number of similar images to encode
+ * \param thePalette False if the encoder always writes RGBA
+ * \param theFilters False if the encoder chooses the filters and strategy itself
+ * \return The chosen parameters
+ */
+// ----------------------------------------------------------------------
+
+EncoderEffort choose_effort(const Imagine::NFmiImage& theImage,
+                            int theFrames,
+                            bool thePalette,
+                            bool theFilters)
+{
+  using namespace Imagine::NFmiColorTools;
+
+  const int width = theImage.Width();
+  const int height = theImage.Height();
+
+  // Sample rows evenly, and a contiguous run of pixels from the middle of each
+
+  unordered_set<Color> colors;
+  colors.reserve(2 * max_palette);
+  size_t histogram[256] = {};
+  size_t samples = 0;
+
+  const int ystep = max(1, height / sample_rows);
+  const int columns = min(width, sample_columns);
+  const int x1 = (width - columns) / 2;
+
+  for (int j = 0; j < height; j += ystep)
+  {
+    Color previous = theImage(x1, j);
+    for (int i = x1; i < x1 + columns; i++)
+    {
+      const Color c = theImage(i, j);
+      if (colors.size() <= max_palette)
+        colors.insert(c);
+      for (int shift = 0; shift < 32; shift += 8)
+        ++histogram[((c >> shift) - (previous >> shift)) & 0xff];
+      previous = c;
+      samples += 4;
+    }
+  }
+
+  EncoderEffort effort;
+  effort.colors = static_cast<int>(colors.size());
+
+  for (const size_t count : histogram)
+    if (count > 0)
+    {
+      const double p = static_cast<double>(count) / samples;
+      effort.entropy -= p * log2(p);
+    }
+
+  effort.palette = (thePalette && colors.size() <= max_palette);
+  effort.filter = (colors.size() > max_palette);
+  effort.strategy = (effort.filter ? Z_FILTERED : Z_DEFAULT_STRATEGY);
+  effort.filters = theFilters;
+
+  // The most effort fitting into the budget, but at least level 1
+
+  const double budget = NFmiSettings::Optional<double>("cropper::effort::budget", 10.0);
+  const double bytes = static_cast<double>(width) * height * (effort.palette ? 1 : 4) * theFrames;
+  const double redundancy = 0.3 + 0.7 * effort.entropy / 8;
+
+  const auto estimate = [&](int level)
+  { return bytes * (deflate_cost[level] * redundancy + (effort.filter ? filter_cost : 0)) / 1e6; };
+
+  effort.level = Z_BEST_COMPRESSION;
+  while (effort.level > Z_BEST_SPEED && estimate(effort.level) > budget)
+    --effort.level;
+  effort.estimate = estimate(effort.level);
+
+  if (Timings* timings = Timings::current())
+    timings->note(effort.summary());
+
+  return effort;
+}
+
+// ======================================================================
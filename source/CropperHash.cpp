@@ -0,0 +1,197 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Fast non-cryptographic hashing
+ *
+ * The hash is MurmurHash3 x64_128 by Austin Appleby, which is in the
+ * public domain. It is used for cache keys only, authentication must
+ * use the keyed digests in WebAuthenticator.
+ */
+// ======================================================================
+
+#include "CropperHash.h"
+
+#include <cstring>
+
+using namespace std;
+
+namespace
+{
+inline uint64_t rotl64(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t fmix64(uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+inline uint64_t load64(const unsigned char* p)
+{
+  uint64_t k;
+  memcpy(&k, p, sizeof(k));  // little endian hosts only
+  return k;
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The hash as 32 hexadecimal digits
+ */
+// ----------------------------------------------------------------------
+
+const string Hash128::hex() const
+{
+  static const char digits[] = "0123456789abcdef";
+
+  string ret(32, '0');
+  for (int i = 0; i < 16; i++)
+  {
+    ret[15 - i] = digits[(h1 >> (4 * i)) & 15];
+    ret[31 - i] = digits[(h2 >> (4 * i)) & 15];
+  }
+  return ret;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Hash a block of memory
+ */
+// ----------------------------------------------------------------------
+
+Hash128 hash128(const void* theData, size_t theLength, uint64_t theSeed)
+{
+  const unsigned char* data = static_cast<const unsigned char*>(theData);
+  const size_t nblocks = theLength / 16;
+
+  const uint64_t c1 = 0x87c37b91114253d5ULL;
+  const uint64_t c2 = 0x4cf5ad432745937fULL;
+
+  uint64_t h1 = theSeed;
+  uint64_t h2 = theSeed;
+
+  for (size_t i = 0; i < nblocks; i++)
+  {
+    uint64_t k1 = load64(data + 16 * i);
+    uint64_t k2 = load64(data + 16 * i + 8);
+
+    k1 *= c1;
+    k1 = rotl64(k1, 31);
+    k1 *= c2;
+    h1 ^= k1;
+
+    h1 = rotl64(h1, 27);
+    h1 += h2;
+    h1 = h1 * 5 + 0x52dce729;
+
+    k2 *= c2;
+    k2 = rotl64(k2, 33);
+    k2 *= c1;
+    h2 ^= k2;
+
+    h2 = rotl64(h2, 31);
+    h2 += h1;
+    h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  // The remaining 0-15 bytes
+
+  const unsigned char* tail = data + 16 * nblocks;
+  uint64_t k1 = 0;
+  uint64_t k2 = 0;
+
+  switch (theLength & 15)
+  {
+    case 15:
+      k2 ^= static_cast<uint64_t>(tail[14]) << 48;
+      // fall through
+    case 14:
+      k2 ^= static_cast<uint64_t>(tail[13]) << 40;
+      // fall through
+    case 13:
+      k2 ^= static_cast<uint64_t>(tail[12]) << 32;
+      // fall through
+    case 12:
+      k2 ^= static_cast<uint64_t>(tail[11]) << 24;
+      // fall through
+    case 11:
+      k2 ^= static_cast<uint64_t>(tail[10]) << 16;
+      // fall through
+    case 10:
+      k2 ^= static_cast<uint64_t>(tail[9]) << 8;
+      // fall through
+    case 9:
+      k2 ^= static_cast<uint64_t>(tail[8]);
+      k2 *= c2;
+      k2 = rotl64(k2, 33);
+      k2 *= c1;
+      h2 ^= k2;
+      // fall through
+    case 8:
+      k1 ^= static_cast<uint64_t>(tail[7]) << 56;
+      // fall through
+    case 7:
+      k1 ^= static_cast<uint64_t>(tail[6]) << 48;
+      // fall through
+    case 6:
+      k1 ^= static_cast<uint64_t>(tail[5]) << 40;
+      // fall through
+    case 5:
+      k1 ^= static_cast<uint64_t>(tail[4]) << 32;
+      // fall through
+    case 4:
+      k1 ^= static_cast<uint64_t>(tail[3]) << 24;
+      // fall through
+    case 3:
+      k1 ^= static_cast<uint64_t>(tail[2]) << 16;
+      // fall through
+    case 2:
+      k1 ^= static_cast<uint64_t>(tail[1]) << 8;
+      // fall through
+    case 1:
+      k1 ^= static_cast<uint64_t>(tail[0]);
+      k1 *= c1;
+      k1 = rotl64(k1, 31);
+      k1 *= c2;
+      h1 ^= k1;
+  }
+
+  // Finalization
+
+  h1 ^= theLength;
+  h2 ^= theLength;
+
+  h1 += h2;
+  h2 += h1;
+
+  h1 = fmix64(h1);
+  h2 = fmix64(h2);
+
+  h1 += h2;
+  h2 += h1;
+
+  Hash128 ret;
+  ret.h1 = h1;
+  ret.h2 = h2;
+  return ret;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Hash a string
+ */
+// ----------------------------------------------------------------------
+
+Hash128 hash128(const string& theData, uint64_t theSeed)
+{
+  return hash128(theData.data(), theData.size(), theSeed);
+}
+
+// ======================================================================
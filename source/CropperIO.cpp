@@ -0,0 +1,170 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief File status, readahead hints and deferred cache writes
+ *
+ * A request touches the same files several times: existence, size and
+ * modification time used to be separate stat calls, and sources and
+ * overlays were read only when the decoder got to them. Here a single
+ * stat returns all the metadata, and files about to be needed can be
+ * hinted to the kernel so that their pages are read in the background
+ * while the request is busy with something else.
+ *
+ * Writes to the secondary caches (sidecars, tiles and undecorated
+ * rasters) do not affect the response. They are queued and run once
+ * the response has been sent, when in CGI mode after redirecting the
+ * standard output to /dev/null so that the web server can complete the response
+ * without waiting for them. The caches written this way are swept at
+ * most once per interval, shared by all processes.
+ */
+// ======================================================================
+
+#include "CropperIO.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+extern "C"
+{
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+using namespace std;
+
+namespace
+{
+// Deferred writes of the current request
+vector<function<void()> > deferred_writes;
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Get the status of a file with a single stat call
+ */
+// ----------------------------------------------------------------------
+
+FileStatus file_status(const string& theFile)
+{
+  FileStatus status;
+  struct stat st;
+  if (stat(theFile.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+  {
+    status.exists = true;
+    status.size = st.st_size;
+    status.modtime = st.st_mtime;
+  }
+  return status;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Ask the kernel to read a file into the page cache
+ *
+ * Returns immediately, the pages are read in the background.
+ * Failures are ignored, the hint only affects speed.
+ */
+// ----------------------------------------------------------------------
+
+void prefetch_file(const string& theFile)
+{
+  const int fd = open(theFile.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  close(fd);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether a cache directory is due for a sweep
+ *
+ * The time of the last sweep is kept in the modification time of a
+ * hidden stamp file, so that the processes of all requests share it.
+ * The stamp is updated when the sweep is found to be due, hence
+ * usually only one process sweeps. A lost race only costs a second
+ * sweep.
+ *
+ * \param theDirectory The cache directory
+ * \param theInterval The minimum time between sweeps in seconds
+ * \return True if the caller should sweep now
+ */
+// ----------------------------------------------------------------------
+
+bool sweep_due(const string& theDirectory, time_t theInterval)
+{
+  const string stamp = theDirectory + "/.sweep";
+  struct stat st;
+  if (stat(stamp.c_str(), &st) == 0 && st.st_mtime + theInterval > time(nullptr))
+    return false;
+
+  const int fd = open(stamp.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return false;
+  futimens(fd, nullptr);
+  close(fd);
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Queue a cache write to be run after the response
+ *
+ * Not thread safe, only the single image path defers writes.
+ * The task must capture everything it needs by value.
+ */
+// ----------------------------------------------------------------------
+
+void defer_write(function<void()> theTask)
+{
+  deferred_writes.push_back(std::move(theTask));
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Run the deferred writes once the response is complete
+ *
+ * Failures are ignored, the caches only affect speed.
+ */
+// ----------------------------------------------------------------------
+
+void finish_deferred_writes()
+{
+  if (deferred_writes.empty())
+    return;
+
+  // Detach the response by pointing the standard output to /dev/null.
+  // Merely closing it would let the cache files reuse the descriptor,
+  // and any later output would then land inside them.
+
+  cout.flush();
+  if (getenv("QUERY_STRING") != nullptr)
+  {
+    fflush(stdout);
+    const int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+      dup2(fd, STDOUT_FILENO);
+      close(fd);
+    }
+  }
+
+  vector<function<void()> > tasks;
+  tasks.swap(deferred_writes);
+  for (auto& task : tasks)
+  {
+    try
+    {
+      task();
+    }
+    catch (...)
+    {
+    }
+  }
+}
+
+// ======================================================================
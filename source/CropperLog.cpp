@@ -0,0 +1,379 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Non-blocking structured request logging
+ *
+ * One record is written per request once the outcome is known:
+ * \code
+ * outcome=render status=200 bytes=12345 decode=3.120 crop=0.410 total=9.870 query=...
+ * \endcode
+ * The records are sent as datagrams directly to the syslog socket.
+ * A CGI process sends its single record without waiting, and batch
+ * mode pushes the records into a lock free ring drained by a
+ * background thread. In both cases records are dropped instead of
+ * blocking the rendering when the syslog daemon cannot keep up.
+ *
+ * The records are enabled by cropper::syslog::active. The level
+ * cropper::syslog::level selects the outcomes as before: new images
+ * and errors at level 1, cached and unmodified images at level 2 and
+ * not modified responses at level 3. Events such as configuration
+ * reloads are logged at level 1 with priority notice.
+ */
+// ======================================================================
+
+#include "CropperLog.h"
+#include "CropperMetrics.h"
+#include "CropperTimings.h"
+
+#include <newbase/NFmiSettings.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <sstream>
+#include <thread>
+
+extern "C"
+{
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <syslog.h>
+#include <unistd.h>
+}
+
+using namespace std;
+
+namespace
+{
+const char* default_logsocket = "/dev/log";
+
+// Capacity of the batch mode ring, must be a power of two
+const size_t ring_size = 4096;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The syslog level required for logging the outcome
+ */
+// ----------------------------------------------------------------------
+
+int required_level(const string& theOutcome)
+{
+  if (theOutcome == "not_modified")
+    return 3;
+  if (theOutcome == "passthrough" || theOutcome == "cache_hit" || theOutcome == "head")
+    return 2;
+  return 1;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Format the header of a syslog datagram
+ *
+ * The month names are not taken from strftime, since LC_TIME may
+ * have been changed for the timestamps in the image.
+ */
+// ----------------------------------------------------------------------
+
+string format_header(int thePriority)
+{
+  static const char* months[] = {
+      "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+  const time_t now = time(nullptr);
+  struct tm tm;
+  localtime_r(&now, &tm);
+
+  char stamp[32];
+  snprintf(stamp,
+           sizeof(stamp),
+           "%s %2d %02d:%02d:%02d",
+           months[tm.tm_mon],
+           tm.tm_mday,
+           tm.tm_hour,
+           tm.tm_min,
+           tm.tm_sec);
+
+  ostringstream out;
+  out << '<' << (LOG_LOCAL2 | thePriority) << '>' << stamp << " cropper[" << getpid() << "]: ";
+  return out.str();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Format a syslog datagram of a request
+ */
+// ----------------------------------------------------------------------
+
+string format_record(const string& theOutcome,
+                     int theStatus,
+                     size_t theBytes,
+                     const char* theQuery)
+{
+  ostringstream out;
+  out << format_header(LOG_INFO) << "outcome=" << theOutcome << " status=" << theStatus
+      << " bytes=" << theBytes;
+
+  if (const Timings* timings = Timings::current())
+    out << ' ' << timings->summary();
+
+  out << " query=" << (theQuery != nullptr ? theQuery : "-");
+  return out.str();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Datagram socket to the syslog daemon
+ */
+// ----------------------------------------------------------------------
+
+class LogSocket
+{
+ public:
+  LogSocket() : itsSocket(socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0))
+  {
+    const string path =
+        NFmiSettings::Optional<string>("cropper::syslog::socket", default_logsocket);
+    memset(&itsAddress, 0, sizeof(itsAddress));
+    itsAddress.sun_family = AF_UNIX;
+    strncpy(itsAddress.sun_path, path.c_str(), sizeof(itsAddress.sun_path) - 1);
+  }
+
+  ~LogSocket()
+  {
+    if (itsSocket >= 0)
+      close(itsSocket);
+  }
+
+  // Returns false if the record was not sent
+  bool send(const string& theRecord, bool theWait)
+  {
+    if (itsSocket < 0)
+      return false;
+    return (sendto(itsSocket,
+                   theRecord.data(),
+                   theRecord.size(),
+                   (theWait ? 0 : MSG_DONTWAIT) | MSG_NOSIGNAL,
+                   reinterpret_cast<const sockaddr*>(&itsAddress),
+                   sizeof(itsAddress)) >= 0);
+  }
+
+ private:
+  LogSocket(const LogSocket& theOther);
+  LogSocket& operator=(const LogSocket& theOther);
+
+  int itsSocket;
+  sockaddr_un itsAddress;
+};
+
+LogSocket& log_socket()
+{
+  static LogSocket sock;
+  return sock;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Bounded lock free ring of records
+ *
+ * Any number of threads may push, a single thread pops. Each slot
+ * carries a sequence number telling whether it is free for the
+ * producer of the given position or full for the consumer.
+ */
+// ----------------------------------------------------------------------
+
+class LogRing
+{
+ public:
+  LogRing() : itsHead(0), itsTail(0)
+  {
+    for (size_t i = 0; i < ring_size; i++)
+      itsSlots[i].sequence.store(i, memory_order_relaxed);
+  }
+
+  // Returns false if the ring is full
+  bool push(string& theRecord)
+  {
+    size_t pos = itsTail.load(memory_order_relaxed);
+    for (;;)
+    {
+      Slot& slot = itsSlots[pos & (ring_size - 1)];
+      const size_t seq = slot.sequence.load(memory_order_acquire);
+      const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0)
+      {
+        if (itsTail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+        {
+          slot.record.swap(theRecord);
+          slot.sequence.store(pos + 1, memory_order_release);
+          return true;
+        }
+      }
+      else if (diff < 0)
+        return false;
+      else
+        pos = itsTail.load(memory_order_relaxed);
+    }
+  }
+
+  // Returns false if the ring is empty
+  bool pop(string& theRecord)
+  {
+    Slot& slot = itsSlots[itsHead & (ring_size - 1)];
+    if (slot.sequence.load(memory_order_acquire) != itsHead + 1)
+      return false;
+    theRecord.clear();
+    theRecord.swap(slot.record);
+    slot.sequence.store(itsHead + ring_size, memory_order_release);
+    ++itsHead;
+    return true;
+  }
+
+ private:
+  struct Slot
+  {
+    atomic<size_t> sequence;
+    string record;
+  };
+
+  Slot itsSlots[ring_size];
+  size_t itsHead;  // only accessed by the consumer
+  atomic<size_t> itsTail;
+};
+
+// The ring is active only while the flusher is running
+unique_ptr<LogRing> ring;
+atomic<LogRing*> active_ring{nullptr};
+atomic<bool> flushing{false};
+thread flusher;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Drain the ring until stopped
+ */
+// ----------------------------------------------------------------------
+
+void flush_loop()
+{
+  string record;
+  for (;;)
+  {
+    const bool running = flushing.load();
+    bool sent = false;
+    while (ring->pop(record))
+    {
+      sent = true;
+      if (!log_socket().send(record, true))
+        metrics_count(LogRecordsDropped);
+    }
+    if (!running)
+      break;
+    if (!sent)
+      this_thread::sleep_for(chrono::milliseconds(10));
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Send a record or queue it for the flusher, dropping it if neither succeeds
+ */
+// ----------------------------------------------------------------------
+
+void deliver(string& theRecord)
+{
+  bool sent;
+  if (LogRing* r = active_ring.load(memory_order_acquire))
+    sent = r->push(theRecord);
+  else
+    sent = log_socket().send(theRecord, false);
+
+  if (!sent)
+    metrics_count(LogRecordsDropped);
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Log the outcome of a request
+ *
+ * Never blocks, the record is dropped if it cannot be delivered.
+ *
+ * \param theOutcome The outcome of the request
+ * \param theStatus The HTTP status
+ * \param theBytes The size of the response body
+ * \param theQuery The query string, may be null
+ */
+// ----------------------------------------------------------------------
+
+void log_request(const string& theOutcome, int theStatus, size_t theBytes, const char* theQuery)
+{
+  if (!NFmiSettings::Optional<bool>("cropper::syslog::active", false) ||
+      NFmiSettings::Optional<int>("cropper::syslog::level", 0) < required_level(theOutcome))
+    return;
+
+  string record = format_record(theOutcome, theStatus, theBytes, theQuery);
+
+  deliver(record);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Log an event not tied to the outcome of a request
+ *
+ * Delivered like the request records and never blocks.
+ *
+ * \param theEvent The fields of the record, for example "event=reload"
+ */
+// ----------------------------------------------------------------------
+
+void log_event(const string& theEvent)
+{
+  if (!NFmiSettings::Optional<bool>("cropper::syslog::active", false) ||
+      NFmiSettings::Optional<int>("cropper::syslog::level", 0) < 1)
+    return;
+
+  string record = format_header(LOG_NOTICE) + theEvent;
+
+  deliver(record);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Start buffering records for a background thread
+ *
+ * Used by the multithreaded modes so that the rendering threads
+ * never wait for the syslog daemon.
+ */
+// ----------------------------------------------------------------------
+
+void start_log_flusher()
+{
+  if (flushing.exchange(true))
+    return;
+  ring.reset(new LogRing);
+  active_ring.store(ring.get(), memory_order_release);
+  flusher = thread(flush_loop);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Flush the buffered records and stop the background thread
+ *
+ * Must not be called while requests are still being logged.
+ */
+// ----------------------------------------------------------------------
+
+void stop_log_flusher()
+{
+  if (!flushing.exchange(false))
+    return;
+  flusher.join();
+  active_ring.store(nullptr, memory_order_release);
+  ring.reset();
+}
+
+// ======================================================================
@@ -0,0 +1,419 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Request counters shared between cropper processes
+ *
+ * Each CGI request is a separate process, hence the counters live in
+ * a memory mapped file, by default in /dev/shm. The counters are
+ * lock free atomics which every process increments directly, and the
+ * cropper_metrics program exports them in the Prometheus text format.
+ *
+ * The file is set with cropper::metrics::file, an empty value disables
+ * the metrics. Failing to open the file is not an error, the counts
+ * are then simply lost.
+ */
+// ======================================================================
+
+#include "CropperMetrics.h"
+
+#include <newbase/NFmiSettings.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <mutex>
+#include <string>
+#include <utility>
+
+extern "C"
+{
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+using namespace std;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Shared counters require lock free 64-bit atomics");
+
+namespace
+{
+const char* default_metricsfile = "/dev/shm/smartmet-cropper.metrics";
+
+// HTTP status codes are counted individually
+const int max_status = 600;
+
+// Render time bucket k counts times up to 2^k milliseconds
+const int render_buckets = 16;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The layout of the shared memory block
+ */
+// ----------------------------------------------------------------------
+
+struct Block
+{
+  atomic<uint64_t> magic;
+  atomic<uint64_t> counters[MetricCount];
+  atomic<uint64_t> errors[max_status];
+  atomic<uint64_t> render_counts[render_buckets + 1];  // the last one is +Inf
+  atomic<uint64_t> render_microseconds;
+};
+
+// Identifies the layout, a different layout must use a new file
+const uint64_t block_magic = 0x43524f5000000000ULL + sizeof(Block);
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief How a counter is exported
+ *
+ * Counters sharing a name are exported as one Prometheus metric with a
+ * distinguishing label. Each counter has an explicit entry, the table
+ * is checked at compile time to list them in the enum order.
+ */
+// ----------------------------------------------------------------------
+
+struct MetricLabel
+{
+  Metric id;
+  const char* name;   // the Prometheus metric
+  const char* label;  // the label within the metric, or empty
+  const char* help;
+};
+
+constexpr MetricLabel metric_labels[] = {
+    {PassthroughRequests,
+     "cropper_requests_total",
+     "outcome=\"passthrough\"",
+     "Successful requests by outcome"},
+    {NotModifiedRequests,
+     "cropper_requests_total",
+     "outcome=\"not_modified\"",
+     "Successful requests by outcome"},
+    {CacheHitRequests,
+     "cropper_requests_total",
+     "outcome=\"cache_hit\"",
+     "Successful requests by outcome"},
+    {RenderRequests,
+     "cropper_requests_total",
+     "outcome=\"render\"",
+     "Successful requests by outcome"},
+    {AnimationRequests,
+     "cropper_requests_total",
+     "outcome=\"animation\"",
+     "Successful requests by outcome"},
+    {MultipartRequests,
+     "cropper_requests_total",
+     "outcome=\"multipart\"",
+     "Successful requests by outcome"},
+    {PassthroughBytes,
+     "cropper_response_bytes_total",
+     "outcome=\"passthrough\"",
+     "Response body bytes by outcome"},
+    {CacheHitBytes,
+     "cropper_response_bytes_total",
+     "outcome=\"cache_hit\"",
+     "Response body bytes by outcome"},
+    {RenderBytes,
+     "cropper_response_bytes_total",
+     "outcome=\"render\"",
+     "Response body bytes by outcome"},
+    {CacheFilesWritten,
+     "cropper_cache_files_written_total",
+     "",
+     "Renderings stored in the cache"},
+    {CacheBytesWritten,
+     "cropper_cache_bytes_written_total",
+     "",
+     "Bytes stored in the cache"},
+    {BatchJobs,
+     "cropper_batch_jobs_total",
+     "",
+     "Batch mode jobs"},
+    {BatchFailures,
+     "cropper_batch_failures_total",
+     "",
+     "Failed batch mode jobs"},
+    {LogRecordsDropped,
+     "cropper_log_records_dropped_total",
+     "",
+     "Log records dropped under backpressure"},
+    {RasterCacheHits,
+     "cropper_raster_cache_requests_total",
+     "result=\"hit\"",
+     "Undecorated raster cache lookups"},
+    {RasterCacheMisses,
+     "cropper_raster_cache_requests_total",
+     "result=\"miss\"",
+     "Undecorated raster cache lookups"},
+    {RasterCacheBytesWritten,
+     "cropper_raster_cache_bytes_written_total",
+     "",
+     "Bytes stored in the raster cache"},
+    {RasterCacheBytesEvicted,
+     "cropper_raster_cache_bytes_evicted_total",
+     "",
+     "Bytes evicted from the raster cache"},
+    {HeadRequests,
+     "cropper_head_requests_total",
+     "",
+     "HEAD requests answered without a body"},
+    {RangeRequests,
+     "cropper_range_requests_total",
+     "",
+     "Partial content responses"},
+    {InteractiveTasksQueued,
+     "cropper_scheduler_tasks_total",
+     "class=\"interactive\"",
+     "Render tasks queued by priority class"},
+    {BackgroundTasksQueued,
+     "cropper_scheduler_tasks_total",
+     "class=\"background\"",
+     "Render tasks queued by priority class"},
+    {InteractiveTasksStarted,
+     "cropper_scheduler_tasks_started_total",
+     "class=\"interactive\"",
+     "Render tasks started by priority class"},
+    {BackgroundTasksStarted,
+     "cropper_scheduler_tasks_started_total",
+     "class=\"background\"",
+     "Render tasks started by priority class"},
+    {DeadlineDrops,
+     "cropper_deadline_drops_total",
+     "",
+     "Requests dropped after their deadline"},
+    {NegativeCacheHits,
+     "cropper_negative_cache_requests_total",
+     "result=\"hit\"",
+     "Negative cache lookups"},
+    {NegativeCacheMisses,
+     "cropper_negative_cache_requests_total",
+     "result=\"miss\"",
+     "Negative cache lookups"},
+    {NegativeCacheStores,
+     "cropper_negative_cache_stores_total",
+     "",
+     "Failures stored in the negative cache"},
+    {NegativeCacheEvictions,
+     "cropper_negative_cache_evictions_total",
+     "",
+     "Entries removed from the negative cache"},
+};
+
+static_assert(sizeof(metric_labels) / sizeof(*metric_labels) == MetricCount,
+              "Every metric needs an export label");
+
+constexpr bool labels_in_order()
+{
+  for (int i = 0; i < MetricCount; i++)
+    if (metric_labels[i].id != i)
+      return false;
+  return true;
+}
+
+static_assert(labels_in_order(), "Metric export labels must be in the enum order");
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The metrics file name
+ */
+// ----------------------------------------------------------------------
+
+string metrics_file()
+{
+  return NFmiSettings::Optional<string>("cropper::metrics::file", default_metricsfile);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Map the block into memory
+ *
+ * \param theWritable True if the block is to be updated
+ * \return The block, or null if not available
+ */
+// ----------------------------------------------------------------------
+
+Block* map_block(bool theWritable)
+{
+  const string filename = metrics_file();
+  if (filename.empty())
+    return nullptr;
+
+  const int flags = (theWritable ? (O_RDWR | O_CREAT) : O_RDONLY);
+  const int fd = open(filename.c_str(), flags | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return nullptr;
+
+  // Simultaneous creators extend the file identically, new pages are zero
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      (st.st_size < static_cast<off_t>(sizeof(Block)) &&
+       (!theWritable || ftruncate(fd, sizeof(Block)) != 0)))
+  {
+    close(fd);
+    return nullptr;
+  }
+
+  void* ptr = mmap(nullptr,
+                   sizeof(Block),
+                   theWritable ? (PROT_READ | PROT_WRITE) : PROT_READ,
+                   MAP_SHARED,
+                   fd,
+                   0);
+  close(fd);
+  if (ptr == MAP_FAILED)
+    return nullptr;
+
+  Block* block = static_cast<Block*>(ptr);
+
+  uint64_t magic = 0;
+  if (theWritable)
+    block->magic.compare_exchange_strong(magic, block_magic);
+  else
+    magic = block->magic.load();
+
+  if (magic != 0 && magic != block_magic)
+  {
+    munmap(ptr, sizeof(Block));
+    return nullptr;
+  }
+
+  return block;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The block for updating the counters
+ */
+// ----------------------------------------------------------------------
+
+Block* writable_block()
+{
+  static once_flag flag;
+  static Block* block = nullptr;
+  call_once(flag, []() { block = map_block(true); });
+  return block;
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Increment a counter
+ */
+// ----------------------------------------------------------------------
+
+void metrics_count(Metric theMetric, size_t theAmount)
+{
+  if (Block* block = writable_block())
+    block->counters[theMetric].fetch_add(theAmount, memory_order_relaxed);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Count an error response
+ */
+// ----------------------------------------------------------------------
+
+void metrics_error(int theStatus)
+{
+  if (Block* block = writable_block())
+    block->errors[(theStatus > 0 && theStatus < max_status) ? theStatus : 0].fetch_add(
+        1, memory_order_relaxed);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Record the time taken by a new rendering
+ */
+// ----------------------------------------------------------------------
+
+void metrics_render_time(double theMilliseconds)
+{
+  Block* block = writable_block();
+  if (block == nullptr)
+    return;
+
+  int k = 0;
+  for (double limit = 1; k < render_buckets && theMilliseconds > limit; limit *= 2)
+    ++k;
+
+  block->render_counts[k].fetch_add(1, memory_order_relaxed);
+  block->render_microseconds.fetch_add(static_cast<uint64_t>(1000 * theMilliseconds),
+                                       memory_order_relaxed);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Print the counters in the Prometheus text format
+ *
+ * \return False if the metrics are not available
+ */
+// ----------------------------------------------------------------------
+
+bool metrics_export(ostream& theOutput)
+{
+  const Block* block = map_block(false);
+  if (block == nullptr)
+    return false;
+
+  const char* previous = "";
+  for (const MetricLabel& metric : metric_labels)
+  {
+    if (strcmp(metric.name, previous) != 0)
+      theOutput << "# HELP " << metric.name << ' ' << metric.help << '\n'
+                << "# TYPE " << metric.name << " counter\n";
+    previous = metric.name;
+
+    theOutput << metric.name;
+    if (*metric.label != '\0')
+      theOutput << '{' << metric.label << '}';
+    theOutput << ' ' << block->counters[metric.id].load() << '\n';
+  }
+
+  theOutput << "# HELP cropper_errors_total Error responses by HTTP status\n"
+            << "# TYPE cropper_errors_total counter\n";
+  for (int status = 0; status < max_status; status++)
+  {
+    const uint64_t count = block->errors[status].load();
+    if (count > 0)
+      theOutput << "cropper_errors_total{status=\"" << status << "\"} " << count << '\n';
+  }
+
+  // Queued tasks not started yet
+
+  theOutput << "# HELP cropper_scheduler_queue_depth Render tasks waiting by priority class\n"
+            << "# TYPE cropper_scheduler_queue_depth gauge\n";
+  for (const auto& counts : {make_pair(InteractiveTasksQueued, InteractiveTasksStarted),
+                             make_pair(BackgroundTasksQueued, BackgroundTasksStarted)})
+  {
+    const uint64_t queued = block->counters[counts.first].load();
+    const uint64_t started = block->counters[counts.second].load();
+    theOutput << "cropper_scheduler_queue_depth{" << metric_labels[counts.first].label << "} "
+              << (queued > started ? queued - started : 0) << '\n';
+  }
+
+  theOutput << "# HELP cropper_render_seconds Time taken by new renderings\n"
+            << "# TYPE cropper_render_seconds histogram\n";
+  uint64_t cumulative = 0;
+  double limit = 0.001;
+  for (int k = 0; k < render_buckets; k++, limit *= 2)
+  {
+    cumulative += block->render_counts[k].load();
+    theOutput << "cropper_render_seconds_bucket{le=\"" << limit << "\"} " << cumulative << '\n';
+  }
+  cumulative += block->render_counts[render_buckets].load();
+  theOutput << "cropper_render_seconds_bucket{le=\"+Inf\"} " << cumulative << '\n'
+            << "cropper_render_seconds_sum " << fixed << setprecision(6)
+            << block->render_microseconds.load() / 1e6 << '\n'
+            << "cropper_render_seconds_count " << cumulative << '\n';
+
+  munmap(const_cast<Block*>(block), sizeof(Block));
+  return true;
+}
+
+// ======================================================================
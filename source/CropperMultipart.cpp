@@ -0,0 +1,160 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Several crops from a single decoded image
+ *
+ * Any of the geometry options p, l, c or g may list several geometries
+ * separated by ';'. The source image is then decoded only once, each
+ * geometry is cropped and decorated in parallel, and the crops are
+ * returned as parts of a single multipart/mixed response in the same
+ * order as the geometries.
+ *
+ * The option L may similarly list a separate label set for each crop.
+ * If only one label set is given, it is used for all the crops.
+ */
+// ======================================================================
+
+#include "CropperMultipart.h"
+#include "CropperException.h"
+#include "CropperThreads.h"
+
+#include <imagine/NFmiImage.h>
+#include <newbase/NFmiStringTools.h>
+
+#include <charconv>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+// The boundary never appears in PNG or JPEG data in practise, and
+// identifies cached multipart responses.
+
+const string multipart_boundary = "cropper-7b1d5f0e2a9c";
+
+namespace
+{
+const char geometry_options[] = {'p', 'l', 'c', 'g'};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Append a header line with a numeric value
+ */
+// ----------------------------------------------------------------------
+
+void append_header(pmr::string& theBody, const char* theName, size_t theValue, const char* theEnd)
+{
+  char buffer[24];
+  const to_chars_result result = to_chars(buffer, buffer + sizeof(buffer), theValue);
+  theBody.append(theName).append(buffer, result.ptr).append(theEnd);
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether several crops are requested
+ */
+// ----------------------------------------------------------------------
+
+bool has_multiple_geometries(const Options& theOptions)
+{
+  for (const char name : geometry_options)
+    if (theOptions.get(name).find(';') != string_view::npos)
+      return true;
+  return false;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Render all the requested crops into a multipart response body
+ *
+ * \param theImage The decoded source image
+ * \param theOptions The parsed options
+ * \param theFilename The source image name for timestamps
+ * \param theType The image type of the parts
+ * \return The multipart body, allocated from the request arena
+ */
+// ----------------------------------------------------------------------
+
+pmr::string render_multipart(const Imagine::NFmiImage& theImage,
+                             const Options& theOptions,
+                             const string& theFilename,
+                             const string& theType)
+{
+  // Establish the geometries
+
+  char option = 0;
+  vector<string_view> geometries;
+  for (const char name : geometry_options)
+  {
+    if (theOptions.has(name))
+    {
+      option = name;
+      geometries.clear();
+      Tokenizer tokens(theOptions.get(name), ";");
+      string_view geometry;
+      while (tokens.next(geometry))
+        geometries.push_back(geometry);
+    }
+  }
+
+  // And the label sets
+
+  vector<string_view> labels;
+  if (theOptions.has('L'))
+  {
+    Tokenizer tokens(theOptions.get('L'), ";");
+    string_view label;
+    while (tokens.next(label))
+      labels.push_back(label);
+    if (labels.size() != 1 && labels.size() != geometries.size())
+      throw CropperException(400, "Option L must have one label set or one for each geometry");
+  }
+
+  // Render the crops
+
+  vector<string> parts(geometries.size());
+
+  parallel_for(geometries.size(),
+               [&](size_t i)
+               {
+                 // The views point into the buffer of theOptions, so set appends copies
+                 Options options = theOptions;
+                 options.set(option, geometries[i]);
+                 if (!labels.empty())
+                   options.set('L', labels[labels.size() == 1 ? 0 : i]);
+
+                 CropInfo info;
+                 unique_ptr<Imagine::NFmiImage> cropped = crop_image(theImage, options, info);
+                 unique_ptr<Imagine::NFmiImage> scaled = scale_image(*cropped, options, info);
+                 if (scaled.get() != 0)
+                   cropped = std::move(scaled);
+                 decorate_image(*cropped, options, info, theFilename);
+                 finish_image(*cropped, options, theType);
+                 parts[i] = encode_image(*cropped, theType);
+               });
+
+  // Assemble the response in a single allocation
+
+  const size_t part_headers = 128 + multipart_boundary.size() + theType.size();
+  size_t size = part_headers;
+  for (const string& part : parts)
+    size += part_headers + part.size();
+
+  pmr::string body(RequestArena::current());
+  body.reserve(size);
+  for (size_t i = 0; i < parts.size(); i++)
+  {
+    body.append("--").append(multipart_boundary).append("\r\n");
+    body.append("Content-Type: image/").append(theType).append("\r\n");
+    append_header(body, "Content-Disposition: inline; name=\"", i, "\"\r\n");
+    append_header(body, "Content-Length: ", parts[i].size(), "\r\n");
+    body.append("\r\n").append(parts[i]).append("\r\n");
+  }
+  body.append("--").append(multipart_boundary).append("--\r\n");
+
+  return body;
+}
+
+// ======================================================================
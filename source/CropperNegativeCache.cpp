@@ -0,0 +1,284 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Short lived cache of failed requests
+ *
+ * Some clients retry failed requests in tight loops. Each retry used
+ * to run the pipeline up to the failure again, for example reloading
+ * the coordinate database for an unknown place name or decoding the
+ * source before noticing a missing map. Client errors (400, 404 and
+ * 410) are therefore remembered for cropper::negative::ttl seconds,
+ * and a repeated query fails with the same status and message without
+ * doing any work. Server errors are not cached, they may well be gone
+ * on the next try.
+ *
+ * Missing files (404 and 410) depend on the sources and label sets
+ * instead of the query alone. Their entries therefore record the modification times of
+ * the sources, and are replayed only while the sources are unchanged,
+ * so a source appearing within the TTL is served at once.
+ *
+ * The entries are keyed by the canonical query and stored one per file
+ * in cropper::negative::dir, since each CGI request is a separate
+ * process. The number of entries is bounded by
+ * cropper::negative::maxentries, enforced by sweeps run at most once a
+ * minute, which remove expired entries and then the oldest ones. A zero
+ * TTL disables the cache.
+ */
+// ======================================================================
+
+#include "CropperNegativeCache.h"
+#include "CropperHash.h"
+#include "CropperIO.h"
+#include "CropperMetrics.h"
+
+#include <newbase/NFmiFileSystem.h>
+#include <newbase/NFmiSettings.h>
+#include <newbase/NFmiStringTools.h>
+
+#include <algorithm>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <vector>
+
+extern "C"
+{
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+using namespace std;
+
+namespace
+{
+const char* default_negative_dir = "/tmp/cropper/negative";
+const int default_negative_ttl = 30;
+const int default_negative_maxentries = 10000;
+const time_t sweep_interval = 60;
+
+// The entry of the query being processed, empty if the cache is not in use
+string current_file;
+string current_query;
+
+// The state of the sources of the query, empty if unknown
+string current_state;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The time to live in seconds, zero if the cache is disabled
+ */
+// ----------------------------------------------------------------------
+
+int ttl()
+{
+  return max(0, NFmiSettings::Optional<int>("cropper::negative::ttl", default_negative_ttl));
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether an error depends on the state of the sources
+ */
+// ----------------------------------------------------------------------
+
+bool file_dependent(int theStatus)
+{
+  return (theStatus == 404 || theStatus == 410);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The modification times of the sources, '-' for missing ones
+ */
+// ----------------------------------------------------------------------
+
+string source_state(const vector<string>& theSources)
+{
+  ostringstream out;
+  for (const string& source : theSources)
+  {
+    const FileStatus status = file_status(source);
+    if (out.tellp() > 0)
+      out << ',';
+    if (status.exists)
+      out << status.modtime;
+    else
+      out << '-';
+  }
+  return out.str();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether an error is worth remembering
+ */
+// ----------------------------------------------------------------------
+
+bool cacheable(int theStatus)
+{
+  return (theStatus == 400 || (file_dependent(theStatus) && !current_state.empty()));
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Remove expired entries and the oldest ones beyond the limit
+ */
+// ----------------------------------------------------------------------
+
+void sweep(const string& theDirectory, size_t theMaxEntries, time_t theExpired)
+{
+  struct Entry
+  {
+    time_t modtime;
+    string path;
+  };
+
+  vector<Entry> entries;
+
+  DIR* top = opendir(theDirectory.c_str());
+  if (top == nullptr)
+    return;
+
+  while (dirent* sub = readdir(top))
+  {
+    if (sub->d_name[0] == '.')
+      continue;
+    const string subdir = theDirectory + "/" + sub->d_name;
+    DIR* dir = opendir(subdir.c_str());
+    if (dir == nullptr)
+      continue;
+    while (dirent* file = readdir(dir))
+    {
+      struct stat st;
+      const string path = subdir + "/" + file->d_name;
+      if (file->d_name[0] == '.' || stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        continue;
+      if (st.st_mtime <= theExpired)
+      {
+        if (unlink(path.c_str()) == 0)
+          metrics_count(NegativeCacheEvictions);
+      }
+      else
+        entries.push_back(Entry{st.st_mtime, path});
+    }
+    closedir(dir);
+  }
+  closedir(top);
+
+  if (entries.size() <= theMaxEntries)
+    return;
+
+  // Leave some room so that the next store does not trigger a new sweep
+
+  sort(entries.begin(),
+       entries.end(),
+       [](const Entry& a, const Entry& b) { return a.modtime < b.modtime; });
+
+  const size_t excess = entries.size() - (theMaxEntries - theMaxEntries / 10);
+  for (size_t i = 0; i < excess; i++)
+    if (unlink(entries[i].path.c_str()) == 0)
+      metrics_count(NegativeCacheEvictions);
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Fail the query if it failed recently
+ *
+ * The query is remembered so that a failure can be stored by
+ * negative_cache_store once it has been caught. Missing files are
+ * remembered only if the sources are known, and are replayed only while
+ * the sources are unchanged.
+ *
+ * \param theQuery The canonical query
+ * \param theSources The files or directories the query reads, empty if unknown
+ */
+// ----------------------------------------------------------------------
+
+void negative_cache_check(const string& theQuery, const vector<string>& theSources)
+{
+  const int seconds = ttl();
+  if (seconds == 0)
+    return;
+
+  const string hex = hash128(theQuery).hex();
+  current_file =
+      (NFmiSettings::Optional<string>("cropper::negative::dir", default_negative_dir) + "/" +
+       hex.substr(0, 2) + "/" + hex);
+  current_query = theQuery;
+  current_state = source_state(theSources);
+
+  // The entry holds the status, the query to guard against collisions,
+  // the state of the sources and the message
+
+  struct stat st;
+  if (stat(current_file.c_str(), &st) == 0 && st.st_mtime + seconds > time(nullptr))
+  {
+    ifstream in(current_file.c_str());
+    int status = 0;
+    string query;
+    string state;
+    if (in >> status && in.ignore() && getline(in, query) && query == theQuery &&
+        getline(in, state) && (!file_dependent(status) || state == current_state))
+    {
+      const string message((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+      metrics_count(NegativeCacheHits);
+      current_file.clear();
+      throw CropperException(status, message);
+    }
+  }
+  metrics_count(NegativeCacheMisses);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Remember the failure of the checked query
+ *
+ * Written immediately, the error response is short and there are no
+ * deferred writes after a failure. Failures are ignored, the cache
+ * only affects speed.
+ *
+ * \param theError The error the query failed with
+ */
+// ----------------------------------------------------------------------
+
+void negative_cache_store(const CropperException& theError)
+{
+  if (current_file.empty() || !cacheable(theError.status()))
+    return;
+
+  const string filename = current_file;
+  current_file.clear();
+
+  const string directory = filename.substr(0, filename.rfind('/'));
+  if (!NFmiFileSystem::CreateDirectory(directory))
+    return;
+
+  const string tmpfile = filename + "." + NFmiStringTools::Convert(::getpid());
+  ofstream out(tmpfile.c_str());
+  out << theError.status() << '\n'
+      << current_query << '\n'
+      << current_state << '\n'
+      << theError.what();
+  out.close();
+  if (!out)
+  {
+    NFmiFileSystem::RemoveFile(tmpfile);
+    return;
+  }
+  NFmiFileSystem::RenameFile(tmpfile, filename);
+  metrics_count(NegativeCacheStores);
+
+  const string top = directory.substr(0, directory.rfind('/'));
+  if (sweep_due(top, sweep_interval))
+  {
+    const size_t maxentries = max(1,
+                                  NFmiSettings::Optional<int>("cropper::negative::maxentries",
+                                                              default_negative_maxentries));
+    sweep(top, maxentries, time(nullptr) - ttl());
+  }
+}
+
+// ======================================================================
@@ -0,0 +1,343 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Request options and allocation free parsing helpers
+ */
+// ======================================================================
+
+#include "CropperOptions.h"
+#include "CropperException.h"
+
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+
+using namespace std;
+
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Value of a hexadecimal digit, or -1
+ */
+// ----------------------------------------------------------------------
+
+int hexvalue(char theChar)
+{
+  if (theChar >= '0' && theChar <= '9')
+    return theChar - '0';
+  if (theChar >= 'a' && theChar <= 'f')
+    return theChar - 'a' + 10;
+  if (theChar >= 'A' && theChar <= 'F')
+    return theChar - 'A' + 10;
+  return -1;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Append an URL encoded string in decoded form
+ *
+ * A '+' is kept as is, since it is the separator in geometries.
+ */
+// ----------------------------------------------------------------------
+
+void append_decoded(pmr::string& theBuffer, string_view theValue)
+{
+  for (size_t i = 0; i < theValue.size(); i++)
+  {
+    int hi, lo;
+    if (theValue[i] == '%' && i + 2 < theValue.size() &&
+        (hi = hexvalue(theValue[i + 1])) >= 0 && (lo = hexvalue(theValue[i + 2])) >= 0)
+    {
+      theBuffer += static_cast<char>(16 * hi + lo);
+      i += 2;
+    }
+    else
+      theBuffer += theValue[i];
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Skip a leading plus sign, which from_chars does not accept
+ */
+// ----------------------------------------------------------------------
+
+string_view skip_plus(string_view theString)
+{
+  if (theString.size() > 1 && theString[0] == '+' && theString[1] != '-')
+    theString.remove_prefix(1);
+  return theString;
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Parse a query string
+ *
+ * \param theQueryString The query string, for example f=file.png&g=10x10+0+0
+ */
+// ----------------------------------------------------------------------
+
+Options::Options(string_view theQueryString)
+{
+  itsBuffer.reserve(theQueryString.size());
+
+  Tokenizer parts(theQueryString, "&");
+  string_view part;
+  while (parts.next(part))
+  {
+    if (part.empty())
+      continue;
+
+    const string_view::size_type pos = part.find('=');
+    const string_view name = part.substr(0, pos);
+    const string_view value = (pos == string_view::npos ? string_view() : part.substr(pos + 1));
+
+    if (name.size() != 1 || index(name[0]) < 0)
+    {
+      ++itsUnknown;
+      continue;
+    }
+
+    Slot& s = itsSlots[index(name[0])];
+    if (!s.set)
+      ++itsCount;
+    s.set = true;
+    s.offset = itsBuffer.size();
+    append_decoded(itsBuffer, value);
+    s.length = itsBuffer.size() - s.offset;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The slot index of an option, or -1 for unknown options
+ */
+// ----------------------------------------------------------------------
+
+int Options::index(char theOption)
+{
+  if (theOption >= 'a' && theOption <= 'z')
+    return theOption - 'a';
+  if (theOption >= 'A' && theOption <= 'Z')
+    return theOption - 'A' + 26;
+  return -1;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The slot of a set option, or null
+ */
+// ----------------------------------------------------------------------
+
+const Options::Slot* Options::slot(char theOption) const
+{
+  const int i = index(theOption);
+  if (i < 0 || !itsSlots[i].set)
+    return nullptr;
+  return &itsSlots[i];
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The value of an option, empty if not set
+ *
+ * The view is valid until the options are modified.
+ */
+// ----------------------------------------------------------------------
+
+string_view Options::get(char theOption) const
+{
+  const Slot* s = slot(theOption);
+  if (s == nullptr)
+    return string_view();
+  return string_view(itsBuffer).substr(s->offset, s->length);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the value of an option
+ *
+ * A value which is a part of another option value is not copied.
+ */
+// ----------------------------------------------------------------------
+
+void Options::set(char theOption, string_view theValue)
+{
+  const int i = index(theOption);
+  if (i < 0)
+    throw CropperException(400, string("Invalid option name '") + theOption + "'");
+
+  Slot& s = itsSlots[i];
+  if (!s.set)
+    ++itsCount;
+  s.set = true;
+
+  const char* begin = itsBuffer.data();
+  if (theValue.data() >= begin && theValue.data() + theValue.size() <= begin + itsBuffer.size())
+    s.offset = theValue.data() - begin;
+  else
+  {
+    s.offset = itsBuffer.size();
+    itsBuffer.append(theValue.data(), theValue.size());
+  }
+  s.length = theValue.size();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Remove an option
+ */
+// ----------------------------------------------------------------------
+
+void Options::erase(char theOption)
+{
+  const int i = index(theOption);
+  if (i >= 0 && itsSlots[i].set)
+  {
+    itsSlots[i] = Slot();
+    --itsCount;
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Get the next part
+ *
+ * \return False if there are no more parts
+ */
+// ----------------------------------------------------------------------
+
+bool Tokenizer::next(string_view& thePart)
+{
+  if (itsDone)
+    return false;
+
+  const string_view::size_type pos = itsString.find(itsDelimiter, itsPos);
+  if (pos == string_view::npos)
+  {
+    thePart = itsString.substr(itsPos);
+    itsDone = true;
+  }
+  else
+  {
+    thePart = itsString.substr(itsPos, pos - itsPos);
+    itsPos = pos + itsDelimiter.size();
+  }
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Split a string into a fixed size array of parts
+ *
+ * \param theString The string to split
+ * \param theDelimiter The delimiter
+ * \param theParts The array for the parts
+ * \param theMaxParts The size of the array
+ * \return The total number of parts, which may exceed theMaxParts
+ */
+// ----------------------------------------------------------------------
+
+size_t split(string_view theString,
+             string_view theDelimiter,
+             string_view* theParts,
+             size_t theMaxParts)
+{
+  Tokenizer tokens(theString, theDelimiter);
+  size_t n = 0;
+  string_view part;
+  while (tokens.next(part))
+  {
+    if (n < theMaxParts)
+      theParts[n] = part;
+    ++n;
+  }
+  return n;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Parse a number, the whole string must be consumed
+ *
+ * \return False on failure
+ */
+// ----------------------------------------------------------------------
+
+bool parse_number(string_view theString, int& theValue)
+{
+  theString = skip_plus(theString);
+  const char* end = theString.data() + theString.size();
+  const from_chars_result result = from_chars(theString.data(), end, theValue);
+  return result.ec == errc() && result.ptr == end && !theString.empty();
+}
+
+bool parse_number(string_view theString, unsigned int& theValue)
+{
+  theString = skip_plus(theString);
+  const char* end = theString.data() + theString.size();
+  const from_chars_result result = from_chars(theString.data(), end, theValue);
+  return result.ec == errc() && result.ptr == end && !theString.empty();
+}
+
+bool parse_number(string_view theString, uintmax_t& theValue)
+{
+  theString = skip_plus(theString);
+  const char* end = theString.data() + theString.size();
+  const from_chars_result result = from_chars(theString.data(), end, theValue);
+  return result.ec == errc() && result.ptr == end && !theString.empty();
+}
+
+bool parse_number(string_view theString, double& theValue)
+{
+  theString = skip_plus(theString);
+  if (theString.empty())
+    return false;
+
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+  const char* end = theString.data() + theString.size();
+  const from_chars_result result = from_chars(theString.data(), end, theValue);
+  return result.ec == errc() && result.ptr == end;
+#else
+  // Older standard libraries support only integers in from_chars
+  char buffer[64];
+  if (theString.size() >= sizeof(buffer))
+    return false;
+  memcpy(buffer, theString.data(), theString.size());
+  buffer[theString.size()] = '\0';
+  char* end;
+  theValue = strtod(buffer, &end);
+  return end == buffer + theString.size();
+#endif
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Parse a number or throw
+ *
+ * \param theString The string to parse
+ * \param theOption The option being parsed, for error messages
+ */
+// ----------------------------------------------------------------------
+
+int to_int(string_view theString, const char* theOption)
+{
+  int value;
+  if (!parse_number(theString, value))
+    throw CropperException(400,
+                           "Invalid integer '" + string(theString) + "' in option " + theOption);
+  return value;
+}
+
+double to_double(string_view theString, const char* theOption)
+{
+  double value;
+  if (!parse_number(theString, value))
+    throw CropperException(400,
+                           "Invalid number '" + string(theString) + "' in option " + theOption);
+  return value;
+}
+
+// ======================================================================
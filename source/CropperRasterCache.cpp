@@ -0,0 +1,374 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Cache of undecorated cropped rasters
+ *
+ * Clients request the same crop with different labels, timestamps and
+ * locales. The cropped image is therefore cached before it is decorated,
+ * so that the variants only need to draw and encode.
+ *
+ * The rasters are stored lightly compressed, keyed by the source image
+ * and the geometry option, in the directory cropper::rastercache::dir.
+ * The tier has its own byte budget cropper::rastercache::maxbytes, zero
+ * disables it. The budget is enforced by sweeps run after a store at
+ * most once a minute, which remove the least recently used rasters.
+ * Stores are written after the response has been sent.
+ */
+// ======================================================================
+
+#include "CropperRasterCache.h"
+#include "CropperHash.h"
+#include "CropperIO.h"
+#include "CropperMetrics.h"
+#include "CropperTimings.h"
+
+#include <imagine/NFmiImage.h>
+#include <newbase/NFmiFileSystem.h>
+#include <newbase/NFmiSettings.h>
+#include <newbase/NFmiStringTools.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+extern "C"
+{
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#include <zlib.h>
+}
+
+using namespace std;
+
+namespace
+{
+const char* default_rastercache_dir = "/tmp/cropper/raster";
+const uint64_t default_rastercache_maxbytes = 256 * 1024 * 1024;
+
+// Minimum time between sweeps in seconds
+const time_t sweep_interval = 60;
+
+// The options which are applied after cropping
+const char* decoration_options = "ALIMSTZz";
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The header of a cached raster
+ *
+ * The files are local to the host, hence native byte order is used.
+ */
+// ----------------------------------------------------------------------
+
+struct Header
+{
+  char magic[4];
+  uint32_t typelength;  // length of the image type following the header
+  int64_t modtime;      // modification time of the source image
+  int32_t width;
+  int32_t height;
+  int32_t xoff;
+  int32_t yoff;
+  int32_t xm;
+  int32_t ym;
+  int32_t has_center;
+  uint32_t datasize;  // size of the compressed pixels following the type
+};
+
+const char raster_magic[4] = {'C', 'R', 'R', '1'};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The byte budget, zero if the tier is disabled
+ */
+// ----------------------------------------------------------------------
+
+uint64_t max_bytes()
+{
+  return NFmiSettings::Optional<uint64_t>("cropper::rastercache::maxbytes",
+                                          default_rastercache_maxbytes);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The geometry option of the request, or 0
+ */
+// ----------------------------------------------------------------------
+
+char geometry_option(const Options& theOptions)
+{
+  for (const char name : {'p', 'l', 'c', 'g'})
+    if (theOptions.has(name))
+      return name;
+  return 0;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The file name of the raster, empty if the tier is not used
+ *
+ * The tier is used only for crops which are decorated, otherwise the
+ * final cache covers the request.
+ */
+// ----------------------------------------------------------------------
+
+const string raster_file(const Options& theOptions, const string& theSource, Hash128& theHash)
+{
+  const char option = geometry_option(theOptions);
+  if (option == 0 || max_bytes() == 0)
+    return "";
+
+  bool decorated = false;
+  for (const char* name = decoration_options; *name != '\0'; ++name)
+    decorated |= theOptions.has(*name);
+  if (!decorated)
+    return "";
+
+  const string_view geometry = theOptions.get(option);
+  const Hash128 geometryhash = hash128(geometry.data(), geometry.size(), option);
+  theHash = hash128(theSource, geometryhash.h1 ^ geometryhash.h2);
+
+  const string hex = theHash.hex();
+  return (NFmiSettings::Optional<string>("cropper::rastercache::dir", default_rastercache_dir) +
+          "/" + hex.substr(0, 2) + "/" + hex);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Remove the least recently used rasters until within the budget
+ */
+// ----------------------------------------------------------------------
+
+void sweep(const string& theDirectory, uint64_t theBudget)
+{
+  struct Entry
+  {
+    time_t modtime;
+    uint64_t size;
+    string path;
+  };
+
+  vector<Entry> entries;
+  uint64_t total = 0;
+
+  DIR* top = opendir(theDirectory.c_str());
+  if (top == nullptr)
+    return;
+
+  while (dirent* sub = readdir(top))
+  {
+    if (sub->d_name[0] == '.')
+      continue;
+    const string subdir = theDirectory + "/" + sub->d_name;
+    DIR* dir = opendir(subdir.c_str());
+    if (dir == nullptr)
+      continue;
+    while (dirent* file = readdir(dir))
+    {
+      struct stat st;
+      const string path = subdir + "/" + file->d_name;
+      if (file->d_name[0] != '.' && stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+      {
+        entries.push_back(Entry{st.st_mtime, static_cast<uint64_t>(st.st_size), path});
+        total += st.st_size;
+      }
+    }
+    closedir(dir);
+  }
+  closedir(top);
+
+  if (total <= theBudget)
+    return;
+
+  // Leave some room so that the next store does not trigger a new sweep
+
+  sort(entries.begin(),
+       entries.end(),
+       [](const Entry& a, const Entry& b) { return a.modtime < b.modtime; });
+
+  const uint64_t target = theBudget - theBudget / 10;
+  for (const Entry& entry : entries)
+  {
+    if (total <= target)
+      break;
+    if (unlink(entry.path.c_str()) == 0)
+    {
+      total -= entry.size;
+      metrics_count(RasterCacheBytesEvicted, entry.size);
+    }
+  }
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Load the undecorated crop of the request
+ *
+ * \param theOptions The parsed options
+ * \param theSource The source image
+ * \param theInfo Returns the projection and offsets of the crop
+ * \param theType Returns the type of the source image
+ * \return The cropped image, or an empty pointer if not cached
+ */
+// ----------------------------------------------------------------------
+
+unique_ptr<Imagine::NFmiImage> raster_cache_load(const Options& theOptions,
+                                                 const string& theSource,
+                                                 CropInfo& theInfo,
+                                                 string& theType)
+{
+  Hash128 hash;
+  const string filename = raster_file(theOptions, theSource, hash);
+  if (filename.empty())
+    return nullptr;
+
+  StageTimer timer("raster");
+
+  ifstream in(filename.c_str(), ios::in | ios::binary);
+  Header header;
+  if (!in || !in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+      memcmp(header.magic, raster_magic, sizeof(raster_magic)) != 0 ||
+      header.modtime != NFmiFileSystem::FileModificationTime(theSource))
+  {
+    metrics_count(RasterCacheMisses);
+    return nullptr;
+  }
+
+  string type(header.typelength, '\0');
+  string data(header.datasize, '\0');
+  vector<int32_t> pixels(static_cast<size_t>(header.width) * header.height);
+  uLongf size = pixels.size() * sizeof(int32_t);
+
+  if (!in.read(&type[0], type.size()) || !in.read(&data[0], data.size()) ||
+      uncompress(reinterpret_cast<Bytef*>(pixels.data()),
+                 &size,
+                 reinterpret_cast<const Bytef*>(data.data()),
+                 data.size()) != Z_OK ||
+      size != pixels.size() * sizeof(int32_t))
+  {
+    metrics_count(RasterCacheMisses);
+    return nullptr;
+  }
+
+  unique_ptr<Imagine::NFmiImage> image(new Imagine::NFmiImage(header.width, header.height));
+  const int32_t* ptr = pixels.data();
+  for (int j = 0; j < header.height; j++)
+    for (int i = 0; i < header.width; i++)
+      (*image)(i, j) = *ptr++;
+
+  // The projection is needed for labels
+
+  theInfo = CropInfo();
+  const char option = geometry_option(theOptions);
+  if (option == 'p' || option == 'l')
+  {
+    const string_view geometry = theOptions.get(option);
+    theInfo.area = create_map(geometry.substr(geometry.rfind(':') + 1));
+  }
+  theInfo.has_center = (header.has_center != 0);
+  theInfo.xm = header.xm;
+  theInfo.ym = header.ym;
+  theInfo.xoff = header.xoff;
+  theInfo.yoff = header.yoff;
+  theType = type;
+
+  // Mark as recently used for the sweeps
+
+  utime(filename.c_str(), nullptr);
+  metrics_count(RasterCacheHits);
+  return image;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Store the undecorated crop of the request
+ *
+ * The pixels are copied immediately, since the caller goes on to
+ * decorate the image, but compressing and writing them is deferred
+ * until the response has been sent. Failures are ignored, the cache
+ * only affects speed.
+ *
+ * \param theOptions The parsed options
+ * \param theSource The source image
+ * \param theImage The cropped image
+ * \param theInfo The offsets of the crop
+ * \param theType The type of the source image
+ */
+// ----------------------------------------------------------------------
+
+void raster_cache_store(const Options& theOptions,
+                        const string& theSource,
+                        const Imagine::NFmiImage& theImage,
+                        const CropInfo& theInfo,
+                        const string& theType)
+{
+  Hash128 hash;
+  const string filename = raster_file(theOptions, theSource, hash);
+  if (filename.empty())
+    return;
+
+  vector<int32_t> pixels;
+  pixels.reserve(static_cast<size_t>(theImage.Width()) * theImage.Height());
+  for (int j = 0; j < theImage.Height(); j++)
+    for (int i = 0; i < theImage.Width(); i++)
+      pixels.push_back(theImage(i, j));
+
+  Header header;
+  memcpy(header.magic, raster_magic, sizeof(raster_magic));
+  header.typelength = theType.size();
+  header.modtime = NFmiFileSystem::FileModificationTime(theSource);
+  header.width = theImage.Width();
+  header.height = theImage.Height();
+  header.xoff = theInfo.xoff;
+  header.yoff = theInfo.yoff;
+  header.xm = theInfo.xm;
+  header.ym = theInfo.ym;
+  header.has_center = theInfo.has_center;
+  header.datasize = 0;
+
+  defer_write(
+      [filename, header, theType, pixels = std::move(pixels)]() mutable
+      {
+        StageTimer timer("raster");
+
+        string data(compressBound(pixels.size() * sizeof(int32_t)), '\0');
+        uLongf size = data.size();
+        if (compress2(reinterpret_cast<Bytef*>(&data[0]),
+                      &size,
+                      reinterpret_cast<const Bytef*>(pixels.data()),
+                      pixels.size() * sizeof(int32_t),
+                      Z_BEST_SPEED) != Z_OK)
+          return;
+        data.resize(size);
+        header.datasize = data.size();
+
+        const string directory = filename.substr(0, filename.rfind('/'));
+        if (!NFmiFileSystem::CreateDirectory(directory))
+          return;
+
+        const string tmpfile = filename + "." + NFmiStringTools::Convert(::getpid());
+        ofstream out(tmpfile.c_str(), ios::out | ios::binary);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out << theType << data;
+        out.close();
+        if (!out)
+        {
+          NFmiFileSystem::RemoveFile(tmpfile);
+          return;
+        }
+        NFmiFileSystem::RenameFile(tmpfile, filename);
+
+        const uint64_t bytes = sizeof(header) + theType.size() + data.size();
+        metrics_count(RasterCacheBytesWritten, bytes);
+
+        const string top = directory.substr(0, directory.rfind('/'));
+        if (sweep_due(top, sweep_interval))
+          sweep(top, max_bytes());
+      });
+}
+
+// ======================================================================
@@ -0,0 +1,264 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Resampling of cropped images
+ *
+ * Images are resampled separably, first the rows and then the columns.
+ * The colors are converted to floats premultiplied by the opacity so
+ * that transparent pixels do not bleed their color into the result.
+ * Every output pixel uses the same number of taps, the weights of taps
+ * outside the support are zero, so that the inner loops have a fixed
+ * shape the compiler can vectorize. The vertical pass accumulates whole
+ * rows at a time for the same reason.
+ */
+// ======================================================================
+
+#include "CropperResample.h"
+#include "CropperException.h"
+#include "CropperHash.h"
+
+#include <imagine/NFmiColorTools.h>
+#include <newbase/NFmiSettings.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+const int channels = 4;  // premultiplied red, green, blue and opacity
+
+const char* default_pyramid_dir = "/tmp/cropper/pyramid";
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Filter taps of every output pixel along one axis
+ */
+// ----------------------------------------------------------------------
+
+struct Taps
+{
+  int count = 0;          // taps per output pixel
+  vector<int> first;      // the first input pixel of each output pixel
+  vector<float> weights;  // count weights per output pixel
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The value of a kernel
+ */
+// ----------------------------------------------------------------------
+
+double kernel_value(ResampleKernel theKernel, double x)
+{
+  if (theKernel == BoxKernel)
+    return (x >= -0.5 && x < 0.5 ? 1.0 : 0.0);
+
+  x = fabs(x);
+  if (x < 1e-8)
+    return 1.0;
+  if (x >= 3.0)
+    return 0.0;
+  const double px = M_PI * x;
+  return 3.0 * sin(px) * sin(px / 3.0) / (px * px);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Calculate the taps for resampling an axis
+ *
+ * When downscaling the kernel is stretched to cover all input pixels.
+ *
+ * \param theInput The input size
+ * \param theOutput The output size
+ * \param theKernel The kernel
+ */
+// ----------------------------------------------------------------------
+
+Taps make_taps(int theInput, int theOutput, ResampleKernel theKernel)
+{
+  const double scale = static_cast<double>(theOutput) / theInput;
+  const double stretch = max(1.0, 1.0 / scale);
+  const double support = (theKernel == BoxKernel ? 0.5 : 3.0) * stretch;
+
+  Taps taps;
+  taps.count = min(theInput, static_cast<int>(ceil(2 * support)) + 1);
+  taps.first.resize(theOutput);
+  taps.weights.resize(static_cast<size_t>(theOutput) * taps.count);
+
+  for (int i = 0; i < theOutput; i++)
+  {
+    const double center = (i + 0.5) / scale;
+    const int left = max(0, static_cast<int>(floor(center - support)));
+    const int first = min(left, theInput - taps.count);
+    float* weights = &taps.weights[static_cast<size_t>(i) * taps.count];
+
+    double sum = 0;
+    for (int k = 0; k < taps.count; k++)
+    {
+      const double w = kernel_value(theKernel, (first + k + 0.5 - center) / stretch);
+      weights[k] = static_cast<float>(w);
+      sum += w;
+    }
+
+    if (sum > 0)
+    {
+      for (int k = 0; k < taps.count; k++)
+        weights[k] = static_cast<float>(weights[k] / sum);
+    }
+    else
+    {
+      // Only possible when upscaling with the box kernel
+      const int nearest = min(theInput - 1, static_cast<int>(center));
+      weights[nearest - first] = 1;
+    }
+    taps.first[i] = first;
+  }
+  return taps;
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Parse a kernel name
+ */
+// ----------------------------------------------------------------------
+
+ResampleKernel resample_kernel(string_view theName)
+{
+  if (theName.empty() || theName == "lanczos")
+    return LanczosKernel;
+  if (theName == "box")
+    return BoxKernel;
+  throw CropperException(400, "Unknown resampling kernel '" + string(theName) + "'");
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Resample an image to the given size
+ *
+ * \param theImage The image to resample
+ * \param theWidth The new width
+ * \param theHeight The new height
+ * \param theKernel The kernel
+ * \return The resampled image
+ */
+// ----------------------------------------------------------------------
+
+unique_ptr<Imagine::NFmiImage> resample_image(const Imagine::NFmiImage& theImage,
+                                              int theWidth,
+                                              int theHeight,
+                                              ResampleKernel theKernel)
+{
+  using namespace Imagine::NFmiColorTools;
+
+  const int width = theImage.Width();
+  const int height = theImage.Height();
+
+  const Taps xtaps = make_taps(width, theWidth, theKernel);
+  const Taps ytaps = make_taps(height, theHeight, theKernel);
+
+  // Premultiply the source
+
+  vector<float> source(static_cast<size_t>(width) * height * channels);
+  float* ptr = source.data();
+  for (int j = 0; j < height; j++)
+    for (int i = 0; i < width; i++)
+    {
+      const Color c = theImage(i, j);
+      const float opacity = static_cast<float>(MaxAlpha - GetAlpha(c)) / MaxAlpha;
+      *ptr++ = GetRed(c) * opacity;
+      *ptr++ = GetGreen(c) * opacity;
+      *ptr++ = GetBlue(c) * opacity;
+      *ptr++ = opacity;
+    }
+
+  // Resample the rows
+
+  const size_t rowsize = static_cast<size_t>(theWidth) * channels;
+  vector<float> rows(rowsize * height);
+  for (int j = 0; j < height; j++)
+  {
+    const float* in = &source[static_cast<size_t>(j) * width * channels];
+    float* out = &rows[j * rowsize];
+    for (int i = 0; i < theWidth; i++)
+    {
+      const float* weights = &xtaps.weights[static_cast<size_t>(i) * xtaps.count];
+      const float* pixel = in + static_cast<size_t>(xtaps.first[i]) * channels;
+      float sum[channels] = {0, 0, 0, 0};
+      for (int k = 0; k < xtaps.count; k++)
+        for (int c = 0; c < channels; c++)
+          sum[c] += weights[k] * pixel[k * channels + c];
+      for (int c = 0; c < channels; c++)
+        out[i * channels + c] = sum[c];
+    }
+  }
+
+  // Resample the columns and undo the premultiplication
+
+  unique_ptr<Imagine::NFmiImage> image(new Imagine::NFmiImage(theWidth, theHeight));
+  vector<float> sum(rowsize);
+  for (int j = 0; j < theHeight; j++)
+  {
+    fill(sum.begin(), sum.end(), 0.0f);
+    const float* weights = &ytaps.weights[static_cast<size_t>(j) * ytaps.count];
+    for (int k = 0; k < ytaps.count; k++)
+    {
+      const float w = weights[k];
+      const float* in = &rows[(ytaps.first[j] + k) * rowsize];
+      for (size_t i = 0; i < rowsize; i++)
+        sum[i] += w * in[i];
+    }
+
+    for (int i = 0; i < theWidth; i++)
+    {
+      const float* pixel = &sum[static_cast<size_t>(i) * channels];
+      const float opacity = min(1.0f, pixel[3]);
+      if (opacity <= 0.5f / MaxAlpha)
+      {
+        (*image)(i, j) = TransparentColor;
+        continue;
+      }
+      const auto channel = [opacity](float value)
+      { return static_cast<int>(lround(min(255.0f, max(0.0f, value / opacity)))); };
+      (*image)(i, j) = MakeColor(channel(pixel[0]),
+                                 channel(pixel[1]),
+                                 channel(pixel[2]),
+                                 static_cast<int>(lround(MaxAlpha * (1 - opacity))));
+    }
+  }
+
+  return image;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The file name of a downscaled level of a source image
+ *
+ * Level n is downscaled by 2^n. The levels are kept in the directory
+ * cropper::pyramid::dir, named by the hash of the source path followed
+ * by the level number and the suffix of the source, for example
+ * <hash>.level2.png. Written beside the sources they would be matched
+ * by the frame patterns of animations.
+ *
+ * \param theSource The source image
+ * \param theLevel The level
+ * \return The file name of the level
+ */
+// ----------------------------------------------------------------------
+
+const string pyramid_file(const string& theSource, int theLevel)
+{
+  const string dir = NFmiSettings::Optional<string>("cropper::pyramid::dir", default_pyramid_dir);
+  const string name = dir + "/" + hash128(theSource).hex() + ".level" + to_string(theLevel);
+
+  const string::size_type dot = theSource.rfind('.');
+  if (dot == string::npos || theSource.find('/', dot) != string::npos)
+    return name;
+  return name + theSource.substr(dot);
+}
+
+// ======================================================================
@@ -0,0 +1,230 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Memory mapped raw raster sidecars of source images
+ *
+ * Inflating the PNG is the largest fixed cost of rendering, and the
+ * same few source images are cropped over and over again. When enabled
+ * with cropper::sidecar::active the first request decoding a source
+ * writes the pixels uncompressed into a sidecar file, and later
+ * requests map the sidecar and copy only the rows of the crop window.
+ * The pages are shared by all concurrent processes via the page cache.
+ *
+ * The sidecar is written into the directory cropper::sidecar::dir
+ * (default /tmp/cropper/sidecar) named by a hash of the source path,
+ * not beside the source where frame patterns would match it and the
+ * data directories would have to be writable. The file consists of a
+ * header padded to a page, followed by rows of 32-bit Imagine colors
+ * padded to 64 bytes. The header records the size and modification
+ * time of the source, a sidecar not matching them is ignored.
+ */
+// ======================================================================
+
+#include "CropperSidecar.h"
+#include "CropperHash.h"
+
+#include <newbase/NFmiFileSystem.h>
+#include <newbase/NFmiSettings.h>
+#include <newbase/NFmiStringTools.h>
+
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+extern "C"
+{
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+using namespace std;
+
+namespace
+{
+const char* default_sidecar_dir = "/tmp/cropper/sidecar";
+
+// The pixels start at a page boundary, rows are aligned to cache lines
+const size_t data_offset = 4096;
+const size_t row_alignment = 16;  // pixels
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The header of a sidecar
+ */
+// ----------------------------------------------------------------------
+
+struct Header
+{
+  char magic[4];
+  int32_t width;
+  int32_t height;
+  uint32_t stride;  // pixels per row
+  int64_t modtime;  // modification time of the source
+  int64_t size;     // size of the source
+  char type[16];    // image type of the source
+};
+
+const char sidecar_magic[4] = {'C', 'R', 'S', '1'};
+
+static_assert(sizeof(Header) <= data_offset, "Sidecar header must fit before the pixels");
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The sidecar file name of a source image, empty if disabled
+ */
+// ----------------------------------------------------------------------
+
+const string sidecar_file(const string& theSource)
+{
+  if (!NFmiSettings::Optional<bool>("cropper::sidecar::active", false))
+    return "";
+
+  const string dir = NFmiSettings::Optional<string>("cropper::sidecar::dir", default_sidecar_dir);
+  return dir + "/" + hash128(theSource).hex() + ".raster";
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Unmap the raster
+ */
+// ----------------------------------------------------------------------
+
+MappedRaster::~MappedRaster()
+{
+  if (itsMapping != nullptr)
+    munmap(itsMapping, itsSize);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Map the sidecar of a source image
+ *
+ * \param theSource The source image
+ * \return The mapped raster, or an empty pointer if not available
+ */
+// ----------------------------------------------------------------------
+
+unique_ptr<MappedRaster> MappedRaster::open(const string& theSource)
+{
+  const string filename = sidecar_file(theSource);
+  if (filename.empty())
+    return nullptr;
+
+  struct stat source;
+  if (stat(theSource.c_str(), &source) != 0)
+    return nullptr;
+
+  const int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return nullptr;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(data_offset))
+  {
+    close(fd);
+    return nullptr;
+  }
+
+  void* ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED)
+    return nullptr;
+
+  unique_ptr<MappedRaster> raster(new MappedRaster);
+  raster->itsMapping = ptr;
+  raster->itsSize = st.st_size;
+
+  const Header* header = static_cast<const Header*>(ptr);
+  if (memcmp(header->magic, sidecar_magic, sizeof(sidecar_magic)) != 0 ||
+      header->modtime != source.st_mtime || header->size != source.st_size ||
+      header->width < 1 || header->height < 1 ||
+      header->stride < static_cast<uint32_t>(header->width) ||
+      data_offset + 4 * static_cast<size_t>(header->stride) * header->height > raster->itsSize)
+    return nullptr;
+
+  raster->itsPixels =
+      reinterpret_cast<const int32_t*>(static_cast<const char*>(ptr) + data_offset);
+  raster->itsWidth = header->width;
+  raster->itsHeight = header->height;
+  raster->itsStride = header->stride;
+  raster->itsType.assign(header->type, strnlen(header->type, sizeof(header->type)));
+  return raster;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write the sidecar of a decoded source image
+ *
+ * Failures are ignored, the sidecar only affects speed.
+ *
+ * \param theSource The source image
+ * \param theImage The decoded source image
+ */
+// ----------------------------------------------------------------------
+
+void MappedRaster::create(const string& theSource, const Imagine::NFmiImage& theImage)
+{
+  const string filename = sidecar_file(theSource);
+  if (filename.empty() || theImage.Type().size() >= sizeof(Header::type))
+    return;
+
+  struct stat source;
+  if (stat(theSource.c_str(), &source) != 0)
+    return;
+
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, sidecar_magic, sizeof(sidecar_magic));
+  header.width = theImage.Width();
+  header.height = theImage.Height();
+  header.stride = (theImage.Width() + row_alignment - 1) / row_alignment * row_alignment;
+  header.modtime = source.st_mtime;
+  header.size = source.st_size;
+  strncpy(header.type, theImage.Type().c_str(), sizeof(header.type) - 1);
+
+  const string dir = filename.substr(0, filename.rfind('/'));
+  if (!NFmiFileSystem::CreateDirectory(dir))
+    return;
+
+  const string tmpfile = filename + "." + NFmiStringTools::Convert(::getpid());
+  ofstream out(tmpfile.c_str(), ios::out | ios::binary);
+
+  vector<char> padding(data_offset - sizeof(header), '\0');
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(padding.data(), padding.size());
+
+  vector<int32_t> row(header.stride, 0);
+  for (int j = 0; j < header.height && out; j++)
+  {
+    for (int i = 0; i < header.width; i++)
+      row[i] = theImage(i, j);
+    out.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(int32_t));
+  }
+  out.close();
+
+  if (out)
+    NFmiFileSystem::RenameFile(tmpfile, filename);
+  else
+    NFmiFileSystem::RemoveFile(tmpfile);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Copy the full raster into an image
+ */
+// ----------------------------------------------------------------------
+
+unique_ptr<Imagine::NFmiImage> MappedRaster::image() const
+{
+  unique_ptr<Imagine::NFmiImage> img(new Imagine::NFmiImage(itsWidth, itsHeight));
+  for (int j = 0; j < itsHeight; j++)
+    for (int i = 0; i < itsWidth; i++)
+      (*img)(i, j) = (*this)(i, j);
+  return img;
+}
+
+// ======================================================================
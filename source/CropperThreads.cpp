@@ -0,0 +1,475 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief A shared work-stealing pool for rendering several images at once
+ *
+ * All parallel rendering, the frames of an animation, the parts of a
+ * multipart response and the jobs of a batch, runs on one pool of
+ * threads so that the work of different requests does not compete for
+ * the cores with separately created threads.
+ *
+ * Each worker has its own queue per priority class. A worker runs its
+ * newest task first, since that one is most likely to reuse what the
+ * worker just touched, and when out of work steals the oldest tasks
+ * of the other workers. Tasks submitted from outside the pool go into
+ * a shared queue which is served in order. Interactive work is always
+ * taken before background work.
+ *
+ * Each request may have a deadline. Tasks inherit the deadline of the
+ * submitting request, and check_deadline drops the request before its
+ * expensive stages once the deadline has passed.
+ *
+ * The pool size is cropper::threads, by default the number of cores.
+ */
+// ======================================================================
+
+#include "CropperThreads.h"
+#include "CropperException.h"
+#include "CropperMetrics.h"
+
+#include <newbase/NFmiSettings.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+typedef chrono::steady_clock::time_point TimePoint;
+
+const TimePoint no_deadline = TimePoint::max();
+
+// The context of the request being processed by this thread
+thread_local Priority current_priority = InteractivePriority;
+thread_local TimePoint current_deadline = no_deadline;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The indices of a single parallel_for call
+ */
+// ----------------------------------------------------------------------
+
+struct Group
+{
+  const function<void(size_t)>* body;
+  vector<exception_ptr> errors;
+  size_t remaining;
+  mutex lock;
+  condition_variable done;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A single index of a parallel_for call
+ */
+// ----------------------------------------------------------------------
+
+struct Task
+{
+  Group* group;
+  size_t index;
+  Priority priority;
+  TimePoint deadline;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The task queues of one worker, or the shared queues
+ */
+// ----------------------------------------------------------------------
+
+struct Queues
+{
+  mutex lock;
+  deque<Task> tasks[PriorityCount];
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The pool
+ */
+// ----------------------------------------------------------------------
+
+class Scheduler
+{
+ public:
+  explicit Scheduler(unsigned int theThreads);
+
+  void submit(Group& theGroup, size_t n);
+  void wait(Group& theGroup);
+  size_t depth(Priority thePriority) const { return itsDepth[thePriority]; }
+
+ private:
+  void work(size_t theWorker);
+  bool take(Task& theTask);
+  bool take(Queues& theQueues, Priority thePriority, bool theNewest, Task& theTask);
+  void run(const Task& theTask);
+
+  vector<unique_ptr<Queues> > itsWorkers;
+  Queues itsShared;
+  atomic<size_t> itsNext{0};  // the worker to start stealing from
+  atomic<size_t> itsDepth[PriorityCount] = {};
+
+  mutex itsSleepLock;
+  condition_variable itsWakeup;
+  long itsPending = 0;  // queued tasks, guarded by itsSleepLock
+};
+
+// The queues of the worker running in this thread, if any
+thread_local Queues* own_queues = nullptr;
+
+unsigned int requested_threads = 0;
+once_flag pool_flag;
+atomic<Scheduler*> pool{nullptr};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The pool, started on first use
+ *
+ * The pool is never destroyed, the idle workers simply end with the
+ * process.
+ */
+// ----------------------------------------------------------------------
+
+Scheduler& the_scheduler()
+{
+  call_once(pool_flag,
+            []()
+            {
+              unsigned int threads = requested_threads;
+              if (threads == 0)
+                threads = max(0, NFmiSettings::Optional<int>("cropper::threads", 0));
+              if (threads == 0)
+                threads = max(1U, thread::hardware_concurrency());
+              pool = new Scheduler(threads);
+            });
+  return *pool;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Start the workers
+ *
+ * The thread waiting for a parallel_for helps with the work, hence one
+ * worker less than requested is started.
+ */
+// ----------------------------------------------------------------------
+
+Scheduler::Scheduler(unsigned int theThreads)
+{
+  const size_t n = max(1U, theThreads - 1);
+  for (size_t i = 0; i < n; i++)
+    itsWorkers.emplace_back(new Queues);
+  for (size_t i = 0; i < n; i++)
+    thread([this, i]() { work(i); }).detach();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Queue the indices of a group
+ *
+ * Workers queue nested work for themselves, other threads into the
+ * shared queue.
+ */
+// ----------------------------------------------------------------------
+
+void Scheduler::submit(Group& theGroup, size_t n)
+{
+  const Priority priority = current_priority;
+  Queues& queues = (own_queues != nullptr ? *own_queues : itsShared);
+  {
+    lock_guard<mutex> lock(queues.lock);
+    for (size_t i = 0; i < n; i++)
+      queues.tasks[priority].push_back(Task{&theGroup, i, priority, current_deadline});
+  }
+
+  itsDepth[priority] += n;
+  metrics_count(priority == InteractivePriority ? InteractiveTasksQueued : BackgroundTasksQueued,
+                n);
+  {
+    lock_guard<mutex> lock(itsSleepLock);
+    itsPending += n;
+  }
+  itsWakeup.notify_all();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Take a task from the given queue
+ */
+// ----------------------------------------------------------------------
+
+bool Scheduler::take(Queues& theQueues, Priority thePriority, bool theNewest, Task& theTask)
+{
+  lock_guard<mutex> lock(theQueues.lock);
+  deque<Task>& tasks = theQueues.tasks[thePriority];
+  if (tasks.empty())
+    return false;
+  if (theNewest)
+  {
+    theTask = tasks.back();
+    tasks.pop_back();
+  }
+  else
+  {
+    theTask = tasks.front();
+    tasks.pop_front();
+  }
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Take the next task for this thread
+ *
+ * Own work first, then the shared queue, then stealing from the other
+ * workers. All interactive work is taken before background work.
+ */
+// ----------------------------------------------------------------------
+
+bool Scheduler::take(Task& theTask)
+{
+  for (int p = 0; p < PriorityCount; p++)
+  {
+    const Priority priority = static_cast<Priority>(p);
+    bool found = (own_queues != nullptr && take(*own_queues, priority, true, theTask));
+    if (!found)
+      found = take(itsShared, priority, false, theTask);
+
+    const size_t n = itsWorkers.size();
+    const size_t first = itsNext++;
+    for (size_t i = 0; !found && i < n; i++)
+    {
+      Queues& victim = *itsWorkers[(first + i) % n];
+      if (&victim != own_queues)
+        found = take(victim, priority, false, theTask);
+    }
+
+    if (found)
+    {
+      lock_guard<mutex> lock(itsSleepLock);
+      --itsPending;
+      return true;
+    }
+  }
+  return false;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Run a task in the context of the request which submitted it
+ */
+// ----------------------------------------------------------------------
+
+void Scheduler::run(const Task& theTask)
+{
+  --itsDepth[theTask.priority];
+  metrics_count(
+      theTask.priority == InteractivePriority ? InteractiveTasksStarted : BackgroundTasksStarted);
+
+  const Priority priority = current_priority;
+  const TimePoint deadline = current_deadline;
+  current_priority = theTask.priority;
+  current_deadline = theTask.deadline;
+
+  Group& group = *theTask.group;
+  try
+  {
+    (*group.body)(theTask.index);
+  }
+  catch (...)
+  {
+    group.errors[theTask.index] = current_exception();
+  }
+
+  current_priority = priority;
+  current_deadline = deadline;
+
+  lock_guard<mutex> lock(group.lock);
+  if (--group.remaining == 0)
+    group.done.notify_all();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The worker loop
+ */
+// ----------------------------------------------------------------------
+
+void Scheduler::work(size_t theWorker)
+{
+  own_queues = itsWorkers[theWorker].get();
+  while (true)
+  {
+    Task task;
+    if (take(task))
+      run(task);
+    else
+    {
+      unique_lock<mutex> lock(itsSleepLock);
+      itsWakeup.wait(lock, [this]() { return itsPending > 0; });
+    }
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Help with the work until the group is done
+ *
+ * If no task is available, the remaining tasks of the group are being
+ * run by other threads and will complete without further help.
+ */
+// ----------------------------------------------------------------------
+
+void Scheduler::wait(Group& theGroup)
+{
+  while (true)
+  {
+    {
+      lock_guard<mutex> lock(theGroup.lock);
+      if (theGroup.remaining == 0)
+        return;
+    }
+
+    Task task;
+    if (take(task))
+      run(task);
+    else
+    {
+      unique_lock<mutex> lock(theGroup.lock);
+      theGroup.done.wait(lock, [&theGroup]() { return theGroup.remaining == 0; });
+      return;
+    }
+  }
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the priority and deadline of the current thread
+ */
+// ----------------------------------------------------------------------
+
+RequestContext::RequestContext(Priority thePriority, chrono::milliseconds theBudget)
+    : itsPreviousPriority(current_priority), itsPreviousDeadline(current_deadline)
+{
+  current_priority = thePriority;
+  current_deadline =
+      (theBudget.count() > 0 ? chrono::steady_clock::now() + theBudget : no_deadline);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Restore the previous context
+ */
+// ----------------------------------------------------------------------
+
+RequestContext::~RequestContext()
+{
+  current_priority = itsPreviousPriority;
+  current_deadline = itsPreviousDeadline;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The priority of the current request
+ */
+// ----------------------------------------------------------------------
+
+Priority RequestContext::priority()
+{
+  return current_priority;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether the deadline of the current request has passed
+ */
+// ----------------------------------------------------------------------
+
+bool RequestContext::expired()
+{
+  return (current_deadline != no_deadline && chrono::steady_clock::now() > current_deadline);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Drop the current request if its deadline has passed
+ *
+ * Called before the expensive stages, the work is useless once the
+ * client has given up.
+ *
+ * \param theStage The stage about to start
+ */
+// ----------------------------------------------------------------------
+
+void check_deadline(const char* theStage)
+{
+  if (!RequestContext::expired())
+    return;
+  metrics_count(DeadlineDrops);
+  throw CropperException(503, string("Deadline exceeded before ") + theStage);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Set the pool size
+ *
+ * Has no effect once the pool has been started. Zero means the
+ * cropper::threads setting or the number of cores.
+ */
+// ----------------------------------------------------------------------
+
+void scheduler_threads(unsigned int theThreads)
+{
+  requested_threads = theThreads;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The number of queued tasks in a priority class
+ */
+// ----------------------------------------------------------------------
+
+size_t scheduler_queue_depth(Priority thePriority)
+{
+  const Scheduler* scheduler = pool;
+  return (scheduler != nullptr ? scheduler->depth(thePriority) : 0);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Run the given function for indices 0...n-1 in parallel
+ */
+// ----------------------------------------------------------------------
+
+void parallel_for(size_t n, const function<void(size_t)>& theFunction)
+{
+  if (n == 0)
+    return;
+
+  Group group;
+  group.body = &theFunction;
+  group.errors.resize(n);
+  group.remaining = n;
+
+  Scheduler& scheduler = the_scheduler();
+  scheduler.submit(group, n);
+  scheduler.wait(group);
+
+  for (const auto& e : group.errors)
+    if (e)
+      rethrow_exception(e);
+}
+
+// ======================================================================
@@ -0,0 +1,288 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Tiled store of source images
+ *
+ * A narrow crop of a very wide composite still touches full rows of
+ * the PNG and of a raw sidecar. The tiled store splits the source into
+ * square tiles of cropper::tiles::size pixels (default 256), each
+ * compressed independently with zlib, so that the cost of a crop
+ * depends on the size of the crop instead of the size of the source.
+ *
+ * The store is enabled with cropper::tiles::active. It is written on
+ * first access, or beforehand with the cropper_tile command when the
+ * images are published, into the directory cropper::tiles::dir
+ * (default /tmp/cropper/tiles) named by a hash of the source path, so
+ * that frame patterns never match it. The file starts with a
+ * header and an index of the tile offsets and sizes in row major order,
+ * followed by the compressed tiles. A store not matching the size and
+ * modification time of the source is ignored.
+ */
+// ======================================================================
+
+#include "CropperTiles.h"
+#include "CropperException.h"
+#include "CropperHash.h"
+
+#include <newbase/NFmiFileSystem.h>
+#include <newbase/NFmiSettings.h>
+#include <newbase/NFmiStringTools.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+extern "C"
+{
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+}
+
+using namespace std;
+
+namespace
+{
+const char* default_tiles_dir = "/tmp/cropper/tiles";
+const int default_tilesize = 256;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The header of a tiled store
+ */
+// ----------------------------------------------------------------------
+
+struct Header
+{
+  char magic[4];
+  int32_t width;
+  int32_t height;
+  int32_t tilesize;
+  int64_t modtime;  // modification time of the source
+  int64_t size;     // size of the source
+  char type[16];    // image type of the source
+};
+
+const char tiles_magic[4] = {'C', 'R', 'T', '1'};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The tiled store file name of a source image
+ */
+// ----------------------------------------------------------------------
+
+const string tiles_file(const string& theSource)
+{
+  const string dir = NFmiSettings::Optional<string>("cropper::tiles::dir", default_tiles_dir);
+  return dir + "/" + hash128(theSource).hex() + ".tiles";
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether tiled stores are used
+ */
+// ----------------------------------------------------------------------
+
+bool TiledRaster::active()
+{
+  return NFmiSettings::Optional<bool>("cropper::tiles::active", false);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Close the store
+ */
+// ----------------------------------------------------------------------
+
+TiledRaster::~TiledRaster()
+{
+  if (itsFile >= 0)
+    close(itsFile);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Open the tiled store of a source image
+ *
+ * Only the header and the index are read.
+ *
+ * \param theSource The source image
+ * \return The store, or an empty pointer if not available
+ */
+// ----------------------------------------------------------------------
+
+unique_ptr<TiledRaster> TiledRaster::open(const string& theSource)
+{
+  if (!active())
+    return nullptr;
+
+  struct stat source;
+  if (stat(theSource.c_str(), &source) != 0)
+    return nullptr;
+
+  unique_ptr<TiledRaster> tiles(new TiledRaster);
+  tiles->itsFile = ::open(tiles_file(theSource).c_str(), O_RDONLY | O_CLOEXEC);
+  if (tiles->itsFile < 0)
+    return nullptr;
+
+  Header header;
+  if (pread(tiles->itsFile, &header, sizeof(header), 0) != sizeof(header) ||
+      memcmp(header.magic, tiles_magic, sizeof(tiles_magic)) != 0 ||
+      header.modtime != source.st_mtime || header.size != source.st_size || header.width < 1 ||
+      header.height < 1 || header.tilesize < 1)
+    return nullptr;
+
+  const size_t columns = (header.width + header.tilesize - 1) / header.tilesize;
+  const size_t rows = (header.height + header.tilesize - 1) / header.tilesize;
+
+  tiles->itsIndex.resize(columns * rows);
+  const ssize_t indexsize = tiles->itsIndex.size() * sizeof(IndexEntry);
+  if (pread(tiles->itsFile, tiles->itsIndex.data(), indexsize, sizeof(header)) != indexsize)
+    return nullptr;
+
+  tiles->itsWidth = header.width;
+  tiles->itsHeight = header.height;
+  tiles->itsTileSize = header.tilesize;
+  tiles->itsColumns = columns;
+  tiles->itsType.assign(header.type, strnlen(header.type, sizeof(header.type)));
+  tiles->itsTiles.resize(tiles->itsIndex.size());
+  return tiles;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read and decompress a tile
+ */
+// ----------------------------------------------------------------------
+
+void TiledRaster::load(size_t theTile) const
+{
+  const IndexEntry& entry = itsIndex[theTile];
+
+  string data(entry.size, '\0');
+  vector<int32_t> pixels(static_cast<size_t>(itsTileSize) * itsTileSize);
+  uLongf size = pixels.size() * sizeof(int32_t);
+
+  if (pread(itsFile, &data[0], data.size(), entry.offset) != static_cast<ssize_t>(data.size()) ||
+      uncompress(reinterpret_cast<Bytef*>(pixels.data()),
+                 &size,
+                 reinterpret_cast<const Bytef*>(data.data()),
+                 data.size()) != Z_OK ||
+      size != pixels.size() * sizeof(int32_t))
+    throw CropperException(500, "Tiled image store is corrupted");
+
+  itsTiles[theTile].swap(pixels);
+  ++itsLoaded;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Write the tiled store of a decoded source image
+ *
+ * \param theSource The source image
+ * \param theImage The decoded source image
+ * \return True on success
+ */
+// ----------------------------------------------------------------------
+
+bool TiledRaster::create(const string& theSource, const Imagine::NFmiImage& theImage)
+{
+  struct stat source;
+  if (theImage.Type().size() >= sizeof(Header::type) || stat(theSource.c_str(), &source) != 0)
+    return false;
+
+  const int tilesize =
+      max(16, NFmiSettings::Optional<int>("cropper::tiles::size", default_tilesize));
+
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, tiles_magic, sizeof(tiles_magic));
+  header.width = theImage.Width();
+  header.height = theImage.Height();
+  header.tilesize = tilesize;
+  header.modtime = source.st_mtime;
+  header.size = source.st_size;
+  strncpy(header.type, theImage.Type().c_str(), sizeof(header.type) - 1);
+
+  const int columns = (header.width + tilesize - 1) / tilesize;
+  const int rows = (header.height + tilesize - 1) / tilesize;
+  vector<IndexEntry> index(static_cast<size_t>(columns) * rows);
+
+  const string filename = tiles_file(theSource);
+  if (!NFmiFileSystem::CreateDirectory(filename.substr(0, filename.rfind('/'))))
+    return false;
+
+  const string tmpfile = filename + "." + NFmiStringTools::Convert(::getpid());
+  ofstream out(tmpfile.c_str(), ios::out | ios::binary);
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(IndexEntry));
+
+  // Edge tiles are padded with transparent pixels
+
+  vector<int32_t> pixels(static_cast<size_t>(tilesize) * tilesize);
+  string data(compressBound(pixels.size() * sizeof(int32_t)), '\0');
+  uint64_t offset = sizeof(header) + index.size() * sizeof(IndexEntry);
+
+  for (int row = 0; row < rows && out; row++)
+    for (int column = 0; column < columns && out; column++)
+    {
+      fill(pixels.begin(), pixels.end(), Imagine::NFmiColorTools::TransparentColor);
+      const int x1 = column * tilesize;
+      const int y1 = row * tilesize;
+      const int x2 = min(x1 + tilesize, header.width);
+      const int y2 = min(y1 + tilesize, header.height);
+      for (int j = y1; j < y2; j++)
+        for (int i = x1; i < x2; i++)
+          pixels[(j - y1) * tilesize + (i - x1)] = theImage(i, j);
+
+      uLongf size = data.size();
+      if (compress2(reinterpret_cast<Bytef*>(&data[0]),
+                    &size,
+                    reinterpret_cast<const Bytef*>(pixels.data()),
+                    pixels.size() * sizeof(int32_t),
+                    Z_BEST_SPEED) != Z_OK)
+        out.setstate(ios::failbit);
+
+      IndexEntry& entry = index[row * columns + column];
+      entry.offset = offset;
+      entry.size = size;
+      entry.reserved = 0;
+      out.write(data.data(), size);
+      offset += size;
+    }
+
+  // Now the index is known
+
+  out.seekp(sizeof(header));
+  out.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(IndexEntry));
+  out.close();
+
+  if (!out)
+  {
+    NFmiFileSystem::RemoveFile(tmpfile);
+    return false;
+  }
+
+  NFmiFileSystem::RenameFile(tmpfile, filename);
+  return true;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Copy the full image
+ */
+// ----------------------------------------------------------------------
+
+unique_ptr<Imagine::NFmiImage> TiledRaster::image() const
+{
+  unique_ptr<Imagine::NFmiImage> img(new Imagine::NFmiImage(itsWidth, itsHeight));
+  for (int j = 0; j < itsHeight; j++)
+    for (int i = 0; i < itsWidth; i++)
+      (*img)(i, j) = (*this)(i, j);
+  return img;
+}
+
+// ======================================================================
@@ -0,0 +1,232 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Per-stage timing of request processing
+ */
+// ======================================================================
+
+#include "CropperTimings.h"
+
+#include <iomanip>
+#include <sstream>
+
+using namespace std;
+
+namespace
+{
+// The timings of the request being processed by this thread
+thread_local Timings* current_timings = nullptr;
+
+double milliseconds(chrono::steady_clock::duration theDuration)
+{
+  return chrono::duration<double, milli>(theDuration).count();
+}
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Start timing a request in the current thread
+ */
+// ----------------------------------------------------------------------
+
+Timings::Timings() : itsStart(chrono::steady_clock::now()), itsPrevious(current_timings)
+{
+  current_timings = this;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Stop timing the request
+ */
+// ----------------------------------------------------------------------
+
+Timings::~Timings()
+{
+  current_timings = itsPrevious;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The timings of the current thread, if any
+ */
+// ----------------------------------------------------------------------
+
+Timings* Timings::current()
+{
+  return current_timings;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Add a stage timing
+ *
+ * Repeated stages, for example several labels, are summed.
+ */
+// ----------------------------------------------------------------------
+
+void Timings::add(const string& theStage, double theMilliseconds)
+{
+  for (auto& stage : itsStages)
+    if (stage.first == theStage)
+    {
+      stage.second += theMilliseconds;
+      return;
+    }
+  itsStages.push_back(make_pair(theStage, theMilliseconds));
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Add a note of form key=value to the log summary
+ */
+// ----------------------------------------------------------------------
+
+void Timings::note(const string& theNote)
+{
+  if (!itsNotes.empty())
+    itsNotes += ' ';
+  itsNotes += theNote;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Time elapsed since the request started
+ */
+// ----------------------------------------------------------------------
+
+double Timings::total() const
+{
+  return milliseconds(chrono::steady_clock::now() - itsStart);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The value of a Server-Timing header
+ */
+// ----------------------------------------------------------------------
+
+string Timings::header() const
+{
+  ostringstream out;
+  out << fixed << setprecision(3);
+  for (const auto& stage : itsStages)
+    out << stage.first << ";dur=" << stage.second << ", ";
+  out << "total;dur=" << total();
+  return out.str();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A compact summary for log files
+ */
+// ----------------------------------------------------------------------
+
+string Timings::summary() const
+{
+  ostringstream out;
+  out << fixed << setprecision(3);
+  for (const auto& stage : itsStages)
+    out << stage.first << '=' << stage.second << ' ';
+  out << "total=" << total();
+  if (!itsNotes.empty())
+    out << ' ' << itsNotes;
+  return out.str();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Start timing a stage
+ */
+// ----------------------------------------------------------------------
+
+StageTimer::StageTimer(const char* theStage)
+    : itsTimings(current_timings), itsStage(theStage), itsStart(chrono::steady_clock::now())
+{
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Record the stage timing
+ */
+// ----------------------------------------------------------------------
+
+StageTimer::~StageTimer()
+{
+  if (itsTimings != nullptr)
+    itsTimings->add(itsStage, milliseconds(chrono::steady_clock::now() - itsStart));
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Add the stage timings of a request
+ */
+// ----------------------------------------------------------------------
+
+void StageHistograms::add(const Timings& theTimings)
+{
+  lock_guard<mutex> lock(itsMutex);
+
+  Timings::Stages stages = theTimings.stages();
+  stages.push_back(make_pair(string("total"), theTimings.total()));
+
+  for (const auto& stage : stages)
+  {
+    Histogram& h = itsHistograms[stage.first];
+    ++h.count;
+    h.sum += stage.second;
+    h.max = std::max(h.max, stage.second);
+
+    int k = 0;
+    for (double us = 1000 * stage.second; us >= 1 && k < buckets - 1; us /= 2)
+      ++k;
+    ++h.counts[k];
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Estimate a percentile from the bucket upper limits
+ */
+// ----------------------------------------------------------------------
+
+double StageHistograms::Histogram::percentile(double theFraction) const
+{
+  const double limit = theFraction * count;
+  size_t sum = 0;
+  for (int k = 0; k < buckets; k++)
+  {
+    sum += counts[k];
+    if (sum >= limit)
+      return std::min(max, static_cast<double>(1UL << k) / 1000);
+  }
+  return max;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Print a table of the stage timings in milliseconds
+ */
+// ----------------------------------------------------------------------
+
+void StageHistograms::report(ostream& theOutput) const
+{
+  lock_guard<mutex> lock(itsMutex);
+
+  if (itsHistograms.empty())
+    return;
+
+  theOutput << "Stage timings (ms):" << endl
+            << "  " << left << setw(12) << "stage" << right << setw(8) << "count" << setw(10)
+            << "mean" << setw(10) << "p50" << setw(10) << "p95" << setw(10) << "max" << endl;
+
+  for (const auto& h : itsHistograms)
+  {
+    const Histogram& hist = h.second;
+    theOutput << "  " << left << setw(12) << h.first << right << setw(8) << hist.count << fixed
+              << setprecision(3) << setw(10) << hist.sum / hist.count << setw(10)
+              << hist.percentile(0.5) << setw(10) << hist.percentile(0.95) << setw(10) << hist.max
+              << endl;
+  }
+}
+
+// ======================================================================
@@ -6,8 +6,23 @@
 // ======================================================================
 
 #include "CropperTools.h"
+#include "CropperAnimation.h"
+#include "CropperArena.h"
+#include "CropperBatch.h"
+#include "CropperEffort.h"
 #include "CropperException.h"
-#include "WebAuthenticator.h"
+#include "CropperHash.h"
+#include "CropperIO.h"
+#include "CropperLog.h"
+#include "CropperMetrics.h"
+#include "CropperMultipart.h"
+#include "CropperNegativeCache.h"
+#include "CropperRasterCache.h"
+#include "CropperResample.h"
+#include "CropperSidecar.h"
+#include "CropperThreads.h"
+#include "CropperTiles.h"
+#include "CropperTimings.h"
 
 #include <imagine/NFmiAlignment.h>
 #include <imagine/NFmiFace.h>
@@ -23,32 +38,63 @@
 #include <newbase/NFmiSettings.h>
 #include <newbase/NFmiStringTools.h>
 
-#include <boost/lexical_cast.hpp>
 #include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
 #include <clocale>
+#include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <vector>
 
 // For getpid:
 #include "sys/types.h"
 #include "unistd.h"
 
-#ifdef UNIX
-extern "C"
-{
-#include <syslog.h>
-}
-#endif
-
 using namespace std;
 
 // Cache directory
 
 const string default_cachedir = "/tmp/cropper";
 
+// Map and location databases
+
+const string default_mapsdir = "/smartmet/share/maps";
+const string default_coordinates = "/smartmet/share/coordinates/kaikki.txt";
+const string default_labelsdir = "/smartmet/share/labels";
+
+// Serializes text rendering, the FreeType library handle is shared
+
+std::mutex font_mutex;
+
+// Rendered timestamp boxes are cached only in long running processes
+
+bool timestamp_cache = false;
+
+// Default parts of the -T and -L specifications, empty for compulsory parts.
+// The y-margin defaults to the x-margin.
+
+const size_t timestamp_parts = 9;
+const size_t timestamp_xmargin = 4;
+const string_view timestamp_defaults[timestamp_parts] = {
+    "", "", "%H:%M", "obs", "1", "1", "misc/6x13.pcf.gz:6x13", "black", "#20B4B4B4"};
+
+const size_t label_parts = 11;
+const size_t label_xmargin = 6;
+const string_view label_defaults[label_parts] = {
+    "", "", "", "0", "0", "Center", "1", "1", "misc/6x13.pcf.gz:6x13", "black", "transparent"};
+
+// Color reduction for -Z without a value
+
+const string_view default_reduction = "5550";
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Print usage information
@@ -69,7 +115,7 @@ void usage(const string &theProgName)
        << "   -L "
           "[labelspecs]\t<text>,<lon>,<lat>,<dx>,<dy>,<align>,<xmargin>,<"
           "ymargin>,<font>,<color>,<bgcolor>"
-       << endl
+       << " or @<labelset>" << endl
        << "   -T "
           "[stampspecs]\t<x>,<y>,<format>,<type>,<xmargin>,<ymargin>,<font>,<"
           "color>,<bgcolor>"
@@ -78,12 +124,17 @@ void usage(const string &theProgName)
        << "   -k [lang]\t\tLanguage, for example fi_FI" << endl
        << "   -I [imagespecs]\t<imagefile>,<x>,<y>,..." << endl
        << "   -Z [RGBA]\t\tReduce color accuracy, default = 5550" << endl
+       << "   -S [scale]\t\t<factor> or <width>x<height>, optionally :box or :lanczos" << endl
        << "   -A\t\t\tKeep alpha channel" << endl
        << "   -f [imagefile]" << endl
+       << "   -F [frames]\t\t<imagefile>,<imagefile>,... or a pattern, outputs an APNG" << endl
+       << "   -D [delay]\t\tAnimation frame delay in milliseconds, default = 500" << endl
        << "   -o [outputfile]" << endl
-       << "   -z [compressionlevel]" << endl
+       << "   -z [compressionlevel]\tor auto" << endl
        << "   -O [output image type]" << endl
        << "   -C" << endl
+       << "   -B [manifest]\t\tRender all jobs in the manifest" << endl
+       << "   -j [threads]\t\tNumber of threads in batch mode, default = number of cores" << endl
        << endl;
 }
 
@@ -140,9 +191,8 @@ NFmiPoint checkmeridian(const NFmiPoint &theLatLon, const NFmiArea &theArea)
 
 void set_timezone(const string &theZone)
 {
-  // must be static, see putenv specs!
-  static string tzvalue = "TZ=" + theZone;
-  putenv(const_cast<char *>(tzvalue.c_str()));
+  // setenv copies the value, hence batch runs may switch zones freely
+  setenv("TZ", theZone.c_str(), 1);
   tzset();
 }
 
@@ -168,37 +218,246 @@ const string format_time(const ::time_t theTime)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Output the given imagefile
+ * \brief The Server-Timing header of the current request
+ *
+ * \return The header line, or an empty string if not available
+ */
+// ----------------------------------------------------------------------
+
+const string server_timing()
+{
+  const Timings *timings = Timings::current();
+  if (timings == nullptr || !NFmiSettings::Optional<bool>("cropper::servertiming", true))
+    return "";
+  return "Server-Timing: " + timings->header() + "\n";
+}
+
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether the request is a HEAD request
+ */
+// ----------------------------------------------------------------------
+
+bool head_request()
+{
+  const char *method = getenv("REQUEST_METHOD");
+  return (method != nullptr && strcmp(method, "HEAD") == 0);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Determine the requested byte range of a file
+ *
+ * Only a single range is supported, requests for several ranges,
+ * invalid ranges and ranges of a changed file (If-Range) are served
+ * in full as permitted by RFC 7233.
+ *
+ * \param theSize The size of the file
+ * \param theLastModified The Last-Modified header value of the file
+ * \param theFirst Returns the first byte to send
+ * \param theCount Returns the number of bytes to send
+ * \return The HTTP status, 200, 206 or 416
+ */
+// ----------------------------------------------------------------------
+
+int byte_range(size_t theSize, const string &theLastModified, size_t &theFirst, size_t &theCount)
+{
+  theFirst = 0;
+  theCount = theSize;
+
+  const char *range = getenv("HTTP_RANGE");
+  const char *ifrange = getenv("HTTP_IF_RANGE");
+  if (range == nullptr || (ifrange != nullptr && theLastModified != ifrange))
+    return 200;
+
+  string_view spec(range);
+  if (spec.substr(0, 6) != "bytes=" || spec.find(',') != string_view::npos)
+    return 200;
+  spec.remove_prefix(6);
+
+  const string_view::size_type dash = spec.find('-');
+  if (dash == string_view::npos)
+    return 200;
+
+  uintmax_t first, last;
+  if (dash == 0)
+  {
+    // The last n bytes
+    if (!parse_number(spec.substr(1), last))
+      return 200;
+    if (last == 0)
+      return 416;
+    theFirst = (last < theSize ? theSize - last : 0);
+    theCount = theSize - theFirst;
+    return 206;
+  }
+
+  if (!parse_number(spec.substr(0, dash), first))
+    return 200;
+  if (dash + 1 == spec.size())
+    last = theSize - 1;
+  else if (!parse_number(spec.substr(dash + 1), last) || last < first)
+    return 200;
+
+  if (first >= theSize)
+    return 416;
+
+  theFirst = first;
+  theCount = min(static_cast<size_t>(last), theSize - 1) - first + 1;
+  return 206;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Output a file whose status is already known
+ *
+ * HEAD requests get only the headers, and byte range requests only
+ * the requested part of the file. Only the sent bytes are read.
+ *
+ * \param theFile The file to output
+ * \param theStatus The status of the file
+ * \param theCacheHit True if the file is a cached rendering
+ * \return False if the file has vanished, nothing has been output then
  */
 // ----------------------------------------------------------------------
 
-void http_output_image(const string &theFile)
+bool output_file(const string &theFile, const FileStatus &theStatus, bool theCacheHit)
 {
   ifstream in(theFile.c_str(), ios::in | ios::binary);
   if (!in)
-    throw CropperException(404, "File missing");
+    return false;
 
   // We expire everything in 24 hours
   const long maxage = 24 * 3600;
   ::time_t expiration_time = time(0) + maxage;
-  ::time_t last_modified = NFmiFileSystem::FileModificationTime(theFile);
+  ::time_t last_modified = theStatus.modtime;
+
+  // Cached multipart responses start with the boundary. Source images
+  // are never sniffed, they may start with anything.
+
+  string mime;
+  if (theCacheHit)
+  {
+    const string prefix = "--" + multipart_boundary;
+    string buffer(prefix.size(), '\0');
+    if (in.read(&buffer[0], buffer.size()) && buffer == prefix)
+      mime = "multipart/mixed; boundary=" + multipart_boundary;
+    in.clear();
+    in.seekg(0);
+  }
+  if (mime.empty())
+    mime = "image/" + Imagine::NFmiImageTools::MimeType(theFile);
+
+  const size_t size = theStatus.size;
+  const string modified = format_time(last_modified);
+
+  size_t first, count;
+  const int status = byte_range(size, modified, first, count);
 
-  string mime = Imagine::NFmiImageTools::MimeType(theFile);
+  if (status == 416)
+  {
+    cout << "Status: 416 Range Not Satisfiable\n"
+         << "Content-Range: bytes */" << size << '\n'
+         << server_timing() << endl;
+    metrics_error(status);
+    log_request("range", status, 0, getenv("QUERY_STRING"));
+    return true;
+  }
+
+  cout << "Status: " << (status == 206 ? "206 Partial Content" : "200 OK") << '\n'
+       << "Content-Type: " << mime << '\n'
+       << "Expires: " << format_time(expiration_time) << '\n'
+       << "Last-Modified: " << modified << '\n'
+       << "Cache-Control: max-age=" << maxage << ", public" << '\n'
+       << "Accept-Ranges: bytes\n";
+  if (status == 206)
+    cout << "Content-Range: bytes " << first << '-' << first + count - 1 << '/' << size << '\n';
+  cout << "Content-Length: " << count << '\n'
+       << (theCacheHit ? "X-Cache: HIT\n" : "") << server_timing() << endl;
+
+  const bool head = head_request();
+  if (head)
+    count = 0;
+  else if (count == size)
+    cout << in.rdbuf();
+  else
+  {
+    in.seekg(first);
+    char buffer[65536];
+    for (size_t left = count; left > 0 && in;)
+    {
+      in.read(buffer, min(left, sizeof(buffer)));
+      cout.write(buffer, in.gcount());
+      left -= in.gcount();
+    }
+  }
+  in.close();
+
+  metrics_count(theCacheHit ? CacheHitRequests : PassthroughRequests);
+  metrics_count(theCacheHit ? CacheHitBytes : PassthroughBytes, count);
+  if (head)
+    metrics_count(HeadRequests);
+  else if (status == 206)
+    metrics_count(RangeRequests);
+  log_request(theCacheHit ? "cache_hit" : "passthrough", status, count, getenv("QUERY_STRING"));
+  return true;
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Output the given imagefile
+ *
+ * \param theFile The file to output
+ * \param theCacheHit True if the file is a cached rendering
+ */
+// ----------------------------------------------------------------------
+
+void http_output_image(const string &theFile, bool theCacheHit)
+{
+  if (!output_file(theFile, file_status(theFile), theCacheHit))
+    throw CropperException(404, "File missing");
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Answer a HEAD request for an image not rendered yet
+ *
+ * The headers are based on the source image, the length of the
+ * rendering is not known without rendering it.
+ *
+ * \param theFile The source image
+ * \param theMimeType The MIME type of the response
+ */
+// ----------------------------------------------------------------------
+
+void http_output_head(const string &theFile, const string &theMimeType)
+{
+  const long maxage = 24 * 3600;
+  ::time_t expiration_time = time(0) + maxage;
+  ::time_t last_modified = NFmiFileSystem::FileModificationTime(theFile);
 
   cout << "Status: 200 OK\n"
-       << "Content-Type: image/" << mime << '\n'
+       << "Content-Type: " << theMimeType << '\n'
        << "Expires: " << format_time(expiration_time) << '\n'
        << "Last-Modified: " << format_time(last_modified) << '\n'
        << "Cache-Control: max-age=" << maxage << ", public" << '\n'
-       << "Content-Length: " << NFmiFileSystem::FileSize(theFile) << '\n'
-       << endl
-       << in.rdbuf();
-  in.close();
+       << "X-Cache: MISS\n"
+       << server_timing() << endl;
+
+  metrics_count(HeadRequests);
+  log_request("head", 200, 0, getenv("QUERY_STRING"));
 }
 
 // ----------------------------------------------------------------------
 /*!
  * \brief Convert QUERY_STRING value to cache name
+ *
+ * The name is computed once per request and passed to the functions
+ * needing it. The directory is created only when the file is written.
  */
 // ----------------------------------------------------------------------
 
@@ -206,12 +465,7 @@ const string cachename(const string &theQueryString)
 {
   string cachedir = NFmiSettings::Optional<string>("cropper::cachedir", default_cachedir);
 
-  WebAuthenticator auth;
-  string md5 = auth.MD5Digest("cropper", theQueryString);
-  string path = cachedir + "/" + md5.substr(0, 2);
-
-  if (!NFmiFileSystem::CreateDirectory(path))
-    throw CropperException(500, "Unable to create cache directory for temporary files");
+  string path = cachedir + "/" + hash128(theQueryString).hex().substr(0, 2);
 
   // Encode
   string name1 = NFmiStringTools::UrlEncode(theQueryString);
@@ -222,39 +476,346 @@ const string cachename(const string &theQueryString)
   return (path + '/' + name2);
 }
 
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Canonical form of a -T or -L specification
+ *
+ * Parts equal to their defaults are emptied, and trailing empty parts
+ * are removed. Invalid specifications are returned as is, rendering
+ * them will fail anyway.
+ */
+// ----------------------------------------------------------------------
+
+string canonical_spec(string_view theSpec,
+                      const string_view *theDefaults,
+                      size_t theSize,
+                      size_t theXmargin)
+{
+  string_view parts[label_parts];
+  size_t n = split(theSpec, ",", parts, theSize);
+  if (n > theSize)
+    return string(theSpec);
+
+  const string_view xmargin =
+      (parts[theXmargin].empty() ? theDefaults[theXmargin] : parts[theXmargin]);
+  if (parts[theXmargin + 1] == xmargin)
+    parts[theXmargin + 1] = string_view();
+
+  // The y-margin defaults to the x-margin, not to its own default
+
+  for (size_t i = 0; i < n; i++)
+    if (i != theXmargin + 1 && parts[i] == theDefaults[i])
+      parts[i] = string_view();
+
+  while (n > 0 && parts[n - 1].empty() && !theDefaults[n - 1].empty())
+    --n;
+
+  string ret;
+  for (size_t i = 0; i < n; i++)
+  {
+    if (i > 0)
+      ret += ',';
+    ret += parts[i];
+  }
+  return ret;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Canonical form of the -L option
+ *
+ * The label sets of multiple geometries are separated by ';', and the
+ * labels of a set by "::".
+ */
+// ----------------------------------------------------------------------
+
+string canonical_labels(string_view theLabels)
+{
+  string ret;
+  Tokenizer sets(theLabels, ";");
+  string_view set;
+  for (bool first_set = true; sets.next(set); first_set = false)
+  {
+    if (!first_set)
+      ret += ';';
+    Tokenizer labels(set, "::");
+    string_view label;
+    for (bool first = true; labels.next(label); first = false)
+    {
+      if (!first)
+        ret += "::";
+      ret += canonical_spec(label, label_defaults, label_parts, label_xmargin);
+    }
+  }
+  return ret;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The definition file of a named label set
+ */
+// ----------------------------------------------------------------------
+
+const string label_set_file(string_view theName)
+{
+  return NFmiSettings::Optional<string>("cropper::labelsdir", default_labelsdir) + "/" +
+         string(theName) + ".txt";
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The definition files of the named label sets used by the -L option
+ */
+// ----------------------------------------------------------------------
+
+vector<string> label_set_files(string_view theLabels)
+{
+  vector<string> ret;
+  Tokenizer sets(theLabels, ";");
+  string_view set;
+  while (sets.next(set))
+  {
+    Tokenizer labels(set, "::");
+    string_view label;
+    while (labels.next(label))
+    {
+      if (!label.empty() && label[0] == '@')
+        ret.push_back(label_set_file(label.substr(1)));
+    }
+  }
+  return ret;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The versions of the named label sets used by the -L option
+ *
+ * The version is the modification time of the definition file, zero
+ * if the file is missing.
+ *
+ * \return The comma separated versions, empty if no sets are used
+ */
+// ----------------------------------------------------------------------
+
+string label_set_versions(string_view theLabels)
+{
+  string ret;
+  for (const string &file : label_set_files(theLabels))
+  {
+    if (!ret.empty())
+      ret += ',';
+    ret += to_string(file_status(file).modtime);
+  }
+  return ret;
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Canonical form of the options for keying the cache
+ *
+ * The options which affect the rendering are listed in sorted order,
+ * and options which equal the defaults or have no effect are omitted.
+ * Hence for example
+ * \code
+ * g=100x100+0+0&f=a.png&A=0&Z=5550&t=Europe/Helsinki
+ * Z&f=a.png&g=100x100+0+0
+ * \endcode
+ * share the same cache entry. The result is a valid query string
+ * which parses back to equivalent options.
+ *
+ * Named label sets are versioned by the modification times of their
+ * definition files, appended as the parameter @ which the option
+ * parser ignores. Editing a set thus creates new cache entries.
+ *
+ * With cropper::cache::pixelkeys enabled named and latlon geometries
+ * are replaced by the equivalent centered pixel geometry, so that all
+ * requests for the same crop share the same entry. If labels are drawn
+ * the map name is kept, since the labels need the projection. It is
+ * appended as the parameter map, which the option parser ignores like
+ * @, so that the pixel geometry stays valid.
+ * Resolving may fail for unknown names, hence the negative cache
+ * keys requests without it.
+ *
+ * \param theOptions The parsed options
+ * \param theTimezone The default timezone
+ * \param theResolve False if geometries are never to be resolved
+ * \return The canonical query string
+ */
+// ----------------------------------------------------------------------
+
+const string canonical_query(const Options &theOptions,
+                             const string &theTimezone,
+                             bool theResolve)
+{
+  const bool has_center = (theOptions.has('p') || theOptions.has('l') || theOptions.has('c'));
+
+  // Resolve single named and latlon geometries if so requested
+
+  char resolved_option = 0;
+  string resolved;
+  string_view resolved_map;
+  if (theResolve && NFmiSettings::Optional<bool>("cropper::cache::pixelkeys", false))
+  {
+    // The resolved geometry replaces the others, hence there may be only one
+
+    if (theOptions.has('g') + theOptions.has('c') + theOptions.has('p') + theOptions.has('l') > 1)
+      throw CropperException(400, "Too many cropping geometries defined, use only one");
+
+    for (const char name : {'p', 'l'})
+    {
+      const string_view geometry = theOptions.get(name);
+      if (theOptions.has(name) && geometry.find(';') == string_view::npos)
+      {
+        resolved_option = name;
+        resolved = resolve_geometry(name, geometry);
+        if (theOptions.has('L'))
+          resolved_map = geometry.substr(geometry.rfind(':') + 1);
+      }
+    }
+  }
+
+  string query;
+  auto append_value = [&query](string_view theValue)
+  {
+    for (const char ch : theValue)
+    {
+      if (ch == '%' || ch == '&')
+        query += (ch == '%' ? "%25" : "%26");
+      else
+        query += ch;
+    }
+  };
+
+  for (const char *opt = "ADFILMSTZcfgklptz"; *opt != '\0'; ++opt)
+  {
+    const char name = *opt;
+    if (name == resolved_option || !(theOptions.has(name) || (name == 'c' && resolved_option)))
+      continue;
+
+    string_view value = (name == 'c' && resolved_option ? string_view(resolved)
+                                                        : theOptions.get(name));
+    string canonical;
+
+    switch (name)
+    {
+      case 'A':
+        if (value == "0")
+          continue;
+        value = string_view();
+        break;
+      case 'D':
+        if (!theOptions.has('F'))
+          continue;
+        break;
+      case 'M':
+        if (!has_center)
+          continue;
+        if (value == "square:black")
+          value = "square";
+        break;
+      case 'S':
+        if (value.size() > 8 && value.substr(value.size() - 8) == ":lanczos")
+          value.remove_suffix(8);
+        break;
+      case 'T':
+        canonical = canonical_spec(value, timestamp_defaults, timestamp_parts, timestamp_xmargin);
+        value = canonical;
+        break;
+      case 'L':
+        canonical = canonical_labels(value);
+        value = canonical;
+        break;
+      case 'Z':
+        if (value == default_reduction)
+          value = string_view();
+        break;
+      case 'k':
+        if (!theOptions.has('T'))
+          continue;
+        break;
+      case 't':
+        if (!theOptions.has('T') || value == theTimezone)
+          continue;
+        break;
+    }
+
+    if (!query.empty())
+      query += '&';
+    query += name;
+    if (!value.empty())
+    {
+      query += '=';
+      append_value(value);
+    }
+  }
+  if (!resolved_map.empty())
+  {
+    query += "&map=";
+    append_value(resolved_map);
+  }
+  if (theOptions.has('L'))
+  {
+    const string versions = label_set_versions(theOptions.get('L'));
+    if (!versions.empty())
+      query += "&@=" + versions;
+  }
+  return query;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Create the directory of a cache file
+ */
+// ----------------------------------------------------------------------
+
+void create_cache_directory(const string &theCacheFile)
+{
+  if (!NFmiFileSystem::CreateDirectory(theCacheFile.substr(0, theCacheFile.rfind('/'))))
+    throw CropperException(500, "Unable to create cache directory for temporary files");
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Output a "not modified" response if possible
  *
  * \param theFile The file whose modification time is requested
+ * \param theCacheFile The cache name of the request, empty if none
  * \return True, if a not-modified response was sent
  */
 // ----------------------------------------------------------------------
 
-bool not_modified(const string &theFile)
+bool not_modified(const string &theFile, const string &theCacheFile)
 {
-  if (getenv("QUERY_STRING") == 0 || getenv("HTTP_IF_MODIFIED_SINCE") == 0)
+  if (theCacheFile.empty() || getenv("HTTP_IF_MODIFIED_SINCE") == 0)
     return false;
 
   // If cached file exists and is newer than the original
   // file, respond "Not Modified"
 
-  const string tmpfile = cachename(getenv("QUERY_STRING"));
+  const FileStatus cache = file_status(theCacheFile);
+  const FileStatus file = file_status(theFile);
 
   // Safety checks
 
-  if (!NFmiFileSystem::FileExists(tmpfile) || !NFmiFileSystem::FileExists(theFile))
+  if (!cache.exists || !file.exists)
   {
-    cout << "Status: 304 Not Modified" << endl << endl;
+    cout << "Status: 304 Not Modified" << endl << server_timing() << endl;
+    metrics_count(NotModifiedRequests);
+    log_request("not_modified", 304, 0, getenv("QUERY_STRING"));
     return true;
   }
 
   // Age check
-  if (NFmiFileSystem::FileModificationTime(theFile) >=
-      NFmiFileSystem::FileModificationTime(tmpfile))
+  if (file.modtime >= cache.modtime)
     return false;
 
-  cout << "Status: 304 Not Modified" << endl << endl;
+  cout << "Status: 304 Not Modified" << endl << server_timing() << endl;
+  metrics_count(NotModifiedRequests);
+  log_request("not_modified", 304, 0, getenv("QUERY_STRING"));
   return true;
 }
 
@@ -262,27 +823,33 @@ bool not_modified(const string &theFile)
 /*!
  * \brief Output image from cache if possible
  *
- * \param theQueryString The value of the QUERY_STRING variable
+ * A cache file removed after the check, for example by a sweep, is
+ * treated as a miss so that the image is rendered again.
+ *
+ * \param theCacheFile The cache name of the request, empty if none
  * \return True, if a cached image was output
  */
 // ----------------------------------------------------------------------
 
-bool http_output_cache(const char *theQueryString)
+bool http_output_cache(const string &theCacheFile)
 {
-  if (theQueryString == 0)
+  if (theCacheFile.empty())
     return false;
 
-  const string filename = cachename(theQueryString);
-  if (!NFmiFileSystem::FileExists(filename))
-    return false;
+  FileStatus status;
+  {
+    StageTimer timer("cache");
+    status = file_status(theCacheFile);
+    if (!status.exists)
+      return false;
+  }
 
-  http_output_image(filename);
-  return true;
+  return output_file(theCacheFile, status, true);
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Establish the map projection for the given map name
+ * \brief Read the map projection for the given map name
  *
  * Throws if the map does not have a system description
  *
@@ -291,9 +858,10 @@ bool http_output_cache(const char *theQueryString)
  */
 // ----------------------------------------------------------------------
 
-NFmiAreaFactory::return_type create_map(const string &theMap)
+NFmiAreaFactory::return_type read_map(const string &theMap)
 {
-  const string areafile = "/smartmet/share/maps/" + theMap + "/area.cnf";
+  const string mapsdir = NFmiSettings::Optional<string>("cropper::mapsdir", default_mapsdir);
+  const string areafile = mapsdir + "/" + theMap + "/area.cnf";
   if (!NFmiFileSystem::FileExists(areafile))
     throw CropperException(400, "Map " + theMap + " is not available");
 
@@ -322,82 +890,482 @@ NFmiAreaFactory::return_type create_map(const string &theMap)
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Establish the coordinate for a named location
+ * \brief Establish the map projection for the given map name
  *
- * Throws if the location name is unknown
+ * The projections are cached, since batch runs use the same few maps
+ * over and over again. The areas are shared between threads, which is
+ * safe since only const methods are used.
  *
- * \param theName The location name
- * \return The location longitude and latitude
+ * \param theMap The map name
+ * \return The created NFmiArea object
  */
 // ----------------------------------------------------------------------
 
-const NFmiPoint find_location(const string &theName)
+NFmiAreaFactory::return_type create_map(string_view theMap)
 {
-  const string coordfile = "/smartmet/share/coordinates/kaikki.txt";
-
-  NFmiLocationFinder finder;
-  if (!finder.AddFile(coordfile, false))
-    throw CropperException(500, "Failed to read coordinate database");
+  static std::mutex mutex;
+  static map<string, NFmiAreaFactory::return_type, less<> > cache;
 
-  const NFmiPoint lonlat = finder.Find(theName);
-  if (finder.LastSearchFailed())
-    throw CropperException(400, "Location '" + theName + "' unknown");
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = cache.find(theMap);
+  if (it != cache.end())
+    return it->second;
 
-  return lonlat;
+  const string name(theMap);
+  NFmiAreaFactory::return_type area = read_map(name);
+  cache.insert(make_pair(name, area));
+  return area;
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Output the given imagefile
+ * \brief Establish the coordinate for a named location
  *
- * Note that we must never write over the final filename due to
- * compression delays causing race situations.
+ * Throws if the location name is unknown
+ *
+ * \param theName The location name
+ * \return The location longitude and latitude
  */
 // ----------------------------------------------------------------------
 
-void http_output_image(const Imagine::NFmiImage &theImage,
-                       const string &theFile,
-                       const string &theType,
-                       bool theCacheFlag)
+const NFmiPoint find_location(string_view theName)
+{
+  const string coordfile =
+      NFmiSettings::Optional<string>("cropper::coordinates", default_coordinates);
+
+  // The database is read only once per process. Find is not const,
+  // hence the lock is held during the search too.
+
+  static std::mutex mutex;
+  static unique_ptr<NFmiLocationFinder> finder;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!finder)
+  {
+    unique_ptr<NFmiLocationFinder> tmp(new NFmiLocationFinder);
+    if (!tmp->AddFile(coordfile, false))
+      throw CropperException(500, "Failed to read coordinate database");
+    finder = std::move(tmp);
+  }
+
+  const string name(theName);
+  const NFmiPoint lonlat = finder->Find(name);
+  if (finder->LastSearchFailed())
+    throw CropperException(400, "Location '" + name + "' unknown");
+
+  return lonlat;
+}
+
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Append a time in the HTTP date format
+ */
+// ----------------------------------------------------------------------
+
+void append_time(pmr::string &theHeaders, ::time_t theTime)
+{
+  struct ::tm t;
+  char buffer[64];
+  const size_t n =
+      strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&theTime, &t));
+  theHeaders.append(buffer, n);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Append a number
+ */
+// ----------------------------------------------------------------------
+
+void append_number(pmr::string &theHeaders, size_t theNumber)
+{
+  char buffer[24];
+  const to_chars_result result = to_chars(buffer, buffer + sizeof(buffer), theNumber);
+  theHeaders.append(buffer, result.ptr);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The headers of a new rendering
+ *
+ * The headers are assembled in the request arena and written with a
+ * single call. We expire everything in 24 hours.
+ *
+ * \param theMimeType The content type
+ * \param theLastModified The modification time of the source
+ * \param theSize The content length
+ */
+// ----------------------------------------------------------------------
+
+pmr::string render_headers(string_view theMimeType, ::time_t theLastModified, size_t theSize)
 {
-  // We expire everything in 24 hours
   const long maxage = 24 * 3600;
-  ::time_t expiration_time = time(0) + maxage;
+
+  pmr::string headers(RequestArena::current());
+  headers.reserve(512);
+  headers += "Status: 200 OK\nContent-Type: ";
+  headers += theMimeType;
+  headers += "\nExpires: ";
+  append_time(headers, time(0) + maxage);
+  headers += "\nLast-Modified: ";
+  append_time(headers, theLastModified);
+  headers += "\nCache-Control: max-age=";
+  append_number(headers, maxage);
+  headers += ", public\nContent-Length: ";
+  append_number(headers, theSize);
+  headers += "\nX-Cache: MISS\n";
+  headers += server_timing();
+  headers += '\n';
+  return headers;
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Output the given imagefile
+ *
+ * Note that we must never write over the final filename due to
+ * compression delays causing race situations.
+ *
+ * \param theCacheFile The cache name, empty if the result is not cached
+ */
+// ----------------------------------------------------------------------
+
+void http_output_image(const Imagine::NFmiImage &theImage,
+                       const string &theFile,
+                       const string &theType,
+                       const string &theCacheFile)
+{
   ::time_t last_modified = NFmiFileSystem::FileModificationTime(theFile);
 
   // This name is unique since the process number is unique
 
-  string tmpfile, finalfile;
-  if (theCacheFlag)
+  const bool nocache = theCacheFile.empty();
+  const string &finalfile = theCacheFile;
+  string tmpfile;
+  if (nocache)
     tmpfile = ("/tmp/cropper/" + NFmiStringTools::Convert(::getpid()) + "." + theType);
   else
   {
-    finalfile = cachename(getenv("QUERY_STRING"));
+    create_cache_directory(finalfile);
     tmpfile = finalfile + "." + NFmiStringTools::Convert(::getpid());
   }
 
-  theImage.Write(tmpfile, theType);
+  check_deadline("encode");
+  {
+    StageTimer timer("encode");
+    theImage.Write(tmpfile, theType);
+  }
 
   ifstream in(tmpfile.c_str(), ios::in | ios::binary);
   if (!in)
     throw CropperException(500, "Unable to create temporary file");
 
-  cout << "Status: 200 OK\n"
-       << "Content-Type: image/" << theType << endl
-       << "Expires: " << format_time(expiration_time) << endl
-       << "Last-Modified: " << format_time(last_modified) << endl
-       << "Cache-Control: max-age=" << maxage << ", public" << endl
-       << "Content-Length: " << NFmiFileSystem::FileSize(tmpfile) << endl
-       << endl
-       << in.rdbuf();
+  const size_t size = NFmiFileSystem::FileSize(tmpfile);
+
+  cout << render_headers("image/" + theType, last_modified, size) << in.rdbuf();
   in.close();
 
-  if (theCacheFlag)
+  if (nocache)
     NFmiFileSystem::RemoveFile(tmpfile);
   else
+  {
+    NFmiFileSystem::RenameFile(tmpfile, finalfile);
+    metrics_count(CacheFilesWritten);
+    metrics_count(CacheBytesWritten, size);
+  }
+
+  metrics_count(RenderRequests);
+  metrics_count(RenderBytes, size);
+  if (const Timings *timings = Timings::current())
+    metrics_render_time(timings->total());
+  log_request("render", 200, size, getenv("QUERY_STRING"));
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Encode an image into memory
+ *
+ * Imagine can only write files, hence a temporary file is used.
+ */
+// ----------------------------------------------------------------------
+
+const string encode_image(const Imagine::NFmiImage &theImage, const string &theType)
+{
+  static std::atomic<unsigned int> counter(0);
+
+  const string cachedir = NFmiSettings::Optional<string>("cropper::cachedir", default_cachedir);
+  if (!NFmiFileSystem::CreateDirectory(cachedir))
+    throw CropperException(500, "Unable to create cache directory for temporary files");
+
+  const string tmpfile = (cachedir + "/" + NFmiStringTools::Convert(::getpid()) + "." +
+                          NFmiStringTools::Convert(counter++) + "." + theType);
+
+  check_deadline("encode");
+  {
+    StageTimer timer("encode");
+    theImage.Write(tmpfile, theType);
+  }
+
+  ifstream in(tmpfile.c_str(), ios::in | ios::binary);
+  if (!in)
+    throw CropperException(500, "Unable to create temporary file");
+  const string ret((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+  in.close();
+
+  NFmiFileSystem::RemoveFile(tmpfile);
+  return ret;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Output the given encoded image data
+ *
+ * The data is written to the cache first unless caching is disabled.
+ *
+ * \param theCacheFile The cache name, empty if the result is not cached
+ */
+// ----------------------------------------------------------------------
+
+void http_output_data(string_view theData,
+                      const string &theFile,
+                      const string &theMimeType,
+                      const string &theCacheFile)
+{
+  ::time_t last_modified = NFmiFileSystem::FileModificationTime(theFile);
+
+  if (!theCacheFile.empty())
+  {
+    const string &finalfile = theCacheFile;
+    const string tmpfile = finalfile + "." + NFmiStringTools::Convert(::getpid());
+    create_cache_directory(finalfile);
+
+    ofstream out(tmpfile.c_str(), ios::out | ios::binary);
+    out << theData;
+    out.close();
+    if (!out)
+      throw CropperException(500, "Unable to create temporary file");
+
     NFmiFileSystem::RenameFile(tmpfile, finalfile);
+    metrics_count(CacheFilesWritten);
+    metrics_count(CacheBytesWritten, theData.size());
+  }
+
+  cout << render_headers(theMimeType, last_modified, theData.size()) << theData;
+
+  metrics_count(RenderBytes, theData.size());
+  if (const Timings *timings = Timings::current())
+    metrics_render_time(timings->total());
+  log_request("render", 200, theData.size(), getenv("QUERY_STRING"));
+}
+
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Parse the <width>x<height> part of a geometry
+ *
+ * The height ends at the first '+', '-' or ':', the rest of the
+ * string is returned in theRest.
+ *
+ * \return False on failure
+ */
+// ----------------------------------------------------------------------
+
+bool parse_size(string_view theGeometry, int &width, int &height, string_view &theRest)
+{
+  const string_view::size_type x = theGeometry.find('x');
+  if (x == string_view::npos)
+    return false;
+
+  string_view::size_type end = theGeometry.find_first_of("+-:", x + 1);
+  if (end == string_view::npos)
+    end = theGeometry.size();
+
+  theRest = theGeometry.substr(end);
+  return (parse_number(theGeometry.substr(0, x), width) &&
+          parse_number(theGeometry.substr(x + 1, end - x - 1), height));
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Extract a signed number from the start of a geometry
+ *
+ * The number may start with a sign, and ends at the next '+', '-'
+ * or ':' which is not part of an exponent.
+ */
+// ----------------------------------------------------------------------
+
+string_view take_number(string_view &theString)
+{
+  string_view::size_type end = 1;
+  while (end < theString.size())
+  {
+    const char ch = theString[end];
+    if (ch == ':' || ((ch == '+' || ch == '-') && theString[end - 1] != 'e' &&
+                      theString[end - 1] != 'E' && theString[end - 1] != '+'))
+      break;
+    ++end;
+  }
+  end = min(end, theString.size());
+  const string_view number = theString.substr(0, end);
+  theString.remove_prefix(end);
+  return number;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Parse a geometry of the form <width>x<height>+<x>+<y>
+ *
+ * \return False on failure
+ */
+// ----------------------------------------------------------------------
+
+bool parse_pixel_geometry(string_view theGeometry, int &x, int &y, int &width, int &height)
+{
+  string_view rest;
+  if (!parse_size(theGeometry, width, height, rest))
+    return false;
+
+  if (rest.empty() || rest[0] != '+')
+    return false;
+  rest.remove_prefix(1);
+  if (!parse_number(take_number(rest), x))
+    return false;
+
+  if (rest.empty() || rest[0] != '+')
+    return false;
+  rest.remove_prefix(1);
+  if (!parse_number(take_number(rest), y))
+    return false;
+
+  return rest.empty();
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Parse a font specification of the form <font>:<width>x<height>
+ */
+// ----------------------------------------------------------------------
+
+void parse_font(string_view theSpec, const char *theOption, string &font, int &width, int &height)
+{
+  string_view parts[2];
+  if (split(theSpec, ":", parts, 2) != 2)
+    throw CropperException(400,
+                           string("Invalid font specification for option -") + theOption +
+                               " : '" + string(theSpec) + "'");
+
+  string_view size[2];
+  if (split(parts[1], "x", size, 2) != 2)
+    throw CropperException(400,
+                           string("Invalid font size specification for option -") + theOption +
+                               " : '" + string(parts[1]) + "'");
+
+  font.assign(parts[0].data(), parts[0].size());
+  width = to_int(size[0], theOption);
+  height = to_int(size[1], theOption);
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Parse a scale specification
+ *
+ * The format is <factor> or <width>x<height>, optionally followed by
+ * :box or :lanczos. The factor is relative to the source image and may
+ * not exceed one, the size is a box the result must fit into.
+ *
+ * \param theSpec The specification
+ * \param factor Returns the factor, or zero if a size was given
+ * \param width Returns the maximum width
+ * \param height Returns the maximum height
+ * \param kernel Returns the resampling kernel
+ */
+// ----------------------------------------------------------------------
+
+void parse_scale(
+    string_view theSpec, double &factor, int &width, int &height, ResampleKernel &kernel)
+{
+  string_view parts[2];
+  if (split(theSpec, ":", parts, 2) > 2)
+    throw CropperException(400, "Invalid scale specification '" + string(theSpec) + "'");
+
+  kernel = resample_kernel(parts[1]);
+  factor = 0;
+  width = height = 0;
+
+  string_view rest;
+  if (parse_size(parts[0], width, height, rest))
+  {
+    if (!rest.empty() || width < 1 || height < 1)
+      throw CropperException(400, "Invalid scale size '" + string(parts[0]) + "'");
+  }
+  else
+  {
+    factor = to_double(parts[0], "S");
+    if (factor <= 0 || factor > 1)
+      throw CropperException(400, "Scale factor must be in the range 0-1");
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Select the downscaled level of the source for a request
+ *
+ * Level n of the source is downscaled by 2^n and is used if it exists,
+ * is up to date, and the request downscales at least as much. A size
+ * is converted to a factor using the size of the geometry, without a
+ * geometry the full source size is not known and no level is used.
+ * At most cropper::pyramid::levels levels are checked, default 3.
+ *
+ * \param theSource The source image
+ * \param theOptions The parsed options
+ * \return The level, zero for the source itself
+ */
+// ----------------------------------------------------------------------
+
+int pyramid_level(const string &theSource, const Options &theOptions)
+{
+  if (!theOptions.has('S'))
+    return 0;
+
+  double factor;
+  int width, height;
+  ResampleKernel kernel;
+  parse_scale(theOptions.get('S'), factor, width, height, kernel);
+
+  if (factor == 0)
+  {
+    for (const char name : {'p', 'l', 'c', 'g'})
+    {
+      int w, h;
+      string_view rest;
+      if (theOptions.has(name) && parse_size(theOptions.get(name), w, h, rest) && w > 0 && h > 0)
+        factor = min(static_cast<double>(width) / w, static_cast<double>(height) / h);
+    }
+    if (factor == 0)
+      return 0;
+  }
+
+  const int levels = NFmiSettings::Optional<int>("cropper::pyramid::levels", 3);
+  for (int level = levels; level > 0; level--)
+  {
+    if (factor > 1.0 / (1 << level))
+      continue;
+    const string filename = pyramid_file(theSource, level);
+    if (NFmiFileSystem::FileExists(filename) &&
+        NFmiFileSystem::FileModificationTime(filename) >=
+            NFmiFileSystem::FileModificationTime(theSource))
+      return level;
+  }
+  return 0;
 }
 
+}  // namespace
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Parse a cornered geometry string
@@ -414,16 +1382,13 @@ void http_output_image(const Imagine::NFmiImage &theImage,
  */
 // ----------------------------------------------------------------------
 
-void parse_geometry(const string &theGeometry, int &x1, int &y1, int &width, int &height)
+void parse_geometry(string_view theGeometry, int &x1, int &y1, int &width, int &height)
 {
   if (theGeometry.empty())
     throw CropperException(400, "The geometry specification is empty!");
 
-  istringstream geom(theGeometry);
-  char ch1, ch2, ch3;
-  geom >> width >> ch1 >> height >> ch2 >> x1 >> ch3 >> y1;
-  if (geom.fail() || ch1 != 'x' || ch2 != '+' || ch3 != '+')
-    throw CropperException(400, "Failed to parse geometry '" + theGeometry + "'");
+  if (!parse_pixel_geometry(theGeometry, x1, y1, width, height))
+    throw CropperException(400, "Failed to parse geometry '" + string(theGeometry) + "'");
 }
 
 // ----------------------------------------------------------------------
@@ -442,16 +1407,13 @@ void parse_geometry(const string &theGeometry, int &x1, int &y1, int &width, int
  */
 // ----------------------------------------------------------------------
 
-void parse_center_geometry(const string &theGeometry, int &xc, int &yc, int &width, int &height)
+void parse_center_geometry(string_view theGeometry, int &xc, int &yc, int &width, int &height)
 {
   if (theGeometry.empty())
     throw CropperException(400, "The geometry specification is empty!");
 
-  istringstream geom(theGeometry);
-  char ch1, ch2, ch3;
-  geom >> width >> ch1 >> height >> ch2 >> xc >> ch3 >> yc;
-  if (geom.fail() || ch1 != 'x' || ch2 != '+' || ch3 != '+')
-    throw CropperException(400, "Failed to parse geometry '" + theGeometry + "'");
+  if (!parse_pixel_geometry(theGeometry, xc, yc, width, height))
+    throw CropperException(400, "Failed to parse geometry '" + string(theGeometry) + "'");
 }
 
 // ----------------------------------------------------------------------
@@ -472,24 +1434,25 @@ void parse_center_geometry(const string &theGeometry, int &xc, int &yc, int &wid
 // ----------------------------------------------------------------------
 
 NFmiAreaFactory::return_type parse_latlon_geometry(
-    const string &theGeometry, int &xc, int &yc, int &width, int &height)
+    string_view theGeometry, int &xc, int &yc, int &width, int &height)
 {
   if (theGeometry.empty())
     throw CropperException(400, "the geometry specification is empty!");
 
-  istringstream geom(theGeometry);
-  string mapname;
+  string_view rest;
   double lon, lat;
-  char ch1, ch2;
-  geom >> width >> ch1 >> height >> lon >> lat >> ch2 >> mapname;
-  if (geom.fail() || ch1 != 'x' || ch2 != ':')
-    throw CropperException(400, "failed to parse geometry '" + theGeometry + "'");
+  if (!parse_size(theGeometry, width, height, rest) || rest.empty() || rest[0] == ':' ||
+      !parse_number(take_number(rest), lon) || rest.empty() || rest[0] == ':' ||
+      !parse_number(take_number(rest), lat) || rest.size() < 2 || rest[0] != ':')
+    throw CropperException(400, "failed to parse geometry '" + string(theGeometry) + "'");
+
+  const string_view mapname = rest.substr(1);
 
   if (lon < -180 || lon > 180)
-    throw CropperException(400, "longitude out of bounds in '" + theGeometry + "'");
+    throw CropperException(400, "longitude out of bounds in '" + string(theGeometry) + "'");
 
   if (lat < -90 || lat > 90)
-    throw CropperException(400, "Latitude out of bounds in '" + theGeometry + "'");
+    throw CropperException(400, "Latitude out of bounds in '" + string(theGeometry) + "'");
 
   NFmiAreaFactory::return_type area = create_map(mapname);
 
@@ -519,19 +1482,19 @@ NFmiAreaFactory::return_type parse_latlon_geometry(
 // ----------------------------------------------------------------------
 
 NFmiAreaFactory::return_type parse_named_geometry(
-    const string &theGeometry, int &xc, int &yc, int &width, int &height)
+    string_view theGeometry, int &xc, int &yc, int &width, int &height)
 {
   if (theGeometry.empty())
     throw CropperException(400, "The geometry specification is empty!");
 
-  istringstream geom(theGeometry);
-  char ch1, ch2;
-  geom >> width >> ch1 >> height >> ch2;
-  string cityname, mapname;
-  getline(geom, cityname, ':');
-  getline(geom, mapname);
-  if (geom.fail() || ch1 != 'x' || ch2 != '+')
-    throw CropperException(400, "Failed to parse geometry '" + theGeometry + "'");
+  string_view rest;
+  const bool ok = parse_size(theGeometry, width, height, rest);
+  const string_view::size_type colon = rest.find(':');
+  if (!ok || rest.empty() || rest[0] != '+' || colon == string_view::npos)
+    throw CropperException(400, "Failed to parse geometry '" + string(theGeometry) + "'");
+
+  const string_view cityname = rest.substr(1, colon - 1);
+  const string_view mapname = rest.substr(colon + 1);
 
   const NFmiPoint city = find_location(cityname);
 
@@ -546,6 +1509,76 @@ NFmiAreaFactory::return_type parse_named_geometry(
   return area;
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Resolve a named or latlon geometry into a centered pixel geometry
+ *
+ * The results are memoized in the cache directory, since a named
+ * location requires reading the coordinate database, which would cost
+ * more than the cache lookup saves. A memo is valid as long as it is
+ * newer than the map and the coordinate database.
+ *
+ * \param theOption The geometry option, p or l
+ * \param theGeometry The geometry string
+ * \return The equivalent geometry for option c
+ */
+// ----------------------------------------------------------------------
+
+const string resolve_geometry(char theOption, string_view theGeometry)
+{
+  const string cachedir = NFmiSettings::Optional<string>("cropper::cachedir", default_cachedir);
+  const string memofile =
+      cachedir + "/geometry/" + hash128(theGeometry.data(), theGeometry.size(), theOption).hex();
+
+  const string_view::size_type colon = theGeometry.rfind(':');
+  const string mapname(colon == string_view::npos ? string_view() : theGeometry.substr(colon + 1));
+  const string mapsdir = NFmiSettings::Optional<string>("cropper::mapsdir", default_mapsdir);
+
+  ::time_t sources = NFmiFileSystem::FileModificationTime(mapsdir + "/" + mapname + "/area.cnf");
+  if (theOption == 'p')
+    sources = max(sources,
+                  NFmiFileSystem::FileModificationTime(NFmiSettings::Optional<string>(
+                      "cropper::coordinates", default_coordinates)));
+
+  const ::time_t memotime = NFmiFileSystem::FileModificationTime(memofile);
+  if (memotime > 0 && memotime >= sources)
+  {
+    ifstream in(memofile.c_str(), ios::in);
+    string geometry;
+    if (getline(in, geometry) && !geometry.empty())
+      return geometry;
+  }
+
+  int xc, yc, width, height;
+  if (theOption == 'p')
+    parse_named_geometry(theGeometry, xc, yc, width, height);
+  else
+    parse_latlon_geometry(theGeometry, xc, yc, width, height);
+
+  const string geometry = NFmiStringTools::Convert(width) + "x" + NFmiStringTools::Convert(height) +
+                          "+" + NFmiStringTools::Convert(xc) + "+" + NFmiStringTools::Convert(yc);
+
+  // Failing to memoize only costs speed
+
+  try
+  {
+    const string tmpfile = memofile + "." + NFmiStringTools::Convert(::getpid());
+    create_cache_directory(memofile);
+    ofstream out(tmpfile.c_str(), ios::out);
+    out << geometry << endl;
+    out.close();
+    if (out)
+      NFmiFileSystem::RenameFile(tmpfile, memofile);
+    else
+      NFmiFileSystem::RemoveFile(tmpfile);
+  }
+  catch (...)
+  {
+  }
+
+  return geometry;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Crop an image given cornered geometry
@@ -558,10 +1591,15 @@ NFmiAreaFactory::return_type parse_named_geometry(
  * \param theXoff The new X-origin
  * \param theYoff The new Y-origin
  * \return unique_ptr to the cropped image
+ *
+ * The image may be an NFmiImage or a MappedRaster, the rows are
+ * copied in order so that only the crop window of a mapped raster
+ * is paged in.
  */
 // ----------------------------------------------------------------------
 
-std::unique_ptr<Imagine::NFmiImage> crop_corner(const Imagine::NFmiImage &theImage,
+template <typename Image>
+std::unique_ptr<Imagine::NFmiImage> crop_corner(const Image &theImage,
                                                 int theX1,
                                                 int theY1,
                                                 int theWidth,
@@ -590,8 +1628,8 @@ std::unique_ptr<Imagine::NFmiImage> crop_corner(const Imagine::NFmiImage &theIma
   theYoff = y1;
 
   std::unique_ptr<Imagine::NFmiImage> image(new Imagine::NFmiImage(width, height));
-  for (int i = x1; i < x2; i++)
-    for (int j = y1; j < y2; j++)
+  for (int j = y1; j < y2; j++)
+    for (int i = x1; i < x2; i++)
       (*image)(i - x1, j - y1) = theImage(i, j);
 
   return image;
@@ -612,7 +1650,8 @@ std::unique_ptr<Imagine::NFmiImage> crop_corner(const Imagine::NFmiImage &theIma
  */
 // ----------------------------------------------------------------------
 
-unique_ptr<Imagine::NFmiImage> crop_center(const Imagine::NFmiImage &theImage,
+template <typename Image>
+unique_ptr<Imagine::NFmiImage> crop_center(const Image &theImage,
                                            int theXC,
                                            int theYC,
                                            int theWidth,
@@ -641,8 +1680,8 @@ unique_ptr<Imagine::NFmiImage> crop_center(const Imagine::NFmiImage &theImage,
   theYoff = y1;
 
   unique_ptr<Imagine::NFmiImage> image(new Imagine::NFmiImage(width, height));
-  for (int i = x1; i < x2; i++)
-    for (int j = y1; j < y2; j++)
+  for (int j = y1; j < y2; j++)
+    for (int i = x1; i < x2; i++)
       (*image)(i - x1, j - y1) = theImage(i, j);
 
   return image;
@@ -654,7 +1693,7 @@ unique_ptr<Imagine::NFmiImage> crop_center(const Imagine::NFmiImage &theImage,
  */
 // ----------------------------------------------------------------------
 
-Imagine::NFmiColorTools::Color parse_color(const string &theColor)
+Imagine::NFmiColorTools::Color parse_color(string_view theColor)
 {
   if (theColor.empty())
     return Imagine::NFmiColorTools::MissingColor;
@@ -663,11 +1702,11 @@ Imagine::NFmiColorTools::Color parse_color(const string &theColor)
 
   const char ch1 = theColor[0];
   if (ch1 == '#')
-    return Imagine::NFmiColorTools::HexToColor(theColor.substr(1));
+    return Imagine::NFmiColorTools::HexToColor(string(theColor.substr(1)));
 
   // Handle ascii format
 
-  return Imagine::NFmiColorTools::ColorValue(theColor);
+  return Imagine::NFmiColorTools::ColorValue(string(theColor));
 }
 
 // ----------------------------------------------------------------------
@@ -675,13 +1714,13 @@ Imagine::NFmiColorTools::Color parse_color(const string &theColor)
  * \brief Extract YYYYMMDDHHMI timestamps from given string
  *
  * \param theString The string from which to extract the stamps
- * \return Vector of found timestamp strings
+ * \return Views of the found timestamps, allocated from the request arena
  */
 // ----------------------------------------------------------------------
 
-const vector<string> extract_timestamps(const string &theString)
+const pmr::vector<string_view> extract_timestamps(string_view theString)
 {
-  vector<string> ret;
+  pmr::vector<string_view> ret(RequestArena::current());
 
   string::size_type pos1 = 0;
 
@@ -709,26 +1748,25 @@ const vector<string> extract_timestamps(const string &theString)
  */
 // ----------------------------------------------------------------------
 
-const ::tm parse_stamp(const string &theStamp)
+const ::tm parse_stamp(string_view theStamp)
 {
   // As UTC time
   ::tm utc;
   utc.tm_sec = 0;
-  utc.tm_min = NFmiStringTools::Convert<int>(theStamp.substr(10, 2));
-  utc.tm_hour = NFmiStringTools::Convert<int>(theStamp.substr(8, 2));
-  utc.tm_mday = NFmiStringTools::Convert<int>(theStamp.substr(6, 2));
-  utc.tm_mon = NFmiStringTools::Convert<int>(theStamp.substr(4, 2)) - 1;
-  utc.tm_year = NFmiStringTools::Convert<int>(theStamp.substr(0, 4)) - 1900;
+  utc.tm_min = to_int(theStamp.substr(10, 2), "T");
+  utc.tm_hour = to_int(theStamp.substr(8, 2), "T");
+  utc.tm_mday = to_int(theStamp.substr(6, 2), "T");
+  utc.tm_mon = to_int(theStamp.substr(4, 2), "T") - 1;
+  utc.tm_year = to_int(theStamp.substr(0, 4), "T") - 1900;
   utc.tm_wday = -1;
   utc.tm_yday = -1;
   utc.tm_isdst = -1;
 
   ::time_t epochtime = ::timegm(&utc);  // Linux extension
 
-  struct ::tm *local = ::localtime(&epochtime);
-
-  // Return by value, localtime owns the above struct
-  struct ::tm ret = *local;
+  // Reentrant version, batch mode renders in several threads
+  struct ::tm ret;
+  ::localtime_r(&epochtime, &ret);
   return ret;
 }
 
@@ -738,13 +1776,16 @@ const ::tm parse_stamp(const string &theStamp)
  */
 // ----------------------------------------------------------------------
 
-string make_timestamp(const string &theFilename, const string &theType, const string &theFormat)
+string make_timestamp(string_view theFilename, string_view theType, string_view theFormat)
 {
   string ret;
 
-  const vector<string> stamps = extract_timestamps(theFilename);
-  const string obsstamp = (stamps.size() >= 1 ? stamps[0] : "");
-  const string forstamp = (stamps.size() >= 2 ? stamps[1] : "");
+  const pmr::vector<string_view> stamps = extract_timestamps(theFilename);
+  const string_view obsstamp = (stamps.size() >= 1 ? stamps[0] : string_view());
+  const string_view forstamp = (stamps.size() >= 2 ? stamps[1] : string_view());
+
+  // strftime needs a terminated format
+  const pmr::string format(theFormat, RequestArena::current());
 
   const int MAXSIZE = 100;
   char buffer[MAXSIZE + 1];
@@ -759,17 +1800,17 @@ string make_timestamp(const string &theFilename, const string &theType, const st
 
   if (theType == "obs" && !obsstamp.empty())
   {
-    ::strftime(buffer, MAXSIZE, theFormat.c_str(), &obstime);
+    ::strftime(buffer, MAXSIZE, format.c_str(), &obstime);
     ret = buffer;
   }
   else if (theType == "for" && !forstamp.empty())
   {
-    ::strftime(buffer, MAXSIZE, theFormat.c_str(), &fortime);
+    ::strftime(buffer, MAXSIZE, format.c_str(), &fortime);
     ret = buffer;
   }
   else if (theType == "forobs" && !forstamp.empty())
   {
-    ::strftime(buffer, MAXSIZE, theFormat.c_str(), &fortime);
+    ::strftime(buffer, MAXSIZE, format.c_str(), &fortime);
     ret = buffer;
     // append forecast length
     ::time_t otime = ::mktime(&obstime);
@@ -786,86 +1827,281 @@ string make_timestamp(const string &theFilename, const string &theType, const st
   return ret;
 }
 
+namespace
+{
 // ----------------------------------------------------------------------
 /*!
- * \brief Draw a timestamp onto the image
+ * \brief A rendered timestamp box
  *
- * \param theImage The image to draw into
- * \param theOptions The options in string form
+ * The pixels are premultiplied by their opacity so that blending needs
+ * no divisions. The anchor is the point the text was aligned to.
  */
 // ----------------------------------------------------------------------
 
-void draw_timestamp(Imagine::NFmiImage &theImage,
-                    const string &theOptions,
-                    const string &theFilename)
+struct StampBitmap
 {
-  // Initialize the defaults
+  int width = 0;
+  int height = 0;
+  int xanchor = 0;
+  int yanchor = 0;
+  vector<float> pixels;  // premultiplied red, green, blue and opacity
+};
 
-  string format = "%H:%M";
-  string type = "obs";
-  int xmargin = 1;
-  int ymargin = 1;
-  string font = "misc/6x13.pcf.gz:6x13";
-  string color = "black";
-  string backgroundcolor = "#20B4B4B4";
+// ----------------------------------------------------------------------
+/*!
+ * \brief Render a timestamp box into a bitmap
+ *
+ * The text is drawn onto a transparent scratch image large enough for
+ * the box, with the anchor in the corner given by the alignment, and
+ * the result is trimmed to the drawn pixels.
+ */
+// ----------------------------------------------------------------------
 
-  vector<string> parts = NFmiStringTools::Split(theOptions);
+std::shared_ptr<const StampBitmap> render_stamp(const string &theText,
+                                                const string &theFont,
+                                                int theWidth,
+                                                int theHeight,
+                                                int theXMargin,
+                                                int theYMargin,
+                                                Imagine::NFmiColorTools::Color theColor,
+                                                Imagine::NFmiColorTools::Color theBackground,
+                                                Imagine::NFmiAlignment theAlignment)
+{
+  using namespace Imagine::NFmiColorTools;
 
-  // Compulsory options
+  // Conservative size, the font width is zero for proportional fonts
 
-  if (parts.size() < 2)
-    throw CropperException(400, "Too short option string '" + theOptions + "'");
-
-  int x = NFmiStringTools::Convert<int>(parts[0]);
-  int y = NFmiStringTools::Convert<int>(parts[1]);
-
-  // Optional parts
-
-  vector<string>::size_type i = 1;
-  if (parts.size() > i + 1 && !parts[++i].empty())
-    format = parts[i];
-  if (parts.size() > i + 1 && !parts[++i].empty())
-    type = parts[i];
-  if (parts.size() > i + 1 && !parts[++i].empty())
-    xmargin = ymargin = NFmiStringTools::Convert<int>(parts[i]);
-  if (parts.size() > i + 1 && !parts[++i].empty())
-    ymargin = NFmiStringTools::Convert<int>(parts[i]);
-  if (parts.size() > i + 1 && !parts[++i].empty())
-    font = parts[i];
-  if (parts.size() > i + 1 && !parts[++i].empty())
-    color = parts[i];
-  if (parts.size() > i + 1 && !parts[++i].empty())
-    backgroundcolor = parts[i];
+  const int pad = 2;
+  const int charsize = max(theWidth, theHeight);
+  const int w = static_cast<int>(theText.size()) * charsize + 2 * abs(theXMargin) + 2 * pad;
+  const int h = 2 * charsize + 2 * abs(theYMargin) + 2 * pad;
 
-  // Extra parts
+  const bool east = (theAlignment == Imagine::kFmiAlignNorthEast ||
+                     theAlignment == Imagine::kFmiAlignSouthEast);
+  const bool south = (theAlignment == Imagine::kFmiAlignSouthWest ||
+                      theAlignment == Imagine::kFmiAlignSouthEast);
+  const int x = (east ? w - 1 - pad - abs(theXMargin) : pad + abs(theXMargin));
+  const int y = (south ? h - 1 - pad - abs(theYMargin) : pad + abs(theYMargin));
 
-  if (parts.size() > i + 1)
-    throw CropperException(400, "Too many -T parts in option '" + theOptions + "'");
+  Imagine::NFmiImage scratch(w, h, TransparentColor);
+  {
+    Imagine::NFmiFace face(theFont, theWidth, theHeight);
+    face.Background(true);
+    face.BackgroundColor(theBackground);
+    face.BackgroundMargin(theXMargin, theYMargin);
+    face.Draw(scratch, x, y, theText, theAlignment, theColor);
+  }
 
-  // Parse the font option
+  // Trim to the drawn pixels
+
+  int x1 = w, y1 = h, x2 = -1, y2 = -1;
+  for (int j = 0; j < h; j++)
+    for (int i = 0; i < w; i++)
+      if (GetAlpha(scratch(i, j)) < MaxAlpha)
+      {
+        x1 = min(x1, i);
+        y1 = min(y1, j);
+        x2 = max(x2, i);
+        y2 = max(y2, j);
+      }
+
+  std::shared_ptr<StampBitmap> bitmap(new StampBitmap);
+  if (x2 < 0)
+    return bitmap;
+
+  bitmap->width = x2 - x1 + 1;
+  bitmap->height = y2 - y1 + 1;
+  bitmap->xanchor = x - x1;
+  bitmap->yanchor = y - y1;
+  bitmap->pixels.reserve(static_cast<size_t>(bitmap->width) * bitmap->height * 4);
+  for (int j = y1; j <= y2; j++)
+    for (int i = x1; i <= x2; i++)
+    {
+      const Color c = scratch(i, j);
+      const float opacity = static_cast<float>(MaxAlpha - GetAlpha(c)) / MaxAlpha;
+      bitmap->pixels.push_back(GetRed(c) * opacity);
+      bitmap->pixels.push_back(GetGreen(c) * opacity);
+      bitmap->pixels.push_back(GetBlue(c) * opacity);
+      bitmap->pixels.push_back(opacity);
+    }
+  return bitmap;
+}
 
-  vector<string> fontparts = NFmiStringTools::Split(font, ":");
-  if (fontparts.size() != 2)
-    throw CropperException(400, "Invalid font specification for option -T : '" + font + "'");
-  font = fontparts[0];
-  fontparts = NFmiStringTools::Split(fontparts[1], "x");
-  if (fontparts.size() != 2)
-    throw CropperException(
-        400, "Invalid font size specification for option -T : '" + fontparts[1] + "'");
-  const int width = NFmiStringTools::Convert<int>(fontparts[0]);
-  const int height = NFmiStringTools::Convert<int>(fontparts[1]);
+// ----------------------------------------------------------------------
+/*!
+ * \brief Blend a timestamp bitmap over the image
+ *
+ * \param theImage The image to draw into
+ * \param theBitmap The rendered timestamp
+ * \param theX The x-coordinate of the anchor
+ * \param theY The y-coordinate of the anchor
+ */
+// ----------------------------------------------------------------------
 
-  // Parse the font color option
+void blend_stamp(Imagine::NFmiImage &theImage, const StampBitmap &theBitmap, int theX, int theY)
+{
+  using namespace Imagine::NFmiColorTools;
+
+  const int x0 = theX - theBitmap.xanchor;
+  const int y0 = theY - theBitmap.yanchor;
+  const int i1 = max(0, -x0);
+  const int j1 = max(0, -y0);
+  const int i2 = min(theBitmap.width, theImage.Width() - x0);
+  const int j2 = min(theBitmap.height, theImage.Height() - y0);
+
+  for (int j = j1; j < j2; j++)
+  {
+    const float *src = &theBitmap.pixels[(static_cast<size_t>(j) * theBitmap.width + i1) * 4];
+    for (int i = i1; i < i2; i++, src += 4)
+    {
+      const float opacity = src[3];
+      if (opacity <= 0)
+        continue;
+
+      Color &c = theImage(x0 + i, y0 + j);
+      const float below = static_cast<float>(MaxAlpha - GetAlpha(c)) / MaxAlpha * (1 - opacity);
+      const float total = opacity + below;
+      const int r = static_cast<int>(lround((src[0] + GetRed(c) * below) / total));
+      const int g = static_cast<int>(lround((src[1] + GetGreen(c) * below) / total));
+      const int b = static_cast<int>(lround((src[2] + GetBlue(c) * below) / total));
+      const int a = static_cast<int>(lround(MaxAlpha * (1 - total)));
+      c = MakeColor(min(r, MaxRGB), min(g, MaxRGB), min(b, MaxRGB), max(a, 0));
+    }
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Get a rendered timestamp box, rendering it if necessary
+ *
+ * Within a cycle every crop of a source gets the same timestamp,
+ * hence the rendered boxes are cached. The cache holds at most
+ * cropper::timestamps::cachesize boxes (default 64, 0 disables)
+ * and is cleared when full.
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<const StampBitmap> stamp_bitmap(const string &theText,
+                                                const string &theFont,
+                                                int theWidth,
+                                                int theHeight,
+                                                int theXMargin,
+                                                int theYMargin,
+                                                Imagine::NFmiColorTools::Color theColor,
+                                                Imagine::NFmiColorTools::Color theBackground,
+                                                Imagine::NFmiAlignment theAlignment)
+{
+  static std::mutex mutex;
+  static map<string, std::shared_ptr<const StampBitmap> > cache;
+
+  const size_t maxsize = max(0, NFmiSettings::Optional<int>("cropper::timestamps::cachesize", 64));
+
+  string key;
+  if (maxsize > 0)
+  {
+    ostringstream out;
+    out << theText << '\n'
+        << theFont << ':' << theWidth << 'x' << theHeight << ':' << theXMargin << ','
+        << theYMargin << ':' << theColor << ',' << theBackground << ':' << theAlignment;
+    key = out.str();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = cache.find(key);
+    if (it != cache.end())
+      return it->second;
+  }
+
+  std::shared_ptr<const StampBitmap> bitmap;
+  {
+    std::lock_guard<std::mutex> lock(font_mutex);
+    bitmap = render_stamp(theText,
+                          theFont,
+                          theWidth,
+                          theHeight,
+                          theXMargin,
+                          theYMargin,
+                          theColor,
+                          theBackground,
+                          theAlignment);
+  }
+
+  if (maxsize > 0)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (cache.size() >= maxsize)
+      cache.clear();
+    cache[key] = bitmap;
+  }
+  return bitmap;
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Draw a timestamp onto the image
+ *
+ * In batch mode the rendered box is cached, hence usually only blended
+ * onto the image. A CGI request draws it directly, a single request
+ * would only pay for the extra render and blend.
+ *
+ * \param theImage The image to draw into
+ * \param theOptions The options in string form
+ */
+// ----------------------------------------------------------------------
+
+void draw_timestamp(Imagine::NFmiImage &theImage,
+                    string_view theOptions,
+                    const string &theFilename)
+{
+  string_view parts[timestamp_parts];
+  const size_t n = split(theOptions, ",", parts, timestamp_parts);
+
+  // Compulsory options
+
+  if (n < 2)
+    throw CropperException(400, "Too short option string '" + string(theOptions) + "'");
+
+  // Extra parts
+
+  if (n > timestamp_parts)
+    throw CropperException(400, "Too many -T parts in option '" + string(theOptions) + "'");
+
+  // Missing optional parts take the defaults
+
+  if (parts[timestamp_xmargin + 1].empty())
+    parts[timestamp_xmargin + 1] = parts[timestamp_xmargin];
+  for (size_t i = 2; i < timestamp_parts; i++)
+    if (parts[i].empty())
+      parts[i] = timestamp_defaults[i];
+
+  const int x = to_int(parts[0], "T");
+  const int y = to_int(parts[1], "T");
+  const string_view format = parts[2];
+  const string_view type = parts[3];
+  const int xmargin = to_int(parts[4], "T");
+  const int ymargin = to_int(parts[5], "T");
+  const string_view fontspec = parts[6];
+  const string_view color = parts[7];
+  const string_view backgroundcolor = parts[8];
+
+  // Parse the font option
+
+  string font;
+  int width, height;
+  parse_font(fontspec, "T", font, width, height);
+
+  // Parse the font color option
 
   Imagine::NFmiColorTools::Color fontcolor = parse_color(color);
   if (fontcolor == Imagine::NFmiColorTools::MissingColor)
-    throw CropperException(400, "Unknown font color '" + color + "'");
+    throw CropperException(400, "Unknown font color '" + string(color) + "'");
 
   // Parse the background color option
 
   Imagine::NFmiColorTools::Color backcolor = parse_color(backgroundcolor);
   if (backcolor == Imagine::NFmiColorTools::MissingColor)
-    throw CropperException(400, "Unknown font color '" + backgroundcolor + "'");
+    throw CropperException(400, "Unknown font color '" + string(backgroundcolor) + "'");
 
   // Establish text coordinates and alignment
 
@@ -895,147 +2131,398 @@ void draw_timestamp(Imagine::NFmiImage &theImage,
 
   string text = make_timestamp(theFilename, type, format);
 
-  // Create the face and setup the background
+  if (!timestamp_cache)
+  {
+    std::lock_guard<std::mutex> lock(font_mutex);
 
-  Imagine::NFmiFace face(font, width, height);
-  face.Background(true);
-  face.BackgroundColor(backcolor);
-  face.BackgroundMargin(xmargin, ymargin);
+    Imagine::NFmiFace face(font, width, height);
+    face.Background(true);
+    face.BackgroundColor(backcolor);
+    face.BackgroundMargin(xmargin, ymargin);
+    face.Draw(theImage, xx, yy, text, align, fontcolor);
+    return;
+  }
 
-  // Draw
+  // Render or reuse the box, and blend it at the anchor
 
-  face.Draw(theImage, xx, yy, text, align, fontcolor);
+  std::shared_ptr<const StampBitmap> bitmap =
+      stamp_bitmap(text, font, width, height, xmargin, ymargin, fontcolor, backcolor, align);
+  blend_stamp(theImage, *bitmap, xx, yy);
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Draw label(s) onto the image
+ * \brief Enable caching rendered timestamp boxes
  *
- * The option syntax is
- * \code
- * <spec>::<spec>::<spec>...
- * \endcode
- * where an individual spec is of form
- * \code
- * text,lon,lat,dx,dy,alignment,xmargin,ymargin,font,color,backgroundcolor
- * \endcode
+ * The cache lives in the process, hence it is enabled only by long
+ * running processes such as the batch mode.
+ */
+// ----------------------------------------------------------------------
+
+void cache_timestamps()
+{
+  timestamp_cache = true;
+}
+
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief A parsed label specification
+ */
+// ----------------------------------------------------------------------
+
+struct Label
+{
+  string text;
+  double lon = 0;
+  double lat = 0;
+  int dx = 0;
+  int dy = 0;
+  Imagine::NFmiAlignment align = Imagine::kFmiAlignCenter;
+  int xmargin = 0;
+  int ymargin = 0;
+  string font;
+  int width = 0;
+  int height = 0;
+  Imagine::NFmiColorTools::Color fontcolor = 0;
+  Imagine::NFmiColorTools::Color backcolor = 0;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Parse a single label specification
  *
- * \param theImage The image to draw into
- * \param theArea The projection
- * \param theXoff The pixel x-offset from cropping
- * \param theYoff The pixel y-offset from cropping
- * \param theOptions The command line option string
+ * \param theSpec The specification
+ * \param theOptions The whole option string, for error messages
+ * \param theLabel The label to fill, its strings are reused
+ */
+// ----------------------------------------------------------------------
+
+void parse_label(string_view theSpec, string_view theOptions, Label &theLabel)
+{
+  string_view words[label_parts];
+  const size_t n = split(theSpec, ",", words, label_parts);
+
+  // compulsory parts: text,lon,lat
+
+  if (n < 3)
+    throw CropperException(
+        400, "Too short option string '" + string(theOptions) + "' for option -L");
+
+  // Extra parts
+
+  if (n > label_parts)
+    throw CropperException(400, "Too many -L parts in option '" + string(theSpec) + "'");
+
+  // Missing optional parts take the defaults
+
+  if (words[label_xmargin + 1].empty())
+    words[label_xmargin + 1] = words[label_xmargin];
+  for (size_t i = 3; i < label_parts; i++)
+    if (words[i].empty())
+      words[i] = label_defaults[i];
+
+  theLabel.text.assign(words[0].data(), words[0].size());
+  theLabel.lon = to_double(words[1], "L");
+  theLabel.lat = to_double(words[2], "L");
+  theLabel.dx = to_int(words[3], "L");
+  theLabel.dy = to_int(words[4], "L");
+  const string_view alignment = words[5];
+  theLabel.xmargin = to_int(words[6], "L");
+  theLabel.ymargin = to_int(words[7], "L");
+  const string_view fontspec = words[8];
+  const string_view color = words[9];
+  const string_view backgroundcolor = words[10];
+
+  // Parse the font option
+
+  parse_font(fontspec, "L", theLabel.font, theLabel.width, theLabel.height);
+
+  // Parse the font color option
+
+  theLabel.fontcolor = parse_color(color);
+  if (theLabel.fontcolor == Imagine::NFmiColorTools::MissingColor)
+    throw CropperException(400, "Unknown font color '" + string(color) + "'");
+
+  // Parse the background color option
+
+  theLabel.backcolor = parse_color(backgroundcolor);
+  if (theLabel.backcolor == Imagine::NFmiColorTools::MissingColor)
+    throw CropperException(400, "Unknown font color '" + string(backgroundcolor) + "'");
+
+  // Parse the alignment option
+
+  theLabel.align = Imagine::AlignmentValue(string(alignment));
+  if (theLabel.align == Imagine::kFmiAlignMissing)
+    throw CropperException(400, "Unknown alignment '" + string(alignment) + "'");
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Create the face for drawing a label
+ */
+// ----------------------------------------------------------------------
+
+unique_ptr<Imagine::NFmiFace> make_face(const Label &theLabel)
+{
+  unique_ptr<Imagine::NFmiFace> face(
+      new Imagine::NFmiFace(theLabel.font, theLabel.width, theLabel.height));
+  face->Background(true);
+  face->BackgroundColor(theLabel.backcolor);
+  face->BackgroundMargin(theLabel.xmargin, theLabel.ymargin);
+  return face;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A label of a named set compiled for a specific map
  */
 // ----------------------------------------------------------------------
 
-void draw_labels(Imagine::NFmiImage &theImage,
-                 const NFmiArea &theArea,
-                 int theXoff,
-                 int theYoff,
-                 const string &theOptions)
+struct CompiledLabel
 {
-  vector<string> options = NFmiStringTools::Split(theOptions, "::");
-  for (vector<string>::const_iterator it = options.begin(); it != options.end(); ++it)
+  Label label;
+  NFmiPoint xy;  // the position in full resolution map pixels
+  int xextent;   // the text may extend this far from the position
+  int yextent;
+  std::shared_ptr<const Imagine::NFmiFace> face;
+};
+
+struct LabelSet
+{
+  ::time_t modtime = 0;  // of the definition file
+  vector<CompiledLabel> labels;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Compile a named label set for the given map
+ *
+ * The definition file contains one label specification per line,
+ * empty lines and lines starting with '#' are ignored. The positions
+ * are projected and the faces created once, labels with the same font
+ * and background share the face.
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<const LabelSet> compile_label_set(const string &theFile,
+                                                  ::time_t theModTime,
+                                                  const NFmiArea &theArea)
+{
+  ifstream in(theFile.c_str());
+  if (!in)
+    throw CropperException(404, "Label set '" + theFile + "' is not available");
+
+  std::shared_ptr<LabelSet> set(new LabelSet);
+  set->modtime = theModTime;
+
+  map<string, std::shared_ptr<const Imagine::NFmiFace> > faces;
+  string line;
+  while (getline(in, line))
   {
-    // defaults
+    NFmiStringTools::Trim(line);
+    if (line.empty() || line[0] == '#')
+      continue;
+
+    CompiledLabel compiled;
+    Label &label = compiled.label;
+    parse_label(line, line, label);
+
+    compiled.xy = theArea.ToXY(checkmeridian(NFmiPoint(label.lon, label.lat), theArea));
 
-    int dx = 0;
-    int dy = 0;
-    string alignment = "Center";
-    int xmargin = 1;
-    int ymargin = 1;
-    string font = "misc/6x13.pcf.gz:6x13";
-    string color = "black";
-    string backgroundcolor = "transparent";
+    // Conservative, the font width is zero for proportional fonts
 
-    // parse the options
+    const int charsize = max(label.width, label.height);
+    compiled.xextent = static_cast<int>(label.text.size()) * charsize + 2 * label.xmargin;
+    compiled.yextent = 2 * charsize + 2 * label.ymargin;
 
-    vector<string> words = NFmiStringTools::Split(*it);
+    const string facekey = label.font + ':' + NFmiStringTools::Convert(label.width) + 'x' +
+                           NFmiStringTools::Convert(label.height) + ':' +
+                           NFmiStringTools::Convert(label.backcolor) + ':' +
+                           NFmiStringTools::Convert(label.xmargin) + 'x' +
+                           NFmiStringTools::Convert(label.ymargin);
+    std::shared_ptr<const Imagine::NFmiFace> &face = faces[facekey];
+    if (!face)
+      face = make_face(label);
+    compiled.face = face;
 
-    // compulsory parts: text,lon,lat
+    set->labels.push_back(compiled);
+  }
+
+  return set;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Get a named label set compiled for the given map
+ *
+ * The sets are read from cropper::labelsdir and compiled once per map.
+ * A set is recompiled if its definition file has been modified.
+ *
+ * \param theName The set name
+ * \param theArea The map projection, which is cached by create_map
+ */
+// ----------------------------------------------------------------------
 
-    if (words.size() < 3)
-      throw CropperException(400, "Too short option string '" + theOptions + "' for option -L");
+std::shared_ptr<const LabelSet> label_set(string_view theName, const NFmiArea &theArea)
+{
+  const string_view valid = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-";
+  if (theName.empty() || theName.find_first_not_of(valid) != string_view::npos)
+    throw CropperException(400, "Invalid label set name '" + string(theName) + "'");
 
-    const string text = words[0];
-    const double lon = NFmiStringTools::Convert<double>(words[1]);
-    const double lat = NFmiStringTools::Convert<double>(words[2]);
+  const string file = label_set_file(theName);
 
-    vector<string>::size_type i = 2;
+  const FileStatus status = file_status(file);
+  if (!status.exists)
+    throw CropperException(404, "Label set " + string(theName) + " is not available");
 
-    if (words.size() > i + 1 && !words[++i].empty())
-      dx = NFmiStringTools::Convert<int>(words[i]);
-    if (words.size() > i + 1 && !words[++i].empty())
-      dy = NFmiStringTools::Convert<int>(words[i]);
-    if (words.size() > i + 1 && !words[++i].empty())
-      alignment = words[i];
-    if (words.size() > i + 1 && !words[++i].empty())
-      xmargin = ymargin = NFmiStringTools::Convert<int>(words[i]);
-    if (words.size() > i + 1 && !words[++i].empty())
-      ymargin = NFmiStringTools::Convert<int>(words[i]);
-    if (words.size() > i + 1 && !words[++i].empty())
-      font = words[i];
-    if (words.size() > i + 1 && !words[++i].empty())
-      color = words[i];
-    if (words.size() > i + 1 && !words[++i].empty())
-      backgroundcolor = words[i];
+  static std::mutex mutex;
+  static map<pair<string, const NFmiArea *>, std::shared_ptr<const LabelSet> > cache;
+
+  const auto key = make_pair(string(theName), &theArea);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = cache.find(key);
+    if (it != cache.end() && it->second->modtime == status.modtime)
+      return it->second;
+  }
 
-    // Extra parts
+  // Compiling creates faces, hence the font lock
 
-    if (words.size() > i + 1)
-      throw CropperException(400, "Too many -L parts in option '" + *it + "'");
+  std::shared_ptr<const LabelSet> set;
+  {
+    std::lock_guard<std::mutex> lock(font_mutex);
+    set = compile_label_set(file, status.modtime, theArea);
+  }
 
-    // Parse the font option
+  std::lock_guard<std::mutex> lock(mutex);
+  cache[key] = set;
+  return set;
+}
 
-    vector<string> fontparts = NFmiStringTools::Split(font, ":");
-    if (fontparts.size() != 2)
-      throw CropperException(400, "Invalid font specification for option -L : '" + font + "'");
-    font = fontparts[0];
-    fontparts = NFmiStringTools::Split(fontparts[1], "x");
-    if (fontparts.size() != 2)
-      throw CropperException(
-          400, "Invalid font size specification for option -L : '" + fontparts[1] + "'");
-    const int width = NFmiStringTools::Convert<int>(fontparts[0]);
-    const int height = NFmiStringTools::Convert<int>(fontparts[1]);
+// ----------------------------------------------------------------------
+/*!
+ * \brief Draw a compiled label set
+ *
+ * The positions are only shifted by the crop and scaled, and labels
+ * which cannot reach the image are skipped.
+ */
+// ----------------------------------------------------------------------
 
-    // Parse the font color option
+void draw_label_set(Imagine::NFmiImage &theImage, const CropInfo &theInfo, const LabelSet &theSet)
+{
+  const int w = theImage.Width();
+  const int h = theImage.Height();
 
-    Imagine::NFmiColorTools::Color fontcolor = parse_color(color);
-    if (fontcolor == Imagine::NFmiColorTools::MissingColor)
-      throw CropperException(400, "Unknown font color '" + color + "'");
+  std::lock_guard<std::mutex> lock(font_mutex);
 
-    // Parse the background color option
+  for (const CompiledLabel &compiled : theSet.labels)
+  {
+    const Label &label = compiled.label;
+    const int xx = static_cast<int>(
+        round((compiled.xy.X() * theInfo.scale - theInfo.xoff) * theInfo.zoom + label.dx));
+    const int yy = static_cast<int>(
+        round((compiled.xy.Y() * theInfo.scale - theInfo.yoff) * theInfo.zoom + label.dy));
 
-    Imagine::NFmiColorTools::Color backcolor = parse_color(backgroundcolor);
-    if (backcolor == Imagine::NFmiColorTools::MissingColor)
-      throw CropperException(400, "Unknown font color '" + backgroundcolor + "'");
+    if (xx + compiled.xextent < 0 || xx - compiled.xextent >= w || yy + compiled.yextent < 0 ||
+        yy - compiled.yextent >= h)
+      continue;
 
-    // Parse the alignment option
+    compiled.face->Draw(theImage, xx, yy, label.text, label.align, label.fontcolor);
+  }
+}
 
-    Imagine::NFmiAlignment align = Imagine::AlignmentValue(alignment);
-    if (align == Imagine::kFmiAlignMissing)
-      throw CropperException(400, "Unknown alignment '" + alignment + "'");
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Draw label(s) onto the image
+ *
+ * The option syntax is
+ * \code
+ * <spec>::<spec>::<spec>...
+ * \endcode
+ * where an individual spec is of form
+ * \code
+ * text,lon,lat,dx,dy,alignment,xmargin,ymargin,font,color,backgroundcolor
+ * \endcode
+ * or @name for a named label set defined on the server.
+ *
+ * \param theImage The image to draw into
+ * \param theInfo The projection, offsets and scales from cropping
+ * \param theOptions The command line option string
+ */
+// ----------------------------------------------------------------------
+
+void draw_labels(Imagine::NFmiImage &theImage, const CropInfo &theInfo, string_view theOptions)
+{
+  const NFmiArea &area = *theInfo.area;
+
+  // Reused for all the labels, the names usually fit into the first allocation
+  Label label;
+
+  Tokenizer specs(theOptions, "::");
+  string_view spec;
+  while (specs.next(spec))
+  {
+    if (!spec.empty() && spec[0] == '@')
+    {
+      draw_label_set(theImage, theInfo, *label_set(spec.substr(1), area));
+      continue;
+    }
+
+    parse_label(spec, theOptions, label);
 
     // Calculate the text coordinates
 
-    NFmiPoint xy = checkmeridian(NFmiPoint(lon, lat), theArea);
-    xy = theArea.ToXY(xy);
-    int xx = static_cast<int>(round(xy.X() + dx - theXoff));
-    int yy = static_cast<int>(round(xy.Y() + dy - theYoff));
+    NFmiPoint xy = checkmeridian(NFmiPoint(label.lon, label.lat), area);
+    xy = area.ToXY(xy);
+    int xx =
+        static_cast<int>(round((xy.X() * theInfo.scale - theInfo.xoff) * theInfo.zoom + label.dx));
+    int yy =
+        static_cast<int>(round((xy.Y() * theInfo.scale - theInfo.yoff) * theInfo.zoom + label.dy));
 
     // Create the face and setup the background
 
-    Imagine::NFmiFace face(font, width, height);
-    face.Background(true);
-    face.BackgroundColor(backcolor);
-    face.BackgroundMargin(xmargin, ymargin);
+    std::lock_guard<std::mutex> lock(font_mutex);
+
+    unique_ptr<Imagine::NFmiFace> face = make_face(label);
 
     // Draw
 
-    face.Draw(theImage, xx, yy, text, align, fontcolor);
+    face->Draw(theImage, xx, yy, label.text, label.align, label.fontcolor);
   }
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read an overlay image
+ *
+ * Markers and legends are the same for practically all images, hence
+ * they are decoded only once per process.
+ *
+ * \param theFile The image file
+ * \return The decoded image
+ */
+// ----------------------------------------------------------------------
+
+std::shared_ptr<const Imagine::NFmiImage> overlay_image(string_view theFile)
+{
+  static std::mutex mutex;
+  static map<string, std::shared_ptr<const Imagine::NFmiImage>, less<> > cache;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = cache.find(theFile);
+  if (it != cache.end())
+    return it->second;
+
+  const string filename(theFile);
+  std::shared_ptr<const Imagine::NFmiImage> image(new Imagine::NFmiImage(filename));
+  cache.insert(make_pair(filename, image));
+  return image;
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Draw a marker onto the projection center
@@ -1047,12 +2534,12 @@ void draw_labels(Imagine::NFmiImage &theImage,
  */
 // ----------------------------------------------------------------------
 
-void draw_center(Imagine::NFmiImage &theImage, const string &theOptions, int theX, int theY)
+void draw_center(Imagine::NFmiImage &theImage, string_view theOptions, int theX, int theY)
 {
   if (theOptions.substr(0, 6) == "square")
   {
-    const vector<string> parts = NFmiStringTools::Split(theOptions, ":");
-    const string colorname = (parts.size() < 2 ? "black" : parts[1]);
+    string_view parts[2];
+    const string_view colorname = (split(theOptions, ":", parts, 2) < 2 ? "black" : parts[1]);
     Imagine::NFmiColorTools::Color color = parse_color(colorname);
 
     const int sz = 2;
@@ -1067,8 +2554,8 @@ void draw_center(Imagine::NFmiImage &theImage, const string &theOptions, int the
   }
   else
   {
-    Imagine::NFmiImage marker(theOptions);
-    theImage.Composite(marker,
+    std::shared_ptr<const Imagine::NFmiImage> marker = overlay_image(theOptions);
+    theImage.Composite(*marker,
                        Imagine::NFmiColorTools::kFmiColorOnOpaque,
                        Imagine::kFmiAlignCenter,
                        theX,
@@ -1086,19 +2573,19 @@ void draw_center(Imagine::NFmiImage &theImage, const string &theOptions, int the
  */
 // ----------------------------------------------------------------------
 
-void draw_image(Imagine::NFmiImage &theImage, const string &theOptions)
+void draw_image(Imagine::NFmiImage &theImage, string_view theOptions)
 {
   // Parse the options
 
-  const vector<string> parts = NFmiStringTools::Split(theOptions);
-  if (parts.size() % 3 != 0)
+  if (split(theOptions, ",", nullptr, 0) % 3 != 0)
     throw CropperException(400, "Option -I argument should be of form image,x,y,...");
 
-  for (unsigned int i = 0; i < parts.size(); i += 3)
+  Tokenizer parts(theOptions, ",");
+  string_view filename, xpart, ypart;
+  while (parts.next(filename) && parts.next(xpart) && parts.next(ypart))
   {
-    const string filename = parts[i];
-    const int x = NFmiStringTools::Convert<int>(parts[i + 1]);
-    const int y = NFmiStringTools::Convert<int>(parts[i + 2]);
+    const int x = to_int(xpart, "I");
+    const int y = to_int(ypart, "I");
 
     // Establish alignment and corrected coordinates
 
@@ -1126,11 +2613,36 @@ void draw_image(Imagine::NFmiImage &theImage, const string &theOptions)
 
     // Render the image
 
-    Imagine::NFmiImage img(filename);
-    theImage.Composite(img, Imagine::NFmiColorTools::kFmiColorOnOpaque, align, xx, yy, 1.0);
+    std::shared_ptr<const Imagine::NFmiImage> img = overlay_image(filename);
+    theImage.Composite(*img, Imagine::NFmiColorTools::kFmiColorOnOpaque, align, xx, yy, 1.0);
   }
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Start reading the overlay images of the request
+ *
+ * The -I images and the -M marker are read only once the crop is
+ * ready, by then the kernel has had time to read them in.
+ *
+ * \param theOptions The request options
+ */
+// ----------------------------------------------------------------------
+
+void prefetch_overlays(const Options &theOptions)
+{
+  if (theOptions.has('I'))
+  {
+    Tokenizer parts(theOptions.get('I'), ",");
+    string_view filename, xpart, ypart;
+    while (parts.next(filename) && parts.next(xpart) && parts.next(ypart))
+      prefetch_file(string(filename));
+  }
+
+  if (theOptions.has('M') && theOptions.get('M').substr(0, 6) != "square")
+    prefetch_file(theOptions.str('M'));
+}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Reduce colors in the image
@@ -1140,10 +2652,11 @@ void draw_image(Imagine::NFmiImage &theImage, const string &theOptions)
  */
 // ----------------------------------------------------------------------
 
-void reduce_colors(Imagine::NFmiImage &theImage, const string &theSpecs)
+void reduce_colors(Imagine::NFmiImage &theImage, string_view theSpecs)
 {
   if (theSpecs.size() != 4)
-    throw CropperException(400, "Invalid color reduction specification '" + theSpecs + "'");
+    throw CropperException(400,
+                           "Invalid color reduction specification '" + string(theSpecs) + "'");
   int r = theSpecs[0] - '0';
   int g = theSpecs[1] - '0';
   int b = theSpecs[2] - '0';
@@ -1152,6 +2665,365 @@ void reduce_colors(Imagine::NFmiImage &theImage, const string &theSpecs)
   Imagine::NFmiImageTools::CompressBits(theImage, r, g, b, a);
 }
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Crop an image according to the geometry options
+ *
+ * Only one of the options p, l, c or g may be given. The geometry is
+ * always given in pixels of the source, when cropping a downscaled
+ * level of the source it is scaled down accordingly.
+ *
+ * \param theImage The image to crop
+ * \param theOptions The parsed options
+ * \param theInfo Returns the projection and offsets of the crop
+ * \param theLevel The level of the source, the image is downscaled by 2^level
+ * \return The cropped image, or an empty pointer if no cropping was requested
+ */
+// ----------------------------------------------------------------------
+
+template <typename Image>
+unique_ptr<Imagine::NFmiImage> crop_image(const Image &theImage,
+                                          const Options &theOptions,
+                                          CropInfo &theInfo,
+                                          int theLevel)
+{
+  unique_ptr<Imagine::NFmiImage> cropped;
+
+  const int f = 1 << theLevel;
+  theInfo.scale = 1.0 / f;
+
+  if (theOptions.has('p') || theOptions.has('l') || theOptions.has('c'))
+  {
+    int xc, yc, width, height;
+    theInfo.has_center = true;
+    {
+      StageTimer timer("geometry");
+      if (theOptions.has('p'))
+        theInfo.area = parse_named_geometry(theOptions.get('p'), xc, yc, width, height);
+      else if (theOptions.has('l'))
+        theInfo.area = parse_latlon_geometry(theOptions.get('l'), xc, yc, width, height);
+      else
+        parse_center_geometry(theOptions.get('c'), xc, yc, width, height);
+    }
+    xc /= f;
+    yc /= f;
+    StageTimer timer("crop");
+    cropped = crop_center(
+        theImage, xc, yc, max(1, width / f), max(1, height / f), theInfo.xoff, theInfo.yoff);
+    theInfo.xm = xc - theInfo.xoff;
+    theInfo.ym = yc - theInfo.yoff;
+  }
+  else if (theOptions.has('g'))
+  {
+    int x1, y1, width, height;
+    {
+      StageTimer timer("geometry");
+      parse_geometry(theOptions.get('g'), x1, y1, width, height);
+    }
+    StageTimer timer("crop");
+    cropped = crop_corner(theImage,
+                          x1 / f,
+                          y1 / f,
+                          max(1, width / f),
+                          max(1, height / f),
+                          theInfo.xoff,
+                          theInfo.yoff);
+  }
+
+  return cropped;
+}
+
+template unique_ptr<Imagine::NFmiImage> crop_corner(
+    const Imagine::NFmiImage &, int, int, int, int, int &, int &);
+template unique_ptr<Imagine::NFmiImage> crop_center(
+    const Imagine::NFmiImage &, int, int, int, int, int &, int &);
+template unique_ptr<Imagine::NFmiImage> crop_image(const Imagine::NFmiImage &,
+                                                   const Options &,
+                                                   CropInfo &,
+                                                   int);
+template unique_ptr<Imagine::NFmiImage> crop_image(const MappedRaster &,
+                                                   const Options &,
+                                                   CropInfo &,
+                                                   int);
+template unique_ptr<Imagine::NFmiImage> crop_image(const TiledRaster &,
+                                                   const Options &,
+                                                   CropInfo &,
+                                                   int);
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Downscale a cropped image according to the scale option
+ *
+ * The center point in the crop info is moved accordingly, and the
+ * zoom is recorded for placing the labels. Timestamps and images are
+ * placed relative to the edges of the final image and need no changes.
+ *
+ * \param theImage The cropped image
+ * \param theOptions The parsed options
+ * \param theInfo The crop info to update
+ * \return The scaled image, or an empty pointer if no scaling is needed
+ */
+// ----------------------------------------------------------------------
+
+unique_ptr<Imagine::NFmiImage> scale_image(const Imagine::NFmiImage &theImage,
+                                           const Options &theOptions,
+                                           CropInfo &theInfo)
+{
+  if (!theOptions.has('S'))
+    return nullptr;
+
+  double factor;
+  int width, height;
+  ResampleKernel kernel;
+  parse_scale(theOptions.get('S'), factor, width, height, kernel);
+
+  // The factor is relative to the source, the image may be a downscaled level of it
+
+  const double zoom =
+      (factor > 0 ? factor / theInfo.scale
+                  : min(static_cast<double>(width) / theImage.Width(),
+                        static_cast<double>(height) / theImage.Height()));
+  if (zoom >= 1)
+    return nullptr;
+
+  StageTimer timer("scale");
+  unique_ptr<Imagine::NFmiImage> scaled =
+      resample_image(theImage,
+                     max(1, static_cast<int>(lround(theImage.Width() * zoom))),
+                     max(1, static_cast<int>(lround(theImage.Height() * zoom))),
+                     kernel);
+
+  theInfo.zoom = zoom;
+  theInfo.xm = static_cast<int>(floor((theInfo.xm + 0.5) * zoom));
+  theInfo.ym = static_cast<int>(floor((theInfo.ym + 0.5) * zoom));
+  return scaled;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Draw the requested labels, timestamps, images and markers
+ *
+ * The timezone and the locale must have been set by the caller,
+ * they are process wide settings.
+ *
+ * \param theImage The image to draw into
+ * \param theOptions The parsed options
+ * \param theInfo The projection and offsets from cropping
+ * \param theFilename The original image name for timestamps
+ */
+// ----------------------------------------------------------------------
+
+void decorate_image(Imagine::NFmiImage &theImage,
+                    const Options &theOptions,
+                    const CropInfo &theInfo,
+                    const string &theFilename)
+{
+  if (theOptions.has('L'))
+  {
+    if (theInfo.area.get() == 0)
+      throw CropperException(400,
+                             "Cannot draw labels onto image without a "
+                             "projection obtained from cropping");
+    StageTimer timer("labels");
+    draw_labels(theImage, theInfo, theOptions.get('L'));
+  }
+
+  if (theOptions.has('T'))
+  {
+    StageTimer timer("timestamp");
+    draw_timestamp(theImage, theOptions.get('T'), theFilename);
+  }
+
+  if (theOptions.has('I'))
+  {
+    StageTimer timer("image");
+    draw_image(theImage, theOptions.get('I'));
+  }
+
+  if (theOptions.has('M') && theInfo.has_center)
+  {
+    StageTimer timer("marker");
+    draw_center(theImage, theOptions.get('M'), theInfo.xm, theInfo.ym);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Apply color reduction and output settings
+ *
+ * \param theImage The image to finish
+ * \param theOptions The parsed options
+ * \param theType The output image type
+ */
+// ----------------------------------------------------------------------
+
+void finish_image(Imagine::NFmiImage &theImage, const Options &theOptions, const string &theType)
+{
+  if (theOptions.has('Z'))
+  {
+    StageTimer timer("reduce");
+    const string_view specs = theOptions.get('Z');
+    reduce_colors(theImage, specs.empty() ? default_reduction : specs);
+  }
+
+  theImage.SaveAlpha(false);
+  if (theOptions.has('A') && theOptions.get('A') != "0")
+    theImage.SaveAlpha(true);
+
+  theImage.WantPalette(true);
+
+  if (theType == "png" && auto_effort(theOptions))
+  {
+    // The PNG writer of the image takes only the level and the palette
+
+    StageTimer timer("effort");
+    const EncoderEffort effort = choose_effort(theImage, 1, true, false);
+    theImage.WantPalette(effort.palette);
+    theImage.PngQuality(effort.level);
+  }
+  else if (theOptions.has('z') && theOptions.get('z') != "auto")
+  {
+    int level = to_int(theOptions.get('z'), "z");
+    if (theType == "png")
+      theImage.PngQuality(level);
+    else if (theType == "jpeg")
+      theImage.JpegQuality(level);
+  }
+}
+
+namespace
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Validate the request without the image
+ *
+ * HEAD requests are answered without rendering, but must fail like the
+ * corresponding GET request when the geometries, maps, places, labels
+ * or the scale are invalid. The geometries and label sets are paired
+ * as in render_multipart.
+ *
+ * \param theOptions The parsed options
+ */
+// ----------------------------------------------------------------------
+
+void validate_request(const Options &theOptions)
+{
+  char option = 0;
+  for (const char name : {'p', 'l', 'c', 'g'})
+    if (theOptions.has(name))
+      option = name;
+
+  vector<string_view> geometries;
+  if (option != 0)
+  {
+    Tokenizer tokens(theOptions.get(option), ";");
+    string_view geometry;
+    while (tokens.next(geometry))
+      geometries.push_back(geometry);
+  }
+  else
+    geometries.push_back(string_view());
+
+  vector<string_view> labels;
+  if (theOptions.has('L'))
+  {
+    if (geometries.size() == 1)
+      labels.push_back(theOptions.get('L'));
+    else
+    {
+      Tokenizer tokens(theOptions.get('L'), ";");
+      string_view label;
+      while (tokens.next(label))
+        labels.push_back(label);
+      if (labels.size() != 1 && labels.size() != geometries.size())
+        throw CropperException(400, "Option L must have one label set or one for each geometry");
+    }
+  }
+
+  for (size_t i = 0; i < geometries.size(); i++)
+  {
+    NFmiAreaFactory::return_type area;
+    int x, y, width, height;
+    if (option == 'p')
+      area = parse_named_geometry(geometries[i], x, y, width, height);
+    else if (option == 'l')
+      area = parse_latlon_geometry(geometries[i], x, y, width, height);
+    else if (option == 'c')
+      parse_center_geometry(geometries[i], x, y, width, height);
+    else if (option == 'g')
+      parse_geometry(geometries[i], x, y, width, height);
+
+    if (labels.empty())
+      continue;
+
+    if (area.get() == 0)
+      throw CropperException(400,
+                             "Cannot draw labels onto image without a "
+                             "projection obtained from cropping");
+
+    const string_view set = labels[labels.size() == 1 ? 0 : i];
+    Label label;
+    Tokenizer specs(set, "::");
+    string_view spec;
+    while (specs.next(spec))
+    {
+      if (!spec.empty() && spec[0] == '@')
+        label_set(spec.substr(1), *area);
+      else
+        parse_label(spec, set, label);
+    }
+  }
+
+  if (theOptions.has('S'))
+  {
+    double factor;
+    int width, height;
+    ResampleKernel kernel;
+    parse_scale(theOptions.get('S'), factor, width, height, kernel);
+  }
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief The files whose state decides whether the sources are missing
+ *
+ * The source files themselves, or for a frame pattern the directory the
+ * frames appear in, followed by the definition files of the named label
+ * sets. Empty if the pattern has wildcards in the directory part, in
+ * which case missing files are not remembered.
+ */
+// ----------------------------------------------------------------------
+
+vector<string> negative_cache_sources(const Options &theOptions)
+{
+  vector<string> sources;
+  if (theOptions.has('f'))
+    sources.push_back(theOptions.str('f'));
+  else if (theOptions.has('F'))
+  {
+    const string spec = theOptions.str('F');
+    if (spec.find_first_of("*?[") == string::npos)
+      sources = NFmiStringTools::Split(spec);
+    else
+    {
+      const string::size_type pos = spec.rfind('/');
+      const string dir = (pos == string::npos ? string(".") : spec.substr(0, pos));
+      if (dir.find_first_of("*?[") != string::npos)
+        return {};
+      sources.push_back(dir);
+    }
+  }
+
+  if (theOptions.has('L'))
+  {
+    const vector<string> files = label_set_files(theOptions.get('L'));
+    sources.insert(sources.end(), files.begin(), files.end());
+  }
+  return sources;
+}
+
+}  // namespace
+
 // ----------------------------------------------------------------------
 /*!
  * \brief The main algorithm
@@ -1160,24 +3032,27 @@ void reduce_colors(Imagine::NFmiImage &theImage, const string &theSpecs)
 
 int domain(int argc, const char *argv[])
 {
-  typedef map<string, string> Options;
+  RequestArena arena;
+  Timings timings;
+  RequestContext context(InteractivePriority,
+                         chrono::milliseconds(NFmiSettings::Optional<int>("cropper::deadline", 0)));
   Options options;
 
-#ifdef UNIX
-  const bool syslog_active = NFmiSettings::Optional<bool>("cropper::syslog::active", false);
-  const int syslog_level = NFmiSettings::Optional<int>("cropper::syslog::level", 0);
-#endif
-
   const string default_timezone =
       NFmiSettings::Optional<string>("cropper::timezone", "Europe/Helsinki");
 
   if (getenv("QUERY_STRING") != 0)
   {
-    options = NFmiStringTools::ParseQueryString();
+    options = Options(getenv("QUERY_STRING"));
+
+    // Repeat a recent failure of the same query without rerunning the pipeline
+
+    negative_cache_check(canonical_query(options, default_timezone, false),
+                         negative_cache_sources(options));
   }
   else
   {
-    NFmiCmdLine cmdline(argc, argv, "f!g!c!l!p!o!T!t!M!I!L!AZ:hk!z!O!");
+    NFmiCmdLine cmdline(argc, argv, "f!F!D!g!c!l!p!o!T!t!M!I!L!S!AZ:hk!z!O!B!j!");
 
     if (cmdline.Status().IsError())
       throw CropperException(400, cmdline.Status().ErrorLog().CharPtr());
@@ -1191,232 +3066,247 @@ int domain(int argc, const char *argv[])
       exit(0);
     }
 
-    if (cmdline.isOption('f'))
-      options.insert(Options::value_type("f", cmdline.OptionValue('f')));
-    if (cmdline.isOption('g'))
-      options.insert(Options::value_type("g", cmdline.OptionValue('g')));
-    if (cmdline.isOption('c'))
-      options.insert(Options::value_type("c", cmdline.OptionValue('c')));
-    if (cmdline.isOption('l'))
-      options.insert(Options::value_type("l", cmdline.OptionValue('l')));
-    if (cmdline.isOption('p'))
-      options.insert(Options::value_type("p", cmdline.OptionValue('p')));
-    if (cmdline.isOption('o'))
-      options.insert(Options::value_type("o", cmdline.OptionValue('o')));
-    if (cmdline.isOption('T'))
-      options.insert(Options::value_type("T", cmdline.OptionValue('T')));
-    if (cmdline.isOption('t'))
-      options.insert(Options::value_type("t", cmdline.OptionValue('t')));
-    if (cmdline.isOption('M'))
-      options.insert(Options::value_type("M", cmdline.OptionValue('M')));
-    if (cmdline.isOption('I'))
-      options.insert(Options::value_type("I", cmdline.OptionValue('I')));
-    if (cmdline.isOption('L'))
-      options.insert(Options::value_type("L", cmdline.OptionValue('L')));
-    if (cmdline.isOption('A'))
-      options.insert(Options::value_type("A", "1"));
-    if (cmdline.isOption('k'))
-      options.insert(Options::value_type("k", cmdline.OptionValue('k')));
-    if (cmdline.isOption('Z'))
+    if (cmdline.isOption('B'))
     {
-      if (cmdline.OptionValue('Z'))
-        options.insert(Options::value_type("Z", cmdline.OptionValue('Z')));
-      else
-        options.insert(Options::value_type("Z", "5550"));
+      const unsigned int threads =
+          (cmdline.isOption('j') ? NFmiStringTools::Convert<unsigned int>(cmdline.OptionValue('j'))
+                                 : 0);
+      return batch(cmdline.OptionValue('B'), threads);
     }
-    if (cmdline.isOption('z'))
-      options.insert(Options::value_type("z", cmdline.OptionValue('z')));
-    if (cmdline.isOption('O'))
-      options.insert(Options::value_type("O", cmdline.OptionValue('O')));
-  }
-
-  const Options::const_iterator end = options.end();
-
-  const bool has_option_f = (options.find("f") != end);
-  const bool has_option_g = (options.find("g") != end);
-  const bool has_option_c = (options.find("c") != end);
-  const bool has_option_p = (options.find("p") != end);
-  const bool has_option_l = (options.find("l") != end);
-  const bool has_option_T = (options.find("T") != end);
-  const bool has_option_t = (options.find("t") != end);
-  const bool has_option_M = (options.find("M") != end);
-  const bool has_option_I = (options.find("I") != end);
-  const bool has_option_C = (options.find("C") != end);
-  const bool has_option_L = (options.find("L") != end);
-  const bool has_option_A = (options.find("A") != end);
-  const bool has_option_Z = (options.find("Z") != end);
-  const bool has_option_k = (options.find("k") != end);
-  const bool has_option_z = (options.find("z") != end);
-
-  // -o does not modify the image
+
+    for (const char *opt = "fFDgclpoTtMILSkzO"; *opt != '\0'; ++opt)
+      if (cmdline.isOption(*opt))
+        options.set(*opt, cmdline.OptionValue(*opt));
+
+    if (cmdline.isOption('A'))
+      options.set('A', "1");
+    if (cmdline.isOption('Z'))
+      options.set('Z', cmdline.OptionValue('Z') ? cmdline.OptionValue('Z') : default_reduction);
+  }
+
+  const bool has_option_f = options.has('f');
+  const bool has_option_F = options.has('F');
+  const bool has_option_g = options.has('g');
+  const bool has_option_c = options.has('c');
+  const bool has_option_p = options.has('p');
+  const bool has_option_l = options.has('l');
+  const bool has_option_T = options.has('T');
+  const bool has_option_t = options.has('t');
+  const bool has_option_C = options.has('C');
+  const bool has_option_k = options.has('k');
+
+  // -o does not modify the image. Frame lists are always rendered as an
+  // animation, even when no other options are given.
   const bool has_modifying_options =
-      (options.size() > 1 || (options.size() == 1 && options.find("o") != end));
+      (options.size() > 1 || (options.size() == 1 && options.has('o')) || has_option_F);
 
-  if (!has_option_f)
+  if (!has_option_f && !has_option_F)
     throw CropperException(400, "Must give image name to be cropped");
 
+  if (has_option_f && has_option_F)
+    throw CropperException(400, "Options f and F cannot be used simultaneously");
+
+  if (has_option_F && has_multiple_geometries(options))
+    throw CropperException(400, "Animations cannot have multiple geometries");
+
   if (has_option_g + has_option_c + has_option_p + has_option_l > 1)
     throw CropperException(400, "Too many cropping geometries defined, use only one");
 
-  // Check the image exists
+  // Check the image exists. For animations the newest frame
+  // determines the modification time.
 
-  const string imagefile = options.find("f")->second;
-  if (!NFmiFileSystem::FileExists(imagefile))
-    throw CropperException(410, "File is no longer available");
+  vector<string> frames;
+  string imagefile;
 
-  // Handle a possible HTTP_IF_MODIFIED_SINCE query
-  if (not_modified(imagefile))
+  if (has_option_f)
+    frames.push_back(options.str('f'));
+  else
+    frames = expand_frames(options.str('F'));
+
+  ::time_t newest = 0;
+  for (const string &frame : frames)
   {
-#ifdef UNIX
-    if (syslog_active && syslog_level >= 3 && getenv("QUERY_STRING") != 0)
+    const FileStatus status = file_status(frame);
+    if (!status.exists)
+      throw CropperException(410, "File is no longer available");
+    if (imagefile.empty() || status.modtime > newest)
     {
-      openlog("cropper", LOG_PID, LOG_LOCAL2);
-      syslog(LOG_INFO, "not modified: %s", getenv("QUERY_STRING"));
+      imagefile = frame;
+      newest = status.modtime;
     }
-#endif
-    return 0;
   }
 
+  // The cache name is needed by several steps, but is computed only once.
+  // Equivalent queries share the same cache entry.
+
+  const char *query = getenv("QUERY_STRING");
+  const string cachefile =
+      (query != 0 ? cachename(canonical_query(options, default_timezone)) : "");
+  const string outputcache = (has_option_C ? "" : cachefile);
+
+  // Handle a possible HTTP_IF_MODIFIED_SINCE query
+  if (not_modified(imagefile, cachefile))
+    return 0;
+
   // Quick special case
 
   if (!has_modifying_options)
   {
-#ifdef UNIX
-    if (syslog_active && syslog_level >= 2 && getenv("QUERY_STRING") != 0)
-    {
-      openlog("cropper", LOG_PID, LOG_LOCAL2);
-      syslog(LOG_INFO, "regular image: %s", getenv("QUERY_STRING"));
-    }
-#endif
-
     http_output_image(imagefile);
     return 0;
   }
 
   // Use cache if possible
 
-  if (!has_option_C)
-  {
-#ifdef UNIX
-    if (syslog_active && syslog_level >= 2 && getenv("QUERY_STRING") != 0)
-    {
-      openlog("cropper", LOG_PID, LOG_LOCAL2);
-      syslog(LOG_INFO, "cached image: %s", getenv("QUERY_STRING"));
-    }
-#endif
-
-    if (http_output_cache(getenv("QUERY_STRING")))
-      return 0;
-  }
+  if (http_output_cache(outputcache))
+    return 0;
 
-  // Make log entry
+  // HEAD requests are answered from the source without rendering, but
+  // fail like the GET request would for invalid options
 
-#ifdef UNIX
-  if (syslog_active && syslog_level >= 1 && getenv("QUERY_STRING") != 0)
+  if (head_request())
   {
-    openlog("cropper", LOG_PID, LOG_LOCAL2);
-    syslog(LOG_INFO, "new image: %s", getenv("QUERY_STRING"));
+    validate_request(options);
+    if (has_option_F)
+      http_output_head(imagefile, "image/png");
+    else if (has_multiple_geometries(options))
+      http_output_head(imagefile, "multipart/mixed; boundary=" + multipart_boundary);
+    else
+      http_output_head(imagefile, "image/" + Imagine::NFmiImageTools::MimeType(imagefile));
+    return 0;
   }
-#endif
-
-  // Set timestring language
 
-  if (has_option_k)
-    setlocale(LC_TIME, options.find("k")->second.c_str());
-
-  unique_ptr<Imagine::NFmiImage> cropped(new Imagine::NFmiImage(imagefile));
-  string imagetype = cropped->Type();
+  // Start reading the overlays while the source is decoded
 
-  bool has_center = false;
-  int xm = 0;
-  int ym = 0;
+  prefetch_overlays(options);
 
-  // How much was removed from the image
-  int xoff = 0;
-  int yoff = 0;
+  // Set timestring language
 
-  // The established projection, if any
+  if (has_option_k)
+    setlocale(LC_TIME, options.str('k').c_str());
 
-  NFmiAreaFactory::return_type area;
+  if (has_option_T)
+    set_timezone(!has_option_t ? default_timezone : options.str('t'));
 
-  if (has_option_p)
-  {
-    int xc, yc, width, height;
-    has_center = true;
-    area = parse_named_geometry(options.find("p")->second, xc, yc, width, height);
-    cropped = crop_center(*cropped, xc, yc, width, height, xoff, yoff);
-    xm = xc - xoff;
-    ym = yc - yoff;
-  }
-  else if (has_option_l)
-  {
-    int xc, yc, width, height;
-    has_center = true;
-    area = parse_latlon_geometry(options.find("l")->second, xc, yc, width, height);
-    cropped = crop_center(*cropped, xc, yc, width, height, xoff, yoff);
-    xm = xc - xoff;
-    ym = yc - yoff;
-  }
-  else if (has_option_c)
-  {
-    int xc, yc, width, height;
-    has_center = true;
-    parse_center_geometry(options.find("c")->second, xc, yc, width, height);
-    cropped = crop_center(*cropped, xc, yc, width, height, xoff, yoff);
-    xm = xc - xoff;
-    ym = yc - yoff;
-  }
-  else if (has_option_g)
+  if (has_option_F)
   {
-    int x1, y1, width, height;
-    parse_geometry(options.find("g")->second, x1, y1, width, height);
-    cropped = crop_corner(*cropped, x1, y1, width, height, xoff, yoff);
+    string data;
+    {
+      StageTimer timer("render");
+      data = render_animation(frames, options);
+    }
+    http_output_data(data, imagefile, "image/png", outputcache);
+    metrics_count(AnimationRequests);
+    return 0;
   }
 
-  if (has_option_L)
-  {
-    if (area.get() == 0)
-      throw CropperException(400,
-                             "Cannot draw labels onto image without a "
-                             "projection obtained from cropping");
-    draw_labels(*cropped, *area, xoff, yoff, options.find("L")->second);
-  }
+  unique_ptr<Imagine::NFmiImage> image;
+  string imagetype;
 
-  if (has_option_T)
+  if (has_multiple_geometries(options))
   {
-    set_timezone(!has_option_t ? default_timezone : options.find("t")->second);
-    draw_timestamp(*cropped, options.find("T")->second, imagefile);
-  }
+    check_deadline("decode");
+    {
+      StageTimer timer("decode");
+      image.reset(new Imagine::NFmiImage(imagefile));
+    }
+    imagetype = image->Type();
 
-  if (has_option_I)
-  {
-    draw_image(*cropped, options.find("I")->second);
+    pmr::string data(RequestArena::current());
+    {
+      StageTimer timer("render");
+      data = render_multipart(*image, options, imagefile, imagetype);
+    }
+    http_output_data(data,
+                     imagefile,
+                     "multipart/mixed; boundary=" + multipart_boundary,
+                     outputcache);
+    metrics_count(MultipartRequests);
+    return 0;
   }
 
-  if (has_option_M && has_center)
-  {
-    draw_center(*cropped, options.find("M")->second, xm, ym);
-  }
+  // Downscaled requests start from the closest downscaled level of the source
 
-  if (has_option_Z)
-    reduce_colors(*cropped, options.find("Z")->second);
+  const int level = pyramid_level(imagefile, options);
+  const string sourcefile = (level > 0 ? pyramid_file(imagefile, level) : imagefile);
 
-  cropped->SaveAlpha(false);
-  if (has_option_A && options.find("A")->second != "0")
-    cropped->SaveAlpha(true);
+  // Decoration variants of the same crop share the undecorated raster
 
-  cropped->WantPalette(true);
+  CropInfo info;
+  image = raster_cache_load(options, sourcefile, info, imagetype);
+  info.scale = 1.0 / (1 << level);
 
-  if (has_option_z)
+  if (!image)
   {
-    int level = boost::lexical_cast<int>(options.find("z")->second);
-    if (imagetype == "png")
-      cropped->PngQuality(level);
-    else if (imagetype == "jpeg")
-      cropped->JpegQuality(level);
+    // Crop directly from a tiled store or a mapped sidecar if there is one
+
+    unique_ptr<Imagine::NFmiImage> cropped;
+    unique_ptr<TiledRaster> tiles;
+    unique_ptr<MappedRaster> raster;
+    check_deadline("decode");
+    {
+      StageTimer timer("decode");
+      tiles = TiledRaster::open(sourcefile);
+      if (!tiles)
+        raster = MappedRaster::open(sourcefile);
+    }
+
+    auto crop_source = [&](const auto &theSource)
+    {
+      imagetype = theSource.Type();
+      cropped = crop_image(theSource, options, info, level);
+      if (!cropped)
+        image = theSource.image();
+    };
+
+    if (tiles)
+      crop_source(*tiles);
+    else if (raster)
+      crop_source(*raster);
+    else
+    {
+      {
+        StageTimer timer("decode");
+        image.reset(new Imagine::NFmiImage(sourcefile));
+      }
+      imagetype = image->Type();
+      cropped = crop_image(*image, options, info, level);
+
+      // The stores are written after the response unless the source is decorated in place
+
+      auto create_store = [sourcefile](const Imagine::NFmiImage &theSource)
+      {
+        if (TiledRaster::active())
+          TiledRaster::create(sourcefile, theSource);
+        else
+          MappedRaster::create(sourcefile, theSource);
+      };
+
+      if (!cropped)
+        create_store(*image);
+      else
+      {
+        shared_ptr<const Imagine::NFmiImage> source(std::move(image));
+        defer_write([create_store, source]() { create_store(*source); });
+      }
+    }
+
+    if (cropped.get() != 0)
+    {
+      image = std::move(cropped);
+      raster_cache_store(options, sourcefile, *image, info, imagetype);
+    }
   }
 
-  http_output_image(*cropped, imagefile, imagetype, has_option_C);
+  unique_ptr<Imagine::NFmiImage> scaled = scale_image(*image, options, info);
+  if (scaled.get() != 0)
+    image = std::move(scaled);
+
+  decorate_image(*image, options, info, imagefile);
+  finish_image(*image, options, imagetype);
+
+  http_output_image(*image, imagefile, imagetype, outputcache);
+  finish_deferred_writes();
 
   return 0;
 }
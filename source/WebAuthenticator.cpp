@@ -25,9 +25,14 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <ctime>
 #include <fstream>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <vector>
+
+#include <sys/stat.h>
 
 using namespace std;
 
@@ -47,37 +52,180 @@ const std::string DEFAULT_SECRET_FILE = "/smartmet/cnf/cropper/auth.cnf";
 #define EXPIRATION_NAME "&exp="
 #define EXPIRATION_SIZE (sizeof(EXPIRATION_NAME) - 1)
 
+#include "CropperLog.h"
 #include "WebAuthenticator.h"
 #include "md5.h"
 
-std::string read_secret(const std::string& filename)
+// ----------------------------------------------------------------------
+/*!
+ * \brief The secret keys as precomputed MD5 states
+ *
+ * The digest is calculated from the secret followed by the query,
+ * hence the state after appending the secret can be computed once
+ * and copied for each query.
+ */
+// ----------------------------------------------------------------------
+struct WebKeyring
+{
+  std::vector<md5_state_t> keys;
+
+  // Identification of the secret file for detecting changes
+  time_t mtime = 0;
+  off_t size = 0;
+  ino_t inode = 0;
+};
+
+namespace
+{
+// How often the secret file is checked for changes in seconds
+const time_t KEYRING_CHECK_INTERVAL = 1;
+
+// Prefix of the lines holding old secrets still accepted during a rotation
+#define ACCEPT_NAME "accept:"
+#define ACCEPT_SIZE (sizeof(ACCEPT_NAME) - 1)
+
+md5_state_t keyed_state(const std::string& secret)
+{
+  md5_state_t state;
+  md5_init(&state);
+  md5_append(&state, (const md5_byte_t*)secret.c_str(), secret.length());
+  return state;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Read the secrets from the given file
+ *
+ * The first line is the secret used by the signers, as before. Old
+ * secrets still accepted during a rotation must be marked explicitly
+ * on later lines as
+ * \code
+ * accept:<secret>
+ * \endcode
+ * and all other lines are ignored, so notes or leftovers in an existing
+ * file never become valid keys.
+ */
+// ----------------------------------------------------------------------
+std::shared_ptr<WebKeyring> read_keyring(const std::string& filename)
 {
   std::ifstream in(filename.c_str());
   if (!in)
     throw std::runtime_error("Failed to open '" + filename + "' for reading");
-  std::string secret;
-  std::getline(in, secret);
-  return secret;
+
+  std::shared_ptr<WebKeyring> keyring(new WebKeyring);
+
+  std::string line;
+  if (!std::getline(in, line) || line.empty())
+    throw std::runtime_error("No secret found in '" + filename + "'");
+  keyring->keys.push_back(keyed_state(line));
+
+  while (std::getline(in, line))
+  {
+    if (line.compare(0, ACCEPT_SIZE, ACCEPT_NAME) == 0 && line.size() > ACCEPT_SIZE)
+      keyring->keys.push_back(keyed_state(line.substr(ACCEPT_SIZE)));
+  }
+
+  return keyring;
 }
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Constructors for Authenticator class
+ * \brief The keyring of the default secret file
  *
- * \param secret Secret key used in MD5 message digest calculation
+ * The keyring is shared by all instances and reloaded if the file
+ * has been modified or replaced.
+ */
+// ----------------------------------------------------------------------
+std::shared_ptr<const WebKeyring> default_keyring()
+{
+  static std::mutex mutex;
+  static std::shared_ptr<const WebKeyring> keyring;
+  static time_t last_check = 0;
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  const time_t now = time(nullptr);
+  if (keyring && now - last_check < KEYRING_CHECK_INTERVAL)
+    return keyring;
+  last_check = now;
+
+  struct stat st;
+  if (stat(DEFAULT_SECRET_FILE.c_str(), &st) == 0 && keyring && keyring->mtime == st.st_mtime &&
+      keyring->size == st.st_size && keyring->inode == st.st_ino)
+    return keyring;
+
+  std::shared_ptr<WebKeyring> newring = read_keyring(DEFAULT_SECRET_FILE);
+  if (stat(DEFAULT_SECRET_FILE.c_str(), &st) == 0)
+  {
+    newring->mtime = st.st_mtime;
+    newring->size = st.st_size;
+    newring->inode = st.st_ino;
+  }
+
+  if (keyring)
+    log_event("event=reload file=" + DEFAULT_SECRET_FILE +
+              " secrets=" + std::to_string(newring->keys.size()));
+
+  keyring = newring;
+  return keyring;
+}
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Test whether the digest of the keyed data matches the given one
+ *
+ * The comparison takes the same time regardless of where the digests
+ * differ, so the correct digest cannot be guessed byte by byte.
  */
 // ----------------------------------------------------------------------
-WebAuthenticator::WebAuthenticator(const std::string& secret) : md5_secret(secret) {}
+bool digest_matches(const md5_state_t& key,
+                    const char* data,
+                    std::size_t length,
+                    const char* digest,
+                    std::size_t digestlength)
+{
+  static const char hexdigits[] = "0123456789abcdef";
+
+  if (digestlength != 32)
+    return false;
+
+  md5_state_t state = key;
+  md5_byte_t md5_digest[16];
+  md5_append(&state, (const md5_byte_t*)data, length);
+  md5_finish(&state, md5_digest);
+
+  unsigned char diff = 0;
+  for (int di = 0; di < 16; ++di)
+  {
+    diff |= (hexdigits[md5_digest[di] >> 4] ^ digest[2 * di]);
+    diff |= (hexdigits[md5_digest[di] & 15] ^ digest[2 * di + 1]);
+  }
+  return diff == 0;
+}
+
+}  // namespace
 
 // ----------------------------------------------------------------------
 /*!
- * \brief Constructors for Authenticator class using \a DEFAULT secret key
+ * \brief Constructors for Authenticator class
+ *
+ * \param secret Secret key used in MD5 message digest calculation
  */
 // ----------------------------------------------------------------------
-WebAuthenticator::WebAuthenticator()
+WebAuthenticator::WebAuthenticator(const std::string& secret)
 {
-  md5_secret = read_secret(DEFAULT_SECRET_FILE);
+  std::shared_ptr<WebKeyring> keyring(new WebKeyring);
+  keyring->keys.push_back(keyed_state(secret));
+  md5_keyring = keyring;
 }
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Constructors for Authenticator class using \a DEFAULT secret keys
+ */
+// ----------------------------------------------------------------------
+WebAuthenticator::WebAuthenticator() : md5_keyring(default_keyring()) {}
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Destructor for Authenticator class
@@ -106,9 +254,15 @@ bool WebAuthenticator::isValidQuery(const std::string& query)
     return false;
   }
 
-  // Compare the MD5 digests
-  if (WebAuthenticator::MD5Digest(md5_secret, query.substr(0, md5_pos)) !=
-      query.substr(md5_pos + MD5_DIGEST_SIZE, query.length()))
+  // Compare the MD5 digests against all the accepted secrets
+  const char* digest = query.c_str() + md5_pos + MD5_DIGEST_SIZE;
+  const std::size_t digest_length = query.length() - md5_pos - MD5_DIGEST_SIZE;
+
+  bool valid = false;
+  for (const md5_state_t& key : md5_keyring->keys)
+    valid |= digest_matches(key, query.c_str(), md5_pos, digest, digest_length);
+
+  if (!valid)
   {
     // MD5 digests didn't match -- QUERY HAS BEEN TAMPERED WITH
     return false;